@@ -0,0 +1,233 @@
+#include "evaluation.h"
+#include "program.h"
+#include "vmath.h"
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#ifndef NAN
+	#define NAN (0.0/0.0)
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define MCALC_X86 1
+	#include <immintrin.h>
+#endif
+
+/* Rows are evaluated in blocks, each stack entry of the program holds one column of a block. */
+#define BLOCK 256
+
+typedef struct kernels {
+	void (*add)(double *a, const double *b, size_t n);
+	void (*sub)(double *a, const double *b, size_t n);
+	void (*mul)(double *a, const double *b, size_t n);
+	void (*div)(double *a, const double *b, size_t n);
+	void (*neg)(double *a, size_t n);
+} kernels;
+
+/* Portable kernels, also used for the tail of the SIMD loops. */
+static void add_scalar(double *a, const double *b, size_t n) {size_t i; for (i = 0; i < n; i++) a[i] += b[i];}
+static void sub_scalar(double *a, const double *b, size_t n) {size_t i; for (i = 0; i < n; i++) a[i] -= b[i];}
+static void mul_scalar(double *a, const double *b, size_t n) {size_t i; for (i = 0; i < n; i++) a[i] *= b[i];}
+static void div_scalar(double *a, const double *b, size_t n) {size_t i; for (i = 0; i < n; i++) a[i] /= b[i];}
+static void neg_scalar(double *a, size_t n) {size_t i; for (i = 0; i < n; i++) a[i] = -a[i];}
+
+static const kernels scalar_kernels = {add_scalar, sub_scalar, mul_scalar, div_scalar, neg_scalar};
+
+#ifdef MCALC_X86
+#define SSE2_KERNEL(NAME, OP) \
+	__attribute__((target("sse2"))) static void NAME##_sse2(double *a, const double *b, size_t n) { \
+		size_t i = 0; \
+		for (; i + 2 <= n; i += 2) _mm_storeu_pd(a + i, OP(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i))); \
+		NAME##_scalar(a + i, b + i, n - i); \
+	}
+#define AVX2_KERNEL(NAME, OP) \
+	__attribute__((target("avx2"))) static void NAME##_avx2(double *a, const double *b, size_t n) { \
+		size_t i = 0; \
+		for (; i + 4 <= n; i += 4) _mm256_storeu_pd(a + i, OP(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i))); \
+		NAME##_scalar(a + i, b + i, n - i); \
+	}
+
+SSE2_KERNEL(add, _mm_add_pd)
+SSE2_KERNEL(sub, _mm_sub_pd)
+SSE2_KERNEL(mul, _mm_mul_pd)
+SSE2_KERNEL(div, _mm_div_pd)
+
+__attribute__((target("sse2"))) static void neg_sse2(double *a, size_t n) {
+	const __m128d sign = _mm_set1_pd(-0.0);
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2) _mm_storeu_pd(a + i, _mm_xor_pd(_mm_loadu_pd(a + i), sign));
+	neg_scalar(a + i, n - i);
+}
+
+AVX2_KERNEL(add, _mm256_add_pd)
+AVX2_KERNEL(sub, _mm256_sub_pd)
+AVX2_KERNEL(mul, _mm256_mul_pd)
+AVX2_KERNEL(div, _mm256_div_pd)
+
+__attribute__((target("avx2"))) static void neg_avx2(double *a, size_t n) {
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) _mm256_storeu_pd(a + i, _mm256_xor_pd(_mm256_loadu_pd(a + i), sign));
+	neg_scalar(a + i, n - i);
+}
+
+static const kernels sse2_kernels = {add_sse2, sub_sse2, mul_sse2, div_sse2, neg_sse2};
+static const kernels avx2_kernels = {add_avx2, sub_avx2, mul_avx2, div_avx2, neg_avx2};
+#endif
+
+static const kernels *select_kernels(void) {
+#ifdef MCALC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return &avx2_kernels;
+	if (__builtin_cpu_supports("sse2")) return &sse2_kernels;
+#endif
+	return &scalar_kernels;
+}
+
+#define MCALC_FUN(...) ((double(*)(__VA_ARGS__))op->function)
+#define FOR_ROWS for (i = 0; i < n; i++)
+
+typedef double column[BLOCK];
+
+typedef struct block {
+	const mcalc_program *p;
+	const kernels *k;
+	const double *const *sources; /* sources[i] is the column read by the i-th instruction when it is a bound variable, or 0. */
+	column *slots;
+	unsigned short *lanes; /* 2 * BLOCK per level of nested branches. */
+	size_t row;
+} block;
+
+static void run_block(const block *b, column *top, int from, int to, const unsigned short *rows, size_t n, int level) {
+	/* Runs code[from, to) on n rows, pushing above `top`. Lane i is row rows[i] of the block, or row i
+	 * without `rows`. When the lanes disagree on a jump, each side runs on its own lanes only. */
+	const mcalc_program *p = b->p;
+	const kernels *k = b->k;
+	column *const slots = b->slots;
+	int pc;
+	size_t i;
+	for (pc = from; pc < to; pc++) {
+		const mcalc_op *op = p->code + pc;
+		mcalc_vmath_unary unary;
+		mcalc_vmath_binary binary;
+		double *a;
+		switch (op->code) {
+			case OP_CONSTANT: a = *++top; FOR_ROWS a[i] = op->value; break;
+			case OP_VARIABLE:
+				a = *++top;
+				if (b->sources[pc]) {
+					const double *source = b->sources[pc] + b->row;
+					if (rows) FOR_ROWS a[i] = source[rows[i]];
+					else memcpy(a, source, n * sizeof(double));
+				} else {
+					const double value = *op->bound;
+					FOR_ROWS a[i] = value;
+				}
+				break;
+			case OP_ADD: --top; k->add(top[0], top[1], n); break;
+			case OP_SUB: --top; k->sub(top[0], top[1], n); break;
+			case OP_MUL: --top; k->mul(top[0], top[1], n); break;
+			case OP_DIV: --top; k->div(top[0], top[1], n); break;
+			case OP_NEG: k->neg(top[0], n); break;
+			case OP_COMMA: --top; memcpy(top[0], top[1], n * sizeof(double)); break;
+			case OP_STORE:
+				if (rows) FOR_ROWS slots[op->slot][rows[i]] = top[0][i];
+				else memcpy(slots[op->slot], top[0], n * sizeof(double));
+				break;
+			case OP_LOAD:
+				++top;
+				if (rows) FOR_ROWS top[0][i] = slots[op->slot][rows[i]];
+				else memcpy(top[0], slots[op->slot], n * sizeof(double));
+				break;
+			case OP_SELECT: top -= 2; FOR_ROWS top[0][i] = top[0][i] != 0 ? top[1][i] : top[2][i]; break;
+			case OP_JUMP_ZERO: {
+				/* c JUMP_ZERO(else) a JUMP(end) else: b end: */
+				unsigned short *const lanes = b->lanes + 2 * BLOCK * level, *const sub = lanes + BLOCK;
+				const int end = p->code[op->target - 1].target;
+				size_t taken = 0, skipped = n, j;
+				a = *top--;
+				/* The lanes taking `a` from the front, the others from the back. */
+				FOR_ROWS if (a[i] != 0) lanes[taken++] = i; else lanes[--skipped] = i;
+				if (!taken) pc = op->target - 1;
+				if (!taken || taken == n) break;
+				for (j = 0; j < taken; j++) sub[j] = rows ? rows[lanes[j]] : lanes[j];
+				run_block(b, top, pc + 1, op->target - 1, sub, taken, level + 1);
+				/* Spread out in place, backwards since lanes[j] >= j. */
+				for (j = taken; j-- > 0;) top[1][lanes[j]] = top[1][j];
+				for (j = 0; j < n - taken; j++) sub[j] = rows ? rows[lanes[n - 1 - j]] : lanes[n - 1 - j];
+				run_block(b, top + 1, op->target, end, sub, n - taken, level + 1);
+				for (j = 0; j < n - taken; j++) top[1][lanes[n - 1 - j]] = top[2][j];
+				++top;
+				pc = end - 1;
+				break;
+			}
+			case OP_JUMP: pc = op->target - 1; break;
+			case OP_CALL0 + 0: a = *++top; FOR_ROWS a[i] = MCALC_FUN(void)(); break;
+			case OP_CALL0 + 1:
+				a = top[0];
+				if ((unary = mcalc_vmath_unary_column(op->function))) unary(a, n);
+				else FOR_ROWS a[i] = MCALC_FUN(double)(a[i]);
+				break;
+			case OP_CALL0 + 2:
+				top -= 1;
+				if ((binary = mcalc_vmath_binary_column(op->function))) binary(top[0], top[1], n);
+				else FOR_ROWS top[0][i] = MCALC_FUN(double, double)(top[0][i], top[1][i]);
+				break;
+			case OP_CALL0 + 3: top -= 2; FOR_ROWS top[0][i] = MCALC_FUN(double, double, double)(top[0][i], top[1][i], top[2][i]); break;
+			case OP_CALL0 + 4: top -= 3; FOR_ROWS top[0][i] = MCALC_FUN(double, double, double, double)(top[0][i], top[1][i], top[2][i], top[3][i]); break;
+			case OP_CALL0 + 5: top -= 4; FOR_ROWS top[0][i] = MCALC_FUN(double, double, double, double, double)(top[0][i], top[1][i], top[2][i], top[3][i], top[4][i]); break;
+			case OP_CALL0 + 6: top -= 5; FOR_ROWS top[0][i] = MCALC_FUN(double, double, double, double, double, double)(top[0][i], top[1][i], top[2][i], top[3][i], top[4][i], top[5][i]); break;
+			case OP_CALL0 + 7: top -= 6; FOR_ROWS top[0][i] = MCALC_FUN(double, double, double, double, double, double, double)(top[0][i], top[1][i], top[2][i], top[3][i], top[4][i], top[5][i], top[6][i]); break;
+			case OP_CLOSURE0 + 0: a = *++top; FOR_ROWS a[i] = MCALC_FUN(void*)(op->context); break;
+			case OP_CLOSURE0 + 1: a = top[0]; FOR_ROWS a[i] = MCALC_FUN(void*, double)(op->context, a[i]); break;
+			case OP_CLOSURE0 + 2: top -= 1; FOR_ROWS top[0][i] = MCALC_FUN(void*, double, double)(op->context, top[0][i], top[1][i]); break;
+			case OP_CLOSURE0 + 3: top -= 2; FOR_ROWS top[0][i] = MCALC_FUN(void*, double, double, double)(op->context, top[0][i], top[1][i], top[2][i]); break;
+			case OP_CLOSURE0 + 4: top -= 3; FOR_ROWS top[0][i] = MCALC_FUN(void*, double, double, double, double)(op->context, top[0][i], top[1][i], top[2][i], top[3][i]); break;
+			case OP_CLOSURE0 + 5: top -= 4; FOR_ROWS top[0][i] = MCALC_FUN(void*, double, double, double, double, double)(op->context, top[0][i], top[1][i], top[2][i], top[3][i], top[4][i]); break;
+			case OP_CLOSURE0 + 6: top -= 5; FOR_ROWS top[0][i] = MCALC_FUN(void*, double, double, double, double, double, double)(op->context, top[0][i], top[1][i], top[2][i], top[3][i], top[4][i], top[5][i]); break;
+			case OP_CLOSURE0 + 7: top -= 6; FOR_ROWS top[0][i] = MCALC_FUN(void*, double, double, double, double, double, double, double)(op->context, top[0][i], top[1][i], top[2][i], top[3][i], top[4][i], top[5][i], top[6][i]); break;
+		}
+	}
+}
+#undef MCALC_FUN
+#undef FOR_ROWS
+
+int mcalc_run_batch(const mcalc_program *p, const mcalc_variable *variables, const double *const *columns, int count, double *out, size_t rows) {
+	size_t row;
+	int pc, j;
+	block b;
+	if (!p) {
+		for (row = 0; row < rows; row++) out[row] = NAN;
+		return 0;
+	}
+	/* One allocation per call: the block-wide value stack with a column more for each level of
+	 * nested branches, the slots, the column map and the lane lists of the branches. */
+	const size_t columns_size = sizeof(column) * (p->depth + p->branches + p->slots);
+	column *stack = malloc(columns_size + sizeof(double*) * p->length + sizeof(unsigned short) * 2 * BLOCK * p->branches);
+	if (!stack) return -1;
+	const double **sources = (const double **)((char *)stack + columns_size);
+	for (pc = 0; pc < p->length; pc++) {
+		sources[pc] = 0;
+		if (p->code[pc].code != OP_VARIABLE) continue;
+		for (j = 0; j < count; j++) {
+			if (variables[j].address == p->code[pc].bound) {
+				sources[pc] = columns[j];
+				break;
+			}
+		}
+	}
+	b.p = p;
+	b.k = select_kernels();
+	b.sources = sources;
+	b.slots = stack + p->depth + p->branches;
+	b.lanes = (unsigned short *)(sources + p->length);
+	for (row = 0; row < rows; row += BLOCK) {
+		const size_t n = rows - row < BLOCK ? rows - row : BLOCK;
+		b.row = row;
+		run_block(&b, stack - 1, 0, p->length, 0, n, 0);
+		memcpy(out + row, stack[0], n * sizeof(double));
+	}
+	free(stack);
+	return 0;
+}
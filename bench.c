@@ -0,0 +1,344 @@
+/*
+** Compares the tree walker (mcalc_eval) with the flat program (mcalc_run)
+** and its native code (mcalc_jit_call). Then measures the kernels of vmath.c:
+** their worst error against the long double libm on random arguments, their
+** cost against libm's, and whole formulas over columns (mcalc_run_batch) at
+** each accuracy. Last, what reading a formula costs: parsing it against
+** checking and evaluating its blob (mcalc_blob_write).
+** Exits with 1 when a kernel is off by more than the ulp it promises, or when
+** its column version doesn't give the same bits as one row at a time.
+**
+** gcc -O2 -o bench bench.c evaluation.c batch.c jit.c stats.c vmath.c blob.c -lm
+** ./bench [iterations]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "evaluation.h"
+#include "vmath.h"
+
+static double x, y, z;
+
+static const mcalc_variable variables[] = {
+	{"x", &x, MCALC_VARIABLE, 0},
+	{"y", &y, MCALC_VARIABLE, 0},
+	{"z", &z, MCALC_VARIABLE, 0},
+};
+
+static const char *formulas[] = {
+	"x+1",
+	"x*y+z",
+	"(x+y)*(x-y)/(z+1)",
+	"sqrt(x^2+y^2+z^2)",
+	"sin(x)*cos(y)+tan(z/10)",
+	"((((x+1)*2-y)/3+z)*4-x)/5+((y-z)*(x+y)-(z*x))",
+	"x*y*z+x*y+y*z+x*z+x+y+z+1",
+	"x<512 ? x*y : z-x",
+	"if(x>100 && z>1, sqrt(x)*ln(x), exp(y)*z)",
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t seed = 88172645463325252ull;
+
+static double uniform(double low, double high) {
+	seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+	return low + (high - low) * ((seed >> 11) * 0x1p-53);
+}
+
+/* Distance from the exact value in units of the last place of its double. */
+static double ulps(double value, long double exact) {
+	int exponent;
+	if (value == (double)exact || (isnan(value) && isnan(exact))) return 0;
+	if (!isfinite(value) || !isfinite((double)exact)) return INFINITY;
+	frexpl(exact, &exponent);
+	return (double)(fabsl(value - exact) / ldexpl(1.0L, exponent - 53 < -1074 ? -1074 : exponent - 53));
+}
+
+typedef struct kernel {
+	const char *name;
+	double (*libm)(double);
+	long double (*exact)(long double);
+	double (*kernel)(double);
+	double low, high;
+	int logarithmic; /* Arguments uniform in log(x) rather than in x. */
+	double bound; /* Promised error in ulp, see vmath.h. */
+} kernel;
+
+static const kernel kernels[] = {
+	{"exp", exp, expl, mcalc_vmath_exp, -708, 708, 0, 1},
+	{"ln", log, logl, mcalc_vmath_log, -700, 700, 1, 1},
+	{"log10", log10, log10l, mcalc_vmath_log10, -700, 700, 1, 4},
+	{"sin", sin, sinl, mcalc_vmath_sin, -1e6, 1e6, 0, 1},
+	{"sin", sin, sinl, mcalc_vmath_sin, -10, 10, 0, 1},
+	{"cos", cos, cosl, mcalc_vmath_cos, -10, 10, 0, 1},
+	{"tan", tan, tanl, mcalc_vmath_tan, -10, 10, 0, 4},
+	{"sinh", sinh, sinhl, mcalc_vmath_sinh, -5, 5, 0, 4},
+	{"cosh", cosh, coshl, mcalc_vmath_cosh, -5, 5, 0, 4},
+	{"tanh", tanh, tanhl, mcalc_vmath_tanh, -5, 5, 0, 4},
+};
+
+#define KERNEL_ROWS 4096
+#define KERNEL_ROUNDS 256
+
+/* Arguments outside every kernel's domain, which the column kernels recompute with libm. */
+static const double special[] = {0.0, -0.0, 1.0, -1.0, 800, -800, 1e300, -1e300, 1e-320, INFINITY, -INFINITY, NAN};
+#define SPECIALS (int)(sizeof(special) / sizeof(special[0]))
+
+/* Counts the rows where a[i] and b[i] differ in any bit. */
+static int differences(const double *a, const double *b, int n) {
+	int i, count = 0;
+	for (i = 0; i < n; i++) count += memcmp(a + i, b + i, sizeof(double)) != 0;
+	return count;
+}
+
+static int bench_kernels(void) {
+	static double in[KERNEL_ROWS], column[KERNEL_ROWS], other[KERNEL_ROWS], rows[KERNEL_ROWS];
+	size_t k;
+	int i, round, failed = 0;
+	printf("\n%-24s %10s %10s %12s %12s %12s\n", "kernel", "max ulp", "libm ulp", "libm ns", "row ns", "column ns");
+	for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		const kernel *f = kernels + k;
+		const mcalc_vmath_unary column_kernel = mcalc_vmath_unary_column(f->kernel);
+		double worst = 0, worst_libm = 0;
+		char label[64];
+		for (i = 0; i < (1 << 20); i++) {
+			double x = uniform(f->low, f->high);
+			if (f->logarithmic) x = exp(x);
+			const long double exact = f->exact(x);
+			const double error = ulps(f->kernel(x), exact), error_libm = ulps(f->libm(x), exact);
+			if (error > worst) worst = error;
+			if (error_libm > worst_libm) worst_libm = error_libm;
+		}
+		for (i = 0; i < KERNEL_ROWS; i++) in[i] = f->logarithmic ? exp(uniform(f->low, f->high)) : uniform(f->low, f->high);
+		memcpy(in, special, sizeof(special));
+		for (i = 0; i < KERNEL_ROWS; i++) rows[i] = f->kernel(in[i]);
+		memcpy(column, in, sizeof(in));
+		column_kernel(column, KERNEL_ROWS);
+		const int different = differences(rows, column, KERNEL_ROWS);
+		volatile double sink = 0;
+		double start = now();
+		for (round = 0; round < KERNEL_ROUNDS; round++) for (i = 0; i < KERNEL_ROWS; i++) sink += f->libm(in[i]);
+		const double libm = (now() - start) / (KERNEL_ROUNDS * KERNEL_ROWS);
+		start = now();
+		for (round = 0; round < KERNEL_ROUNDS; round++) for (i = 0; i < KERNEL_ROWS; i++) sink += f->kernel(in[i]);
+		const double row = (now() - start) / (KERNEL_ROUNDS * KERNEL_ROWS);
+		start = now();
+		for (round = 0; round < KERNEL_ROUNDS; round++) {
+			for (i = 0; i < KERNEL_ROWS; i++) column[i] = in[i];
+			column_kernel(column, KERNEL_ROWS);
+		}
+		const double columns = (now() - start) / (KERNEL_ROUNDS * KERNEL_ROWS);
+		snprintf(label, sizeof(label), "%s [%g, %g]%s", f->name, f->low, f->high, f->logarithmic ? " log" : "");
+		printf("%-24s %10.3f %10.3f %12.2f %12.2f %12.2f\n", label, worst, worst_libm, libm, row, columns);
+		if (worst >= f->bound) {
+			fprintf(stderr, "%s: %.3f ulp, promised under %g\n", label, worst, f->bound);
+			failed = 1;
+		}
+		if (different) {
+			fprintf(stderr, "%s: the column kernel differs from the row kernel on %d of %d rows\n", label, different, KERNEL_ROWS);
+			failed = 1;
+		}
+	}
+	/* pow: x in [1e-3, 1e3] and y in [-50, 50] */
+	{
+		double worst = 0, worst_libm = 0;
+		for (i = 0; i < (1 << 20); i++) {
+			const double a = exp(uniform(-6.9, 6.9)), b = uniform(-50, 50);
+			const long double exact = powl(a, b);
+			const double error = ulps(mcalc_vmath_pow(a, b), exact), error_libm = ulps(pow(a, b), exact);
+			if (error > worst) worst = error;
+			if (error_libm > worst_libm) worst_libm = error_libm;
+		}
+		for (i = 0; i < KERNEL_ROWS; i++) {
+			in[i] = exp(uniform(-6.9, 6.9));
+			other[i] = uniform(-50, 50);
+		}
+		/* Every pair of special arguments, then specials against ordinary ones both ways. */
+		for (i = 0; i < SPECIALS * SPECIALS; i++) {
+			in[i] = special[i / SPECIALS];
+			other[i] = special[i % SPECIALS];
+		}
+		for (i = 0; i < SPECIALS; i++) {
+			in[SPECIALS * SPECIALS + i] = special[i];
+			other[SPECIALS * SPECIALS + SPECIALS + i] = special[i];
+		}
+		const mcalc_vmath_binary column_kernel = mcalc_vmath_binary_column(mcalc_vmath_pow);
+		for (i = 0; i < KERNEL_ROWS; i++) rows[i] = mcalc_vmath_pow(in[i], other[i]);
+		memcpy(column, in, sizeof(in));
+		column_kernel(column, other, KERNEL_ROWS);
+		const int different = differences(rows, column, KERNEL_ROWS);
+		volatile double sink = 0;
+		double start = now();
+		for (round = 0; round < KERNEL_ROUNDS; round++) for (i = 0; i < KERNEL_ROWS; i++) sink += pow(in[i], other[i]);
+		const double libm = (now() - start) / (KERNEL_ROUNDS * KERNEL_ROWS);
+		start = now();
+		for (round = 0; round < KERNEL_ROUNDS; round++) for (i = 0; i < KERNEL_ROWS; i++) sink += mcalc_vmath_pow(in[i], other[i]);
+		const double row = (now() - start) / (KERNEL_ROUNDS * KERNEL_ROWS);
+		start = now();
+		for (round = 0; round < KERNEL_ROUNDS; round++) {
+			for (i = 0; i < KERNEL_ROWS; i++) column[i] = in[i];
+			column_kernel(column, other, KERNEL_ROWS);
+		}
+		const double columns = (now() - start) / (KERNEL_ROUNDS * KERNEL_ROWS);
+		printf("%-24s %10.3f %10.3f %12.2f %12.2f %12.2f\n", "pow [1e-3, 1e3]^[-50, 50]", worst, worst_libm, libm, row, columns);
+		if (worst >= 4) {
+			fprintf(stderr, "pow: %.3f ulp, promised under 4\n", worst);
+			failed = 1;
+		}
+		if (different) {
+			fprintf(stderr, "pow: the column kernel differs from the row kernel on %d of %d rows\n", different, KERNEL_ROWS);
+			failed = 1;
+		}
+	}
+	return failed;
+}
+
+static const char *batch_formulas[] = {
+	"sin(x)*cos(y)+exp(-z)",
+	"ln(x+1)*tanh(y)-sqrt(z)",
+	"pow(x+1,y)/cosh(z/10)",
+	"x<5 ? sin(x)*cos(y) : exp(-z)",
+};
+
+static void bench_batch(void) {
+	static const struct {const char *name; int flags;} accuracies[] = {
+		{"libm", 0}, {"ulp1", MCALC_MATH_ULP1}, {"ulp4", MCALC_MATH_ULP4},
+	};
+	static double xs[KERNEL_ROWS], ys[KERNEL_ROWS], zs[KERNEL_ROWS], out[KERNEL_ROWS];
+	const double *columns[] = {xs, ys, zs};
+	size_t f, a;
+	int i, round;
+	for (i = 0; i < KERNEL_ROWS; i++) {
+		xs[i] = uniform(0, 10);
+		ys[i] = uniform(-2, 2);
+		zs[i] = uniform(0, 5);
+	}
+	printf("\n%-50s %8s %12s %12s\n", "formula", "accuracy", "run ns/row", "batch ns/row");
+	for (f = 0; f < sizeof(batch_formulas) / sizeof(batch_formulas[0]); f++) {
+		for (a = 0; a < sizeof(accuracies) / sizeof(accuracies[0]); a++) {
+			mcalc_options options = {0};
+			int error;
+			options.flags = accuracies[a].flags;
+			mcalc_expr *n = mcalc_compile_ex(batch_formulas[f], strlen(batch_formulas[f]), variables, 3, &options, &error);
+			mcalc_program *p = mcalc_assemble(n);
+			volatile double sink = 0;
+			double start = now();
+			for (round = 0; round < KERNEL_ROUNDS; round++) {
+				for (i = 0; i < KERNEL_ROWS; i++) {
+					x = xs[i]; y = ys[i]; z = zs[i];
+					sink += mcalc_run(p);
+				}
+			}
+			const double row = (now() - start) / (KERNEL_ROUNDS * KERNEL_ROWS);
+			start = now();
+			for (round = 0; round < KERNEL_ROUNDS; round++) mcalc_run_batch(p, variables, columns, 3, out, KERNEL_ROWS);
+			const double batch = (now() - start) / (KERNEL_ROUNDS * KERNEL_ROWS);
+			printf("%-50s %8s %12.2f %12.2f\n", batch_formulas[f], accuracies[a].name, row, batch);
+			mcalc_program_free(p);
+			mcalc_free(n);
+		}
+	}
+}
+
+static void bench_blob(long iterations) {
+	double inputs[3];
+	const mcalc_variable bound[] = {
+		{"x", inputs, MCALC_VARIABLE, 0},
+		{"y", inputs + 1, MCALC_VARIABLE, 0},
+		{"z", inputs + 2, MCALC_VARIABLE, 0},
+	};
+	unsigned char blob[4096];
+	size_t i;
+	long j;
+	printf("\n%-50s %8s %12s %12s %12s %12s\n", "formula", "bytes", "compile ns", "check ns", "blob ns/op", "run ns/op");
+	for (i = 0; i < sizeof(formulas) / sizeof(formulas[0]); i++) {
+		int error;
+		mcalc_expr *n = mcalc_compile(formulas[i], bound, 3, &error);
+		mcalc_program *p = mcalc_assemble(n);
+		const long size = mcalc_blob_write(p, inputs, 3, blob, sizeof(blob));
+		const long rounds = iterations / 100;
+		volatile double sink = 0;
+		double start = now();
+		for (j = 0; j < rounds; j++) {
+			mcalc_expr *copy = mcalc_compile(formulas[i], bound, 3, &error);
+			mcalc_program *program = mcalc_assemble(copy);
+			sink += mcalc_program_pure(program);
+			mcalc_program_free(program);
+			mcalc_free(copy);
+		}
+		const double compile = (now() - start) / rounds;
+		start = now();
+		for (j = 0; j < rounds; j++) sink += mcalc_blob_check(blob, size, 3);
+		const double check = (now() - start) / rounds;
+		start = now();
+		for (j = 0; j < iterations; j++) {
+			inputs[0] = j & 1023; inputs[1] = 0.5; inputs[2] = 3;
+			sink += mcalc_blob_eval(blob, size, inputs);
+		}
+		const double blob_ns = (now() - start) / iterations;
+		start = now();
+		for (j = 0; j < iterations; j++) {
+			inputs[0] = j & 1023; inputs[1] = 0.5; inputs[2] = 3;
+			sink += mcalc_run(p);
+		}
+		const double run = (now() - start) / iterations;
+		printf("%-50s %8ld %12.2f %12.2f %12.2f %12.2f\n", formulas[i], size, compile, check, blob_ns, run);
+		mcalc_program_free(p);
+		mcalc_free(n);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	const long iterations = argc > 1 ? atol(argv[1]) : 5000000;
+	size_t i;
+	long j;
+	int failed;
+	printf("%-50s %12s %12s %12s %8s\n", "formula", "eval ns/op", "run ns/op", "jit ns/op", "speedup");
+	for (i = 0; i < sizeof(formulas) / sizeof(formulas[0]); i++) {
+		int error;
+		mcalc_expr *n = mcalc_compile(formulas[i], variables, 3, &error);
+		mcalc_program *p = mcalc_assemble(n);
+		mcalc_jit *jit = mcalc_jit_compile(p);
+		if (!jit) {
+			fprintf(stderr, "%s: error at %d\n", formulas[i], error);
+			return 1;
+		}
+		volatile double sink = 0;
+		double start = now();
+		for (j = 0; j < iterations; j++) {
+			x = j & 1023; y = 0.5; z = 3;
+			sink += mcalc_eval(n);
+		}
+		const double tree = (now() - start) / iterations;
+		start = now();
+		for (j = 0; j < iterations; j++) {
+			x = j & 1023; y = 0.5; z = 3;
+			sink += mcalc_run(p);
+		}
+		const double flat = (now() - start) / iterations;
+		start = now();
+		for (j = 0; j < iterations; j++) {
+			x = j & 1023; y = 0.5; z = 3;
+			sink += mcalc_jit_call(jit);
+		}
+		const double native = (now() - start) / iterations;
+		printf("%-50s %12.2f %12.2f %12.2f %7.2fx\n", formulas[i], tree, flat, native, tree / native);
+		mcalc_jit_free(jit);
+		mcalc_program_free(p);
+		mcalc_free(n);
+	}
+	failed = bench_kernels();
+	bench_batch();
+	bench_blob(iterations);
+	return failed;
+}
@@ -0,0 +1,659 @@
+/*
+** Benchmark suite for the library and the UDFs that runs without a MySQL
+** server: udf_stub/mysql.h stands in for the server's header and the UDFs
+** are called the way mysqld calls them.
+**
+** gcc -O2 -c evaluation.c batch.c jit.c stats.c vmath.c blob.c
+** g++ -O2 -std=c++11 -Iudf_stub -o bench_udf bench_udf.cc mcalc.cc cache.cc definitions.cc evaluation.o batch.o jit.o stats.o vmath.o blob.o -lm -lpthread
+** ./bench_udf [--json] [--stats] [--time ms] [--threads n]
+**
+** Every formula of the corpus is measured in ns/op and allocations/op for:
+**   compile     mcalc_compile + mcalc_free
+**   eval        mcalc_eval on a compiled tree
+**   interp      mcalc_interp (formulas without variables only)
+**   udf_row     mcalc() on a constant formula, mcalc_init done once
+**   udf_memo    the same with mcalc_memo(), over 1024 distinct rows
+**   udf_column  mcalc() on a formula coming from a column (cache hit)
+**   udf_query   mcalc_init + one mcalc() + mcalc_deinit
+**   fixed       the formula's MCALC_FIXED function (mcalc_fixed.h) called directly
+**   udf_fixed   mcalc_fixed() on it, mcalc_fixed_init done once
+** then the whole corpus is run from 1, 2, 4, ... threads to show how each
+** operation scales. It first checks that the fixed formulas give the bits
+** of the parsed ones and that formulas MCALC_MAX_DEPTH deep run on a 256 KiB
+** thread stack. --json prints the same numbers as one JSON object,
+** --stats measures with the runtime statistics (stats.h) switched on.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "evaluation.h"
+#include "mcalc_fixed.h"
+#include "mysql.h"
+#include "stats.h"
+
+extern "C" bool mcalc_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+extern "C" void mcalc_deinit(UDF_INIT *initid);
+extern "C" double mcalc(UDF_INIT *initid, UDF_ARGS *args, unsigned char *is_null, unsigned char *error);
+extern "C" bool mcalc_memo_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+extern "C" bool mcalc_fixed_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+extern "C" void mcalc_fixed_deinit(UDF_INIT *initid);
+extern "C" double mcalc_fixed(UDF_INIT *initid, UDF_ARGS *args, unsigned char *is_null, unsigned char *error);
+
+// Counts heap allocations of the calling thread by wrapping glibc's allocator.
+#ifdef __GLIBC__
+	extern "C" void *__libc_malloc(size_t size);
+	extern "C" void *__libc_calloc(size_t count, size_t size);
+	extern "C" void *__libc_realloc(void *pointer, size_t size);
+	extern "C" void __libc_free(void *pointer);
+
+	static __thread unsigned long long allocations;
+
+	extern "C" void *malloc(size_t size) {
+		allocations++;
+		return __libc_malloc(size);
+	}
+	extern "C" void *calloc(size_t count, size_t size) {
+		allocations++;
+		return __libc_calloc(count, size);
+	}
+	extern "C" void *realloc(void *pointer, size_t size) {
+		if (!pointer) allocations++;
+		return __libc_realloc(pointer, size);
+	}
+	extern "C" void free(void *pointer) {
+		__libc_free(pointer);
+	}
+
+	#define COUNTS_ALLOCATIONS 1
+#else
+	static unsigned long long allocations;
+	#define COUNTS_ALLOCATIONS 0
+#endif
+
+enum {VARIABLES = 16};
+
+static const char *names[VARIABLES] = {
+	"x1", "x2", "x3", "x4", "x5", "x6", "x7", "x8",
+	"x9", "x10", "x11", "x12", "x13", "x14", "x15", "x16",
+};
+
+struct formula {
+	const char *group;
+	const char *text;
+	int variables; // Uses x1 ... xN.
+	const char *fixed; // Name of the same formula in MCALC_FIXED below.
+};
+
+static const formula corpus[] = {
+	{"literal", "1", 0, "one"},
+	{"literal", "5+5*2/2", 0, "literal_arithmetic"},
+	{"literal", "2^10-pi*e", 0, "literal_constants"},
+	{"nested", "(((((((1+2)*3-4)/5+6)*7-8)/9+10)*11-12)/13+14)", 0, "nested_literals"},
+	{"nested", "((((x1+1)*2-x2)/3+x3)*4-x1)/5+((x2-x3)*(x1+x2)-(x3*x1))", 3, "nested_variables"},
+	{"nested", "-(-(-(-(-(-(x1+x2)*x3)/x4)+x1)*x2)/x3)+x4", 4, "nested_negations"},
+	{"variables", "x1+x2+x3+x4+x5+x6+x7+x8", 8, "sum8"},
+	{"variables", "(x1-x2)*(x3-x4)/(x5+x6+1)", 6, "ratio6"},
+	{"variables", "x1*x2+x3*x4+x5*x6+x7*x8+x9*x10+x11*x12+x13*x14+x15*x16", 16, "dot16"},
+	{"transcendental", "sin(x1)*cos(x2)+tan(x3/10)", 3, "trigonometric"},
+	{"transcendental", "exp(-x1*x1/2)/sqrt(2*pi)", 1, "gaussian"},
+	{"transcendental", "atan2(x1,x2)+ln(x3+10)+log10(x4+10)+pow(x1+20,1.5)", 4, "logarithms"},
+	{"transcendental", "sqrt(sinh(x1/100)^2+cosh(x2/100)^2)*tanh(x3)+asin(x4/100)", 4, "hyperbolic"},
+	{"conditional", "x1<8 ? x1*x2 : x2-x1", 2, "piecewise"},
+	{"conditional", "if(x1>4 && x2<10, sqrt(x1)*ln(x2), exp(-x1))", 2, "lazy"},
+};
+
+// The corpus compiled by the C++ compiler, x1 ... x16 being _1 ... _16; main() checks they give the same bits.
+MCALC_FIXED(one, 0, lift(1))
+MCALC_FIXED(literal_arithmetic, 0, 5 + lift(5) * 2 / 2)
+MCALC_FIXED(literal_constants, 0, pow(lift(2), 10) - pi() * e())
+MCALC_FIXED(nested_literals, 0, (((((((lift(1) + 2) * 3 - 4) / 5 + 6) * 7 - 8) / 9 + 10) * 11 - 12) / 13 + 14))
+MCALC_FIXED(nested_variables, 3, ((((_1 + 1) * 2 - _2) / 3 + _3) * 4 - _1) / 5 + ((_2 - _3) * (_1 + _2) - (_3 * _1)))
+MCALC_FIXED(nested_negations, 4, -(-(-(-(-(-(_1 + _2) * _3) / _4) + _1) * _2) / _3) + _4)
+MCALC_FIXED(sum8, 8, _1 + _2 + _3 + _4 + _5 + _6 + _7 + _8)
+MCALC_FIXED(ratio6, 6, (_1 - _2) * (_3 - _4) / (_5 + _6 + 1))
+MCALC_FIXED(dot16, 16, _1 * _2 + _3 * _4 + _5 * _6 + _7 * _8 + _9 * _10 + _11 * _12 + _13 * _14 + _15 * _16)
+MCALC_FIXED(trigonometric, 3, sin(_1) * cos(_2) + tan(_3 / 10))
+MCALC_FIXED(gaussian, 1, exp(-_1 * _1 / 2) / sqrt(2 * pi()))
+MCALC_FIXED(logarithms, 4, atan2(_1, _2) + ln(_3 + 10) + log10(_4 + 10) + pow(_1 + 20, 1.5))
+MCALC_FIXED(hyperbolic, 4, sqrt(pow(sinh(_1 / 100), 2) + pow(cosh(_2 / 100), 2)) * tanh(_3) + asin(_4 / 100))
+MCALC_FIXED(piecewise, 2, if_(_1 < 8, _1 * _2, _2 - _1))
+MCALC_FIXED(lazy, 2, if_(_1 > 4 && _2 < 10, sqrt(_1) * ln(_2), exp(-_1)))
+
+static const size_t corpus_size = sizeof(corpus) / sizeof(corpus[0]);
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// The values of one thread, bound both as library variables and as UDF arguments.
+struct bindings {
+	double values[VARIABLES];
+	mcalc_variable variables[VARIABLES];
+	enum Item_result types[VARIABLES + 1];
+	char *args[VARIABLES + 1];
+	unsigned long lengths[VARIABLES + 1];
+	char maybe_null[VARIABLES + 1];
+	char *attributes[VARIABLES + 1];
+	unsigned long attribute_lengths[VARIABLES + 1];
+	UDF_ARGS udf_args;
+
+	bindings() {
+		for (int i = 0; i < VARIABLES; i++) {
+			values[i] = 0.5 + i;
+			mcalc_variable var = {names[i], &values[i], MCALC_VARIABLE, 0};
+			variables[i] = var;
+		}
+		memset(&udf_args, 0, sizeof(udf_args));
+	}
+
+	void next_row(unsigned long long row) {
+		values[0] = 0.5 + (row & 1023) / 64.0;
+	}
+
+	// Sets up the arguments of mcalc(text, x1, ..., xN) for mcalc_init; text 0 passes a NULL formula.
+	// Like column values, x1 ... xN are only known once the rows start, see columns().
+	UDF_ARGS *arguments(const char *text, int count) {
+		types[0] = STRING_RESULT;
+		args[0] = (char *)text;
+		lengths[0] = text ? strlen(text) : 0;
+		maybe_null[0] = 0;
+		attributes[0] = (char *)"formula";
+		attribute_lengths[0] = 7;
+		for (int i = 0; i < count; i++) {
+			types[i + 1] = REAL_RESULT;
+			args[i + 1] = 0;
+			lengths[i + 1] = sizeof(double);
+			maybe_null[i + 1] = 0;
+			attributes[i + 1] = (char *)names[i];
+			attribute_lengths[i + 1] = strlen(names[i]);
+		}
+		udf_args.arg_count = count + 1;
+		udf_args.arg_type = types;
+		udf_args.args = args;
+		udf_args.lengths = lengths;
+		udf_args.maybe_null = maybe_null;
+		udf_args.attributes = attributes;
+		udf_args.attribute_lengths = attribute_lengths;
+		return &udf_args;
+	}
+
+	// Points x1 ... xN to the values, for the rows after mcalc_init.
+	void columns() {
+		for (unsigned int i = 1; i < udf_args.arg_count; i++) args[i] = (char *)&values[i - 1];
+	}
+};
+
+// One measured operation on one formula, prepared once and run `run(n)` times.
+struct operation {
+	virtual ~operation() {}
+	virtual bool prepare(bindings &b, const formula &f) = 0;
+	virtual double run(bindings &b, unsigned long long n) = 0;
+	virtual void finish() {}
+};
+
+struct compile_op : operation {
+	const formula *f;
+	bool prepare(bindings &, const formula &form) {
+		f = &form;
+		return true;
+	}
+	double run(bindings &b, unsigned long long n) {
+		double sink = 0;
+		for (unsigned long long i = 0; i < n; i++) {
+			int error;
+			mcalc_expr *e = mcalc_compile(f->text, b.variables, VARIABLES, &error);
+			sink += error;
+			mcalc_free(e);
+		}
+		return sink;
+	}
+};
+
+struct eval_op : operation {
+	mcalc_expr *e;
+	bool prepare(bindings &b, const formula &f) {
+		int error;
+		e = mcalc_compile(f.text, b.variables, VARIABLES, &error);
+		return e != 0;
+	}
+	double run(bindings &b, unsigned long long n) {
+		double sink = 0;
+		for (unsigned long long i = 0; i < n; i++) {
+			b.next_row(i);
+			sink += mcalc_eval(e);
+		}
+		return sink;
+	}
+	void finish() {
+		mcalc_free(e);
+	}
+};
+
+struct interp_op : operation {
+	const char *text;
+	bool prepare(bindings &, const formula &f) {
+		text = f.text;
+		return f.variables == 0;
+	}
+	double run(bindings &, unsigned long long n) {
+		double sink = 0;
+		for (unsigned long long i = 0; i < n; i++) {
+			int error;
+			sink += mcalc_interp(text, &error);
+		}
+		return sink;
+	}
+};
+
+struct udf_row_op : operation {
+	UDF_INIT initid;
+	UDF_ARGS *args;
+	bool prepare(bindings &b, const formula &f) {
+		char message[MYSQL_ERRMSG_SIZE];
+		memset(&initid, 0, sizeof(initid));
+		args = b.arguments(f.text, f.variables);
+		if (mcalc_init(&initid, args, message)) return false;
+		b.columns();
+		return true;
+	}
+	double run(bindings &b, unsigned long long n) {
+		double sink = 0;
+		for (unsigned long long i = 0; i < n; i++) {
+			unsigned char is_null = 0, error = 0;
+			b.next_row(i);
+			sink += mcalc(&initid, args, &is_null, &error);
+		}
+		return sink;
+	}
+	void finish() {
+		mcalc_deinit(&initid);
+	}
+};
+
+// mcalc_memo() shares mcalc()'s row and deinit functions.
+struct udf_memo_op : udf_row_op {
+	bool prepare(bindings &b, const formula &f) {
+		char message[MYSQL_ERRMSG_SIZE];
+		memset(&initid, 0, sizeof(initid));
+		args = b.arguments(f.text, f.variables);
+		if (mcalc_memo_init(&initid, args, message)) return false;
+		b.columns();
+		return true;
+	}
+};
+
+// The formula is NULL at init time, as for mcalc(formula_column, ...), so rows go through the cache.
+struct udf_column_op : udf_row_op {
+	const char *text;
+	bool prepare(bindings &b, const formula &f) {
+		char message[MYSQL_ERRMSG_SIZE];
+		memset(&initid, 0, sizeof(initid));
+		args = b.arguments(0, f.variables);
+		text = f.text;
+		if (mcalc_init(&initid, args, message)) return false;
+		b.columns();
+		return true;
+	}
+	double run(bindings &b, unsigned long long n) {
+		double sink = 0;
+		std::string row[2] = {text, text};
+		for (unsigned long long i = 0; i < n; i++) {
+			unsigned char is_null = 0, error = 0;
+			// Alternate between two equal copies so every row compares the text again.
+			const std::string &formula = row[i & 1];
+			args->args[0] = (char *)formula.data();
+			args->lengths[0] = formula.size();
+			b.next_row(i);
+			sink += mcalc(&initid, args, &is_null, &error);
+		}
+		return sink;
+	}
+};
+
+struct udf_query_op : operation {
+	const formula *f;
+	bool prepare(bindings &, const formula &form) {
+		f = &form;
+		return true;
+	}
+	double run(bindings &b, unsigned long long n) {
+		double sink = 0;
+		for (unsigned long long i = 0; i < n; i++) {
+			char message[MYSQL_ERRMSG_SIZE];
+			unsigned char is_null = 0, error = 0;
+			UDF_INIT initid;
+			memset(&initid, 0, sizeof(initid));
+			UDF_ARGS *args = b.arguments(f->text, f->variables);
+			if (mcalc_init(&initid, args, message)) return sink;
+			b.columns();
+			sink += mcalc(&initid, args, &is_null, &error);
+			mcalc_deinit(&initid);
+		}
+		return sink;
+	}
+};
+
+struct fixed_op : operation {
+	mcalc_fixed_function function;
+	bool prepare(bindings &, const formula &f) {
+		const mcalc_fixed_entry *entry = f.fixed ? mcalc_fixed_find(f.fixed) : 0;
+		function = entry ? entry->function : 0;
+		return function != 0;
+	}
+	double run(bindings &b, unsigned long long n) {
+		double sink = 0;
+		for (unsigned long long i = 0; i < n; i++) {
+			b.next_row(i);
+			sink += function(b.values);
+		}
+		return sink;
+	}
+};
+
+// mcalc_fixed('name', x1, ..., xN): the name takes the place of the formula.
+struct udf_fixed_op : operation {
+	UDF_INIT initid;
+	UDF_ARGS *args;
+	bool prepare(bindings &b, const formula &f) {
+		char message[MYSQL_ERRMSG_SIZE];
+		memset(&initid, 0, sizeof(initid));
+		if (!f.fixed) return false;
+		args = b.arguments(f.fixed, f.variables);
+		if (mcalc_fixed_init(&initid, args, message)) return false;
+		b.columns();
+		return true;
+	}
+	double run(bindings &b, unsigned long long n) {
+		double sink = 0;
+		for (unsigned long long i = 0; i < n; i++) {
+			unsigned char is_null = 0, error = 0;
+			b.next_row(i);
+			sink += mcalc_fixed(&initid, args, &is_null, &error);
+		}
+		return sink;
+	}
+	void finish() {
+		mcalc_fixed_deinit(&initid);
+	}
+};
+
+static operation *new_operation(const std::string &name) {
+	if (name == "compile") return new compile_op;
+	if (name == "eval") return new eval_op;
+	if (name == "interp") return new interp_op;
+	if (name == "udf_row") return new udf_row_op;
+	if (name == "udf_memo") return new udf_memo_op;
+	if (name == "udf_column") return new udf_column_op;
+	if (name == "udf_query") return new udf_query_op;
+	if (name == "fixed") return new fixed_op;
+	if (name == "udf_fixed") return new udf_fixed_op;
+	return 0;
+}
+
+static const char *operations[] = {"compile", "eval", "interp", "udf_row", "udf_memo", "udf_column", "udf_query", "fixed", "udf_fixed"};
+static const size_t operation_count = sizeof(operations) / sizeof(operations[0]);
+
+struct result {
+	std::string operation;
+	const formula *f;
+	double ns;
+	double allocations;
+};
+
+struct scaling {
+	std::string operation;
+	unsigned threads;
+	double ops; // Operations per second over all threads.
+	double efficiency; // ops / (threads * ops of one thread).
+};
+
+static volatile double sink;
+
+// Every pass over a tree recurses into it: x+x+...+x as deep as MCALC_MAX_DEPTH must compile,
+// run and profile on a small thread stack, and one of 5000 terms must fail with MCALC_TOO_DEEP.
+static void *deep_chains(void *failed) {
+	double x = 1, column[4] = {1, 1, 1, 1}, out[4];
+	const double *columns[] = {column};
+	mcalc_variable v = {"x", &x, MCALC_VARIABLE, 0};
+	static char report[1 << 20];
+	for (int terms : {(int)MCALC_MAX_DEPTH, 5000}) {
+		std::string text = "x";
+		for (int i = 1; i < terms; i++) text += "+x";
+		int error;
+		mcalc_expr *e = mcalc_compile_n(text.data(), text.size(), &v, 1, &error);
+		if (terms > MCALC_MAX_DEPTH) {
+			if (e || error != MCALC_TOO_DEEP) *(bool *)failed = true;
+			mcalc_free(e);
+			continue;
+		}
+		mcalc_program *p = mcalc_assemble(e);
+		mcalc_profiler *profiler = mcalc_profiler_create(e, &v, 1, 1);
+		if (!e || !p || !profiler || mcalc_eval(e) != terms || mcalc_run(p) != terms || mcalc_profiler_eval(profiler) != terms ||
+			mcalc_run_batch(p, &v, columns, 1, out, 4) != 0 || out[3] != terms || !mcalc_profiler_report(profiler, 1, report, sizeof(report))) {
+			*(bool *)failed = true;
+		}
+		mcalc_profiler_free(profiler);
+		mcalc_program_free(p);
+		mcalc_free(e);
+	}
+	return 0;
+}
+
+// Runs `op` with growing iteration counts until one round takes at least `budget` ns.
+static bool measure(const std::string &name, const formula &f, double budget, result *out) {
+	bindings b;
+	operation *op = new_operation(name);
+	if (!op->prepare(b, f)) {
+		delete op;
+		return false;
+	}
+	sink += op->run(b, 16); // Warm up caches, the JIT of udf_row and the formula cache.
+	unsigned long long n = 1;
+	double elapsed;
+	unsigned long long allocated;
+	for (;;) {
+		allocated = allocations;
+		const double start = now();
+		sink += op->run(b, n);
+		elapsed = now() - start;
+		allocated = allocations - allocated;
+		if (elapsed >= budget || n >= (1ull << 40)) break;
+		// Aim a bit past the budget so the final round usually needs no retry.
+		const double scale = elapsed > 0 ? 1.2 * budget / elapsed : 100;
+		n = (unsigned long long)(n * (scale < 2 ? 2 : scale > 100 ? 100 : scale));
+	}
+	op->finish();
+	delete op;
+	out->operation = name;
+	out->f = &f;
+	out->ns = elapsed / n;
+	out->allocations = (double)allocated / n;
+	return true;
+}
+
+// Runs every formula of the corpus in turn on `threads` threads for `budget` ns.
+static double throughput(const std::string &name, unsigned threads, double budget) {
+	std::atomic<bool> stop(false);
+	std::atomic<unsigned> ready(0);
+	std::vector<unsigned long long> done(threads);
+	std::vector<std::thread> pool;
+	for (unsigned t = 0; t < threads; t++) {
+		pool.push_back(std::thread([&, t]() {
+			bindings b;
+			std::vector<operation *> ops;
+			for (size_t i = 0; i < corpus_size; i++) {
+				operation *op = new_operation(name);
+				if (op->prepare(b, corpus[i])) {
+					ops.push_back(op);
+				} else {
+					delete op;
+				}
+			}
+			ready++;
+			while (ready < threads) std::this_thread::yield();
+			unsigned long long count = 0;
+			double local = 0;
+			while (!stop.load(std::memory_order_relaxed)) {
+				for (size_t i = 0; i < ops.size(); i++) {
+					local += ops[i]->run(b, 64);
+				}
+				count += 64 * ops.size();
+			}
+			sink += local;
+			done[t] = count;
+			for (size_t i = 0; i < ops.size(); i++) {
+				ops[i]->finish();
+				delete ops[i];
+			}
+		}));
+	}
+	while (ready < threads) std::this_thread::yield();
+	const double start = now();
+	std::this_thread::sleep_for(std::chrono::nanoseconds((long long)budget));
+	stop = true;
+	const double elapsed = now() - start;
+	unsigned long long total = 0;
+	for (unsigned t = 0; t < threads; t++) {
+		pool[t].join();
+		total += done[t];
+	}
+	return total / (elapsed / 1e9);
+}
+
+static std::string quote(const char *text) {
+	std::string s = "\"";
+	for (; *text; text++) {
+		if (*text == '"' || *text == '\\') s += '\\';
+		s += *text;
+	}
+	return s + "\"";
+}
+
+static void print_json(const std::vector<result> &results, const std::vector<scaling> &scales) {
+	printf("{\n\t\"allocations_counted\": %s,\n\t\"results\": [\n", COUNTS_ALLOCATIONS ? "true" : "false");
+	for (size_t i = 0; i < results.size(); i++) {
+		const result &r = results[i];
+		printf("\t\t{\"operation\": \"%s\", \"group\": \"%s\", \"formula\": %s, \"ns_per_op\": %.3f, \"allocations_per_op\": %.3f}%s\n",
+			r.operation.c_str(), r.f->group, quote(r.f->text).c_str(), r.ns, r.allocations, i + 1 < results.size() ? "," : "");
+	}
+	printf("\t],\n\t\"scaling\": [\n");
+	for (size_t i = 0; i < scales.size(); i++) {
+		const scaling &s = scales[i];
+		printf("\t\t{\"operation\": \"%s\", \"threads\": %u, \"ops_per_sec\": %.0f, \"efficiency\": %.3f}%s\n",
+			s.operation.c_str(), s.threads, s.ops, s.efficiency, i + 1 < scales.size() ? "," : "");
+	}
+	printf("\t]\n}\n");
+}
+
+static void print_table(const std::vector<result> &results, const std::vector<scaling> &scales) {
+	printf("%-11s %-15s %-60s %12s %10s\n", "operation", "group", "formula", "ns/op", "allocs/op");
+	for (size_t i = 0; i < results.size(); i++) {
+		const result &r = results[i];
+		printf("%-11s %-15s %-60.60s %12.2f ", r.operation.c_str(), r.f->group, r.f->text, r.ns);
+		if (COUNTS_ALLOCATIONS) {
+			printf("%10.2f\n", r.allocations);
+		} else {
+			printf("%10s\n", "-");
+		}
+	}
+	printf("\n%-11s %8s %14s %11s\n", "operation", "threads", "ops/s", "efficiency");
+	for (size_t i = 0; i < scales.size(); i++) {
+		const scaling &s = scales[i];
+		printf("%-11s %8u %14.0f %10.0f%%\n", s.operation.c_str(), s.threads, s.ops, s.efficiency * 100);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	bool json = false;
+	double budget = 100e6;
+	unsigned max_threads = std::thread::hardware_concurrency();
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--json")) {
+			json = true;
+		} else if (!strcmp(argv[i], "--stats")) {
+			mcalc_stats_enable(1);
+		} else if (!strcmp(argv[i], "--time") && i + 1 < argc) {
+			budget = atof(argv[++i]) * 1e6;
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			max_threads = atoi(argv[++i]);
+		} else {
+			fprintf(stderr, "usage: %s [--json] [--stats] [--time ms] [--threads n]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (max_threads < 1) max_threads = 1;
+
+	pthread_attr_t attributes;
+	pthread_t thread;
+	bool failed = false;
+	pthread_attr_init(&attributes);
+	pthread_attr_setstacksize(&attributes, 256 * 1024);
+	if (pthread_create(&thread, &attributes, deep_chains, &failed) != 0 || pthread_join(thread, 0) != 0 || failed) {
+		fprintf(stderr, "formulas %d deep don't run on a 256 KiB stack, or deeper ones compile\n", (int)MCALC_MAX_DEPTH);
+		return 1;
+	}
+	pthread_attr_destroy(&attributes);
+
+	for (size_t i = 0; i < corpus_size; i++) {
+		bindings b;
+		int error;
+		mcalc_expr *e = mcalc_compile(corpus[i].text, b.variables, VARIABLES, &error);
+		if (!e) {
+			fprintf(stderr, "%s: error at %d\n", corpus[i].text, error);
+			return 1;
+		}
+		const mcalc_fixed_entry *fixed = corpus[i].fixed ? mcalc_fixed_find(corpus[i].fixed) : 0;
+		for (unsigned long long row = 0; fixed && row < 1024; row++) {
+			b.next_row(row);
+			const double parsed = mcalc_eval(e), native = fixed->function(b.values);
+			if (memcmp(&parsed, &native, sizeof(double)) != 0) {
+				fprintf(stderr, "%s: fixed formula %s gives %.17g instead of %.17g\n", corpus[i].text, corpus[i].fixed, native, parsed);
+				return 1;
+			}
+		}
+		mcalc_free(e);
+	}
+
+	std::vector<result> results;
+	for (size_t o = 0; o < operation_count; o++) {
+		for (size_t i = 0; i < corpus_size; i++) {
+			result r;
+			if (measure(operations[o], corpus[i], budget, &r)) results.push_back(r);
+		}
+	}
+
+	std::vector<unsigned> counts;
+	for (unsigned threads = 1; threads < max_threads; threads *= 2) counts.push_back(threads);
+	counts.push_back(max_threads);
+	std::vector<scaling> scales;
+	for (size_t o = 0; o < operation_count; o++) {
+		double single = 0;
+		for (size_t i = 0; i < counts.size(); i++) {
+			scaling s;
+			s.operation = operations[o];
+			s.threads = counts[i];
+			s.ops = throughput(operations[o], s.threads, budget);
+			if (i == 0) single = s.ops;
+			s.efficiency = single > 0 ? s.ops / (s.threads * single) : 0;
+			scales.push_back(s);
+		}
+	}
+
+	if (json) {
+		print_json(results, scales);
+	} else {
+		print_table(results, scales);
+	}
+	return 0;
+}
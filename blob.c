@@ -0,0 +1,216 @@
+#include "evaluation.h"
+#include "program.h"
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#ifndef NAN
+	#define NAN (0.0/0.0)
+#endif
+
+/* Layout, little-endian whatever the host:
+ *   0  "MCB" and the version
+ *   4  u32 FNV-1a of the bytes from 8 on
+ *   8  u16 inputs, u16 depth, u16 slots, u16 reserved (0)
+ *  16  code: one opcode byte, then its operand (f64 constant, u16 input, slot or builtin number).
+ * Opcodes are numbered here rather than reusing program.h's, which may change between versions.
+ * There are no jumps: blobs only call pure builtins, so both sides of a branch are computed
+ * and B_SELECT keeps one, which gives the same value. */
+#define BLOB_VERSION 1
+#define HEADER 16
+
+enum {
+	B_CONSTANT, B_INPUT, B_ADD, B_SUB, B_MUL, B_DIV, B_NEG, B_COMMA, B_STORE, B_LOAD, B_CALL,
+	B_SELECT,
+	B_OPCODES
+};
+
+/* Operand size of each opcode. */
+static const unsigned char operand[B_OPCODES] = {8, 2, 0, 0, 0, 0, 0, 0, 2, 2, 2, 0};
+
+static unsigned read16(const unsigned char *p) {return p[0] | p[1] << 8;}
+
+static uint32_t read32(const unsigned char *p) {return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;}
+
+static double read_double(const unsigned char *p) {
+	uint64_t bits = 0;
+	double value;
+	int i;
+	for (i = 7; i >= 0; i--) bits = bits << 8 | p[i];
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+static uint32_t checksum(const unsigned char *p, size_t size) {
+	uint32_t h = 2166136261u;
+	size_t i;
+	for (i = 0; i < size; i++) h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+typedef struct writer {
+	unsigned char *at, *end; /* Only counts once past the end. */
+	size_t size;
+} writer;
+
+static void put(writer *w, unsigned value, int bytes) {
+	int i;
+	for (i = 0; i < bytes; i++, w->size++) {
+		if (w->at && w->at < w->end) *w->at++ = (unsigned char)(value >> 8 * i);
+	}
+}
+
+static void put_double(writer *w, double value) {
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	put(w, (unsigned)bits, 4);
+	put(w, (unsigned)(bits >> 32), 4);
+}
+
+static int builtin_number(const void *function, int arity) {
+	int i;
+	for (i = 0; i < mcalc_builtin_count; i++) {
+		if (mcalc_builtins[i].function == function && mcalc_builtins[i].arity == arity) return i;
+	}
+	return -1;
+}
+
+long mcalc_blob_write(const mcalc_program *p, const double *inputs, int count, unsigned char *blob, size_t size) {
+	writer w = {blob, blob + size, 0};
+	int merges[MCALC_BLOB_STACK]; /* Ends of the branches being written, innermost last. */
+	int i, open = 0, height = 0, depth = 0;
+	if (!p || count < 0 || count > 0xFFFF) return -1;
+	put(&w, 'M', 1); put(&w, 'C', 1); put(&w, 'B', 1); put(&w, BLOB_VERSION, 1);
+	put(&w, 0, 4);
+	put(&w, count, 2); put(&w, 0, 2); put(&w, p->slots, 2); put(&w, 0, 2);
+	for (i = 0; i <= p->length; i++) {
+		const mcalc_op *op = p->code + i;
+		while (open && merges[open - 1] == i) {
+			put(&w, B_SELECT, 1);
+			height -= 2;
+			open--;
+		}
+		if (i == p->length) break;
+		switch (op->code) {
+			case OP_CONSTANT: put(&w, B_CONSTANT, 1); put_double(&w, op->value); height++; break;
+			case OP_VARIABLE:
+				/* Only the inputs can be stored, by their index. */
+				if (!inputs || op->bound < inputs || op->bound >= inputs + count) return -1;
+				put(&w, B_INPUT, 1); put(&w, (unsigned)(op->bound - inputs), 2);
+				height++;
+				break;
+			case OP_ADD: put(&w, B_ADD, 1); height--; break;
+			case OP_SUB: put(&w, B_SUB, 1); height--; break;
+			case OP_MUL: put(&w, B_MUL, 1); height--; break;
+			case OP_DIV: put(&w, B_DIV, 1); height--; break;
+			case OP_NEG: put(&w, B_NEG, 1); break;
+			case OP_COMMA: put(&w, B_COMMA, 1); height--; break;
+			case OP_STORE: put(&w, B_STORE, 1); put(&w, op->slot, 2); break;
+			case OP_LOAD: put(&w, B_LOAD, 1); put(&w, op->slot, 2); height++; break;
+			case OP_SELECT: put(&w, B_SELECT, 1); height -= 2; break;
+			/* The condition and the first side stay on the stack for the B_SELECT at the end. */
+			case OP_JUMP_ZERO: break;
+			case OP_JUMP:
+				if (open == MCALC_BLOB_STACK) return -1;
+				merges[open++] = op->target;
+				break;
+			default: {
+				/* Calls of a builtin, closures and the caller's functions have no stable name. */
+				const int number = op->code >= OP_CALL0 && op->code < OP_CLOSURE0 ? builtin_number(op->function, op->code - OP_CALL0) : -1;
+				if (number < 0) return -1;
+				put(&w, B_CALL, 1); put(&w, number, 2);
+				height += 1 - mcalc_builtins[number].arity;
+			}
+		}
+		if (height > depth) depth = height;
+	}
+	if (depth + p->slots > MCALC_BLOB_STACK) return -1;
+	if (blob && w.size <= size) {
+		const size_t total = w.size;
+		w.at = blob + 10;
+		put(&w, depth, 2);
+		w.at = blob + 4;
+		put(&w, checksum(blob + 8, total - 8), 4);
+		w.size = total;
+	}
+	return (long)w.size;
+}
+
+int mcalc_blob_check(const unsigned char *blob, size_t size, int count) {
+	unsigned char stored[MCALC_BLOB_STACK];
+	unsigned inputs, depth, slots, height = 0;
+	size_t at = HEADER;
+	if (!blob || size < HEADER || memcmp(blob, "MCB", 3) != 0 || blob[3] != BLOB_VERSION) return -1;
+	if (read32(blob + 4) != checksum(blob + 8, size - 8)) return -1;
+	inputs = read16(blob + 8);
+	depth = read16(blob + 10);
+	slots = read16(blob + 12);
+	if (read16(blob + 14) != 0 || (int)inputs > count || depth + slots > MCALC_BLOB_STACK) return -1;
+	memset(stored, 0, slots);
+	/* Runs the code on the stack heights only: every operand must be in range and every
+	 * pop, push and load must stay within what the header declares. */
+	while (at < size) {
+		const unsigned code = blob[at++];
+		unsigned value = 0, pops = 0, pushes = 1;
+		if (code >= B_OPCODES || size - at < operand[code]) return -1;
+		if (operand[code] == 2) value = read16(blob + at);
+		at += operand[code];
+		switch (code) {
+			case B_CONSTANT: break;
+			case B_INPUT: if (value >= inputs) return -1; break;
+			case B_NEG: pops = 1; break;
+			case B_SELECT: pops = 3; break;
+			case B_STORE:
+				if (value >= slots) return -1;
+				stored[value] = 1;
+				pops = pushes = 1;
+				break;
+			case B_LOAD: if (value >= slots || !stored[value]) return -1; break;
+			case B_CALL:
+				if ((int)value >= mcalc_builtin_count) return -1;
+				pops = mcalc_builtins[value].arity;
+				break;
+			default: pops = 2; break;
+		}
+		if (pops > height) return -1;
+		height += pushes - pops;
+		if (height > depth) return -1;
+	}
+	return height == 1 ? 0 : -1;
+}
+
+#define CALL(...) ((double(*)(__VA_ARGS__))mcalc_builtins[read16(op)].function)
+
+double mcalc_blob_eval(const unsigned char *blob, size_t size, const double *inputs) {
+	/* The blob passed mcalc_blob_check, so nothing here needs checking again. */
+	double stack[MCALC_BLOB_STACK];
+	double *top = stack - 1;
+	double *slots = stack + read16(blob + 10);
+	const unsigned char *op = blob + HEADER, *end = blob + size;
+	while (op != end) {
+		switch (*op++) {
+			case B_CONSTANT: *++top = read_double(op); op += 8; break;
+			case B_INPUT: *++top = inputs[read16(op)]; op += 2; break;
+			case B_ADD: top[-1] += top[0]; --top; break;
+			case B_SUB: top[-1] -= top[0]; --top; break;
+			case B_MUL: top[-1] *= top[0]; --top; break;
+			case B_DIV: top[-1] /= top[0]; --top; break;
+			case B_NEG: top[0] = -top[0]; break;
+			case B_COMMA: top[-1] = top[0]; --top; break;
+			case B_SELECT: top -= 2; top[0] = top[0] != 0 ? top[1] : top[2]; break;
+			case B_STORE: slots[read16(op)] = top[0]; op += 2; break;
+			case B_LOAD: *++top = slots[read16(op)]; op += 2; break;
+			case B_CALL:
+				switch (mcalc_builtins[read16(op)].arity) {
+					case 0: *++top = CALL(void)(); break;
+					case 1: top[0] = CALL(double)(top[0]); break;
+					case 2: top -= 1; top[0] = CALL(double, double)(top[0], top[1]); break;
+				}
+				op += 2;
+				break;
+			default: return NAN;
+		}
+	}
+	return top[0];
+}
+#undef CALL
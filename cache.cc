@@ -0,0 +1,153 @@
+/**
+ *
+ * @Name : MysqlCalc
+ * @Version : 1.0
+ * @Programmer : Max
+ * @Date : 2019-11-02
+ * @Released under : https://github.com/BaseMax/MysqlCalc/blob/master/LICENSE
+ * @Repository : https://github.com/BaseMax/MysqlCalc
+ *
+**/
+/*
+** Process-wide cache of compiled formulas, keyed by the expression text.
+**
+** The cache is split into independent shards, each with its own mutex and
+** LRU list, so connection threads working on different formulas rarely
+** contend. The shard is picked from the hash of the text; the capacity is
+** divided between shards, the remainder going one each to the first shards so
+** that they add up to exactly the capacity, and the least recently used
+** formula of a full shard is evicted on insert.
+**
+** The default capacity can be set with the MCALC_CACHE_SIZE environment
+** variable of mysqld, and changed at runtime with mcalc_cache_size(n).
+**
+** Programs have the functions of mcalc_define() inlined, so a program compiled
+** with functions that changed meanwhile is not kept.
+*/
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "cache.h"
+#include "definitions.h"
+#include "stats.h"
+
+namespace {
+
+const size_t shard_count = 16;
+const size_t default_capacity = 1024;
+
+struct shard {
+	typedef std::list<std::pair<std::string, mcalc_cached_program> > lru_list;
+
+	std::mutex lock;
+	lru_list lru; // Most recently used first.
+	std::unordered_map<std::string, lru_list::iterator> index;
+
+	void trim(size_t limit) {
+		while (lru.size() > limit) {
+			index.erase(lru.back().first);
+			lru.pop_back();
+		}
+	}
+};
+
+size_t initial_capacity() {
+	const char *env = getenv("MCALC_CACHE_SIZE");
+	if (!env || !*env) return default_capacity;
+	return strtoul(env, 0, 10);
+}
+
+std::atomic<size_t> capacity(initial_capacity());
+
+shard *shards() {
+	static shard all[shard_count];
+	return all;
+}
+
+size_t shard_capacity(size_t i) {
+	const size_t total = capacity.load(std::memory_order_relaxed);
+	return total / shard_count + (i < total % shard_count ? 1 : 0);
+}
+
+void free_program(const mcalc_program *p) {
+	mcalc_program_free((mcalc_program *)p);
+}
+
+mcalc_cached_program compile(const std::string &text, int *error, unsigned long long *generation) {
+	// Only the program outlives this call, the tree is built in a scratch arena.
+	double buffer[512];
+	mcalc_arena arena;
+	mcalc_arena_init(&arena, buffer, sizeof(buffer));
+	mcalc_definitions_reader definitions;
+	mcalc_options options = {};
+	options.arena = &arena;
+	definitions.bind(&options);
+	*generation = definitions.generation();
+	mcalc_program *p = mcalc_assemble(mcalc_compile_ex(text.data(), text.size(), 0, 0, &options, error));
+	mcalc_arena_release(&arena);
+	return p ? mcalc_cached_program(p, free_program) : mcalc_cached_program();
+}
+
+} // namespace
+
+mcalc_cached_program mcalc_cache_get(const std::string &text, int *error) {
+	const size_t index = std::hash<std::string>()(text) % shard_count;
+	const size_t limit = shard_capacity(index);
+	unsigned long long generation;
+	if (error) *error = 0;
+	if (!limit) {
+		return compile(text, error, &generation);
+	}
+	shard &s = shards()[index];
+	{
+		std::lock_guard<std::mutex> guard(s.lock);
+		auto found = s.index.find(text);
+		if (found != s.index.end()) {
+			s.lru.splice(s.lru.begin(), s.lru, found->second);
+			if (MCALC_STATS_ON()) mcalc_stats_count(MCALC_STAT_CACHE_HITS, 1);
+			return found->second->second;
+		}
+	}
+	if (MCALC_STATS_ON()) mcalc_stats_count(MCALC_STAT_CACHE_MISSES, 1);
+	// Compile outside the lock; another thread may race us to the same text.
+	mcalc_cached_program compiled = compile(text, error, &generation);
+	if (!compiled) return compiled;
+	std::lock_guard<std::mutex> guard(s.lock);
+	// Checked under the lock: a change after this is followed by mcalc_cache_clear().
+	if (generation != mcalc_definitions_generation()) return compiled;
+	auto found = s.index.find(text);
+	if (found != s.index.end()) {
+		s.lru.splice(s.lru.begin(), s.lru, found->second);
+		return found->second->second;
+	}
+	s.lru.emplace_front(text, compiled);
+	s.index.emplace(text, s.lru.begin());
+	s.trim(limit);
+	return compiled;
+}
+
+size_t mcalc_cache_capacity() {
+	return capacity.load(std::memory_order_relaxed);
+}
+
+void mcalc_cache_set_capacity(size_t value) {
+	capacity.store(value, std::memory_order_relaxed);
+	for (size_t i = 0; i < shard_count; i++) {
+		std::lock_guard<std::mutex> guard(shards()[i].lock);
+		shards()[i].trim(shard_capacity(i));
+	}
+}
+
+void mcalc_cache_clear() {
+	for (size_t i = 0; i < shard_count; i++) {
+		std::lock_guard<std::mutex> guard(shards()[i].lock);
+		shards()[i].trim(0);
+	}
+}
@@ -0,0 +1,26 @@
+#ifndef __MCALC_CACHE_H__
+	#define __MCALC_CACHE_H__
+
+	#include <stddef.h>
+
+	#include <memory>
+	#include <string>
+
+	#include "evaluation.h"
+
+	// A compiled formula shared between the cache and every statement using it.
+	// The program is only freed once the last holder lets go, so eviction is
+	// safe while other connection threads are still running it.
+	typedef std::shared_ptr<const mcalc_program> mcalc_cached_program;
+
+	// Returns the compiled program for `text`, compiling it on a miss.
+	// On a syntax error an empty pointer is returned and *error holds the position.
+	mcalc_cached_program mcalc_cache_get(const std::string &text, int *error);
+
+	// Total number of formulas kept across all shards, 0 disables caching. Each of the 16 shards
+	// holds capacity / 16, the first capacity % 16 shards one more, so the total is never exceeded.
+	size_t mcalc_cache_capacity();
+	void mcalc_cache_set_capacity(size_t capacity);
+	// Also needed after a change of the functions of mcalc_define(), which programs inline.
+	void mcalc_cache_clear();
+#endif
@@ -0,0 +1,258 @@
+#ifndef __MCALC_COMBINATORICS_H__
+	#define __MCALC_COMBINATORICS_H__
+
+	#include <stdint.h>
+
+	/* Exact factorials and binomial coefficients over the range of uint64_t,
+	 * used by fac, ncr and npr and by the integer constant folding. */
+
+	/* n! for n <= 20; 21! does not fit in 64 bits. */
+	#define MCALC_FAC_MAX 20
+
+	static const uint64_t mcalc_fac_table[MCALC_FAC_MAX + 1] = {
+		1ull, 1ull, 2ull, 6ull,
+		24ull, 120ull, 720ull, 5040ull,
+		40320ull, 362880ull, 3628800ull, 39916800ull,
+		479001600ull, 6227020800ull, 87178291200ull, 1307674368000ull,
+		20922789888000ull, 355687428096000ull, 6402373705728000ull, 121645100408832000ull,
+		2432902008176640000ull,
+	};
+
+	/* ncr(n, k) for n <= 67 and k <= n/2, row n starting at mcalc_ncr_rows[n];
+	 * ncr(68, 34) is the first coefficient that does not fit in 64 bits. */
+	#define MCALC_NCR_MAX 67
+
+	static const unsigned short mcalc_ncr_rows[MCALC_NCR_MAX + 1] = {
+		0, 1, 2, 4, 6, 9, 12, 16, 20, 25, 30, 36,
+		42, 49, 56, 64, 72, 81, 90, 100, 110, 121, 132, 144,
+		156, 169, 182, 196, 210, 225, 240, 256, 272, 289, 306, 324,
+		342, 361, 380, 400, 420, 441, 462, 484, 506, 529, 552, 576,
+		600, 625, 650, 676, 702, 729, 756, 784, 812, 841, 870, 900,
+		930, 961, 992, 1024, 1056, 1089, 1122, 1156,
+	};
+
+	static const uint64_t mcalc_ncr_table[1190] = {
+		/* 0 */ 1ull,
+		/* 1 */ 1ull,
+		/* 2 */ 1ull, 2ull,
+		/* 3 */ 1ull, 3ull,
+		/* 4 */ 1ull, 4ull, 6ull,
+		/* 5 */ 1ull, 5ull, 10ull,
+		/* 6 */ 1ull, 6ull, 15ull, 20ull,
+		/* 7 */ 1ull, 7ull, 21ull, 35ull,
+		/* 8 */ 1ull, 8ull, 28ull, 56ull, 70ull,
+		/* 9 */ 1ull, 9ull, 36ull, 84ull, 126ull,
+		/* 10 */ 1ull, 10ull, 45ull, 120ull, 210ull, 252ull,
+		/* 11 */ 1ull, 11ull, 55ull, 165ull, 330ull, 462ull,
+		/* 12 */ 1ull, 12ull, 66ull, 220ull, 495ull, 792ull, 924ull,
+		/* 13 */ 1ull, 13ull, 78ull, 286ull, 715ull, 1287ull, 1716ull,
+		/* 14 */ 1ull, 14ull, 91ull, 364ull, 1001ull, 2002ull, 3003ull, 3432ull,
+		/* 15 */ 1ull, 15ull, 105ull, 455ull, 1365ull, 3003ull, 5005ull, 6435ull,
+		/* 16 */ 1ull, 16ull, 120ull, 560ull, 1820ull, 4368ull, 8008ull, 11440ull, 12870ull,
+		/* 17 */ 1ull, 17ull, 136ull, 680ull, 2380ull, 6188ull, 12376ull, 19448ull, 24310ull,
+		/* 18 */ 1ull, 18ull, 153ull, 816ull, 3060ull, 8568ull, 18564ull, 31824ull, 43758ull, 48620ull,
+		/* 19 */ 1ull, 19ull, 171ull, 969ull, 3876ull, 11628ull, 27132ull, 50388ull, 75582ull, 92378ull,
+		/* 20 */ 1ull, 20ull, 190ull, 1140ull, 4845ull, 15504ull, 38760ull, 77520ull, 125970ull, 167960ull,
+			184756ull,
+		/* 21 */ 1ull, 21ull, 210ull, 1330ull, 5985ull, 20349ull, 54264ull, 116280ull, 203490ull, 293930ull,
+			352716ull,
+		/* 22 */ 1ull, 22ull, 231ull, 1540ull, 7315ull, 26334ull, 74613ull, 170544ull, 319770ull, 497420ull,
+			646646ull, 705432ull,
+		/* 23 */ 1ull, 23ull, 253ull, 1771ull, 8855ull, 33649ull, 100947ull, 245157ull, 490314ull, 817190ull,
+			1144066ull, 1352078ull,
+		/* 24 */ 1ull, 24ull, 276ull, 2024ull, 10626ull, 42504ull, 134596ull, 346104ull, 735471ull,
+			1307504ull, 1961256ull, 2496144ull, 2704156ull,
+		/* 25 */ 1ull, 25ull, 300ull, 2300ull, 12650ull, 53130ull, 177100ull, 480700ull, 1081575ull,
+			2042975ull, 3268760ull, 4457400ull, 5200300ull,
+		/* 26 */ 1ull, 26ull, 325ull, 2600ull, 14950ull, 65780ull, 230230ull, 657800ull, 1562275ull,
+			3124550ull, 5311735ull, 7726160ull, 9657700ull, 10400600ull,
+		/* 27 */ 1ull, 27ull, 351ull, 2925ull, 17550ull, 80730ull, 296010ull, 888030ull, 2220075ull,
+			4686825ull, 8436285ull, 13037895ull, 17383860ull, 20058300ull,
+		/* 28 */ 1ull, 28ull, 378ull, 3276ull, 20475ull, 98280ull, 376740ull, 1184040ull, 3108105ull,
+			6906900ull, 13123110ull, 21474180ull, 30421755ull, 37442160ull, 40116600ull,
+		/* 29 */ 1ull, 29ull, 406ull, 3654ull, 23751ull, 118755ull, 475020ull, 1560780ull, 4292145ull,
+			10015005ull, 20030010ull, 34597290ull, 51895935ull, 67863915ull, 77558760ull,
+		/* 30 */ 1ull, 30ull, 435ull, 4060ull, 27405ull, 142506ull, 593775ull, 2035800ull, 5852925ull,
+			14307150ull, 30045015ull, 54627300ull, 86493225ull, 119759850ull, 145422675ull, 155117520ull,
+		/* 31 */ 1ull, 31ull, 465ull, 4495ull, 31465ull, 169911ull, 736281ull, 2629575ull, 7888725ull,
+			20160075ull, 44352165ull, 84672315ull, 141120525ull, 206253075ull, 265182525ull, 300540195ull,
+		/* 32 */ 1ull, 32ull, 496ull, 4960ull, 35960ull, 201376ull, 906192ull, 3365856ull, 10518300ull,
+			28048800ull, 64512240ull, 129024480ull, 225792840ull, 347373600ull, 471435600ull, 565722720ull,
+			601080390ull,
+		/* 33 */ 1ull, 33ull, 528ull, 5456ull, 40920ull, 237336ull, 1107568ull, 4272048ull, 13884156ull,
+			38567100ull, 92561040ull, 193536720ull, 354817320ull, 573166440ull, 818809200ull, 1037158320ull,
+			1166803110ull,
+		/* 34 */ 1ull, 34ull, 561ull, 5984ull, 46376ull, 278256ull, 1344904ull, 5379616ull, 18156204ull,
+			52451256ull, 131128140ull, 286097760ull, 548354040ull, 927983760ull, 1391975640ull, 1855967520ull,
+			2203961430ull, 2333606220ull,
+		/* 35 */ 1ull, 35ull, 595ull, 6545ull, 52360ull, 324632ull, 1623160ull, 6724520ull, 23535820ull,
+			70607460ull, 183579396ull, 417225900ull, 834451800ull, 1476337800ull, 2319959400ull,
+			3247943160ull, 4059928950ull, 4537567650ull,
+		/* 36 */ 1ull, 36ull, 630ull, 7140ull, 58905ull, 376992ull, 1947792ull, 8347680ull, 30260340ull,
+			94143280ull, 254186856ull, 600805296ull, 1251677700ull, 2310789600ull, 3796297200ull,
+			5567902560ull, 7307872110ull, 8597496600ull, 9075135300ull,
+		/* 37 */ 1ull, 37ull, 666ull, 7770ull, 66045ull, 435897ull, 2324784ull, 10295472ull, 38608020ull,
+			124403620ull, 348330136ull, 854992152ull, 1852482996ull, 3562467300ull, 6107086800ull,
+			9364199760ull, 12875774670ull, 15905368710ull, 17672631900ull,
+		/* 38 */ 1ull, 38ull, 703ull, 8436ull, 73815ull, 501942ull, 2760681ull, 12620256ull, 48903492ull,
+			163011640ull, 472733756ull, 1203322288ull, 2707475148ull, 5414950296ull, 9669554100ull,
+			15471286560ull, 22239974430ull, 28781143380ull, 33578000610ull, 35345263800ull,
+		/* 39 */ 1ull, 39ull, 741ull, 9139ull, 82251ull, 575757ull, 3262623ull, 15380937ull, 61523748ull,
+			211915132ull, 635745396ull, 1676056044ull, 3910797436ull, 8122425444ull, 15084504396ull,
+			25140840660ull, 37711260990ull, 51021117810ull, 62359143990ull, 68923264410ull,
+		/* 40 */ 1ull, 40ull, 780ull, 9880ull, 91390ull, 658008ull, 3838380ull, 18643560ull, 76904685ull,
+			273438880ull, 847660528ull, 2311801440ull, 5586853480ull, 12033222880ull, 23206929840ull,
+			40225345056ull, 62852101650ull, 88732378800ull, 113380261800ull, 131282408400ull, 137846528820ull,
+		/* 41 */ 1ull, 41ull, 820ull, 10660ull, 101270ull, 749398ull, 4496388ull, 22481940ull, 95548245ull,
+			350343565ull, 1121099408ull, 3159461968ull, 7898654920ull, 17620076360ull, 35240152720ull,
+			63432274896ull, 103077446706ull, 151584480450ull, 202112640600ull, 244662670200ull,
+			269128937220ull,
+		/* 42 */ 1ull, 42ull, 861ull, 11480ull, 111930ull, 850668ull, 5245786ull, 26978328ull, 118030185ull,
+			445891810ull, 1471442973ull, 4280561376ull, 11058116888ull, 25518731280ull, 52860229080ull,
+			98672427616ull, 166509721602ull, 254661927156ull, 353697121050ull, 446775310800ull,
+			513791607420ull, 538257874440ull,
+		/* 43 */ 1ull, 43ull, 903ull, 12341ull, 123410ull, 962598ull, 6096454ull, 32224114ull, 145008513ull,
+			563921995ull, 1917334783ull, 5752004349ull, 15338678264ull, 36576848168ull, 78378960360ull,
+			151532656696ull, 265182149218ull, 421171648758ull, 608359048206ull, 800472431850ull,
+			960566918220ull, 1052049481860ull,
+		/* 44 */ 1ull, 44ull, 946ull, 13244ull, 135751ull, 1086008ull, 7059052ull, 38320568ull, 177232627ull,
+			708930508ull, 2481256778ull, 7669339132ull, 21090682613ull, 51915526432ull, 114955808528ull,
+			229911617056ull, 416714805914ull, 686353797976ull, 1029530696964ull, 1408831480056ull,
+			1761039350070ull, 2012616400080ull, 2104098963720ull,
+		/* 45 */ 1ull, 45ull, 990ull, 14190ull, 148995ull, 1221759ull, 8145060ull, 45379620ull, 215553195ull,
+			886163135ull, 3190187286ull, 10150595910ull, 28760021745ull, 73006209045ull, 166871334960ull,
+			344867425584ull, 646626422970ull, 1103068603890ull, 1715884494940ull, 2438362177020ull,
+			3169870830126ull, 3773655750150ull, 4116715363800ull,
+		/* 46 */ 1ull, 46ull, 1035ull, 15180ull, 163185ull, 1370754ull, 9366819ull, 53524680ull, 260932815ull,
+			1101716330ull, 4076350421ull, 13340783196ull, 38910617655ull, 101766230790ull, 239877544005ull,
+			511738760544ull, 991493848554ull, 1749695026860ull, 2818953098830ull, 4154246671960ull,
+			5608233007146ull, 6943526580276ull, 7890371113950ull, 8233430727600ull,
+		/* 47 */ 1ull, 47ull, 1081ull, 16215ull, 178365ull, 1533939ull, 10737573ull, 62891499ull,
+			314457495ull, 1362649145ull, 5178066751ull, 17417133617ull, 52251400851ull, 140676848445ull,
+			341643774795ull, 751616304549ull, 1503232609098ull, 2741188875414ull, 4568648125690ull,
+			6973199770790ull, 9762479679106ull, 12551759587422ull, 14833897694226ull, 16123801841550ull,
+		/* 48 */ 1ull, 48ull, 1128ull, 17296ull, 194580ull, 1712304ull, 12271512ull, 73629072ull,
+			377348994ull, 1677106640ull, 6540715896ull, 22595200368ull, 69668534468ull, 192928249296ull,
+			482320623240ull, 1093260079344ull, 2254848913647ull, 4244421484512ull, 7309837001104ull,
+			11541847896480ull, 16735679449896ull, 22314239266528ull, 27385657281648ull, 30957699535776ull,
+			32247603683100ull,
+		/* 49 */ 1ull, 49ull, 1176ull, 18424ull, 211876ull, 1906884ull, 13983816ull, 85900584ull,
+			450978066ull, 2054455634ull, 8217822536ull, 29135916264ull, 92263734836ull, 262596783764ull,
+			675248872536ull, 1575580702584ull, 3348108992991ull, 6499270398159ull, 11554258485616ull,
+			18851684897584ull, 28277527346376ull, 39049918716424ull, 49699896548176ull, 58343356817424ull,
+			63205303218876ull,
+		/* 50 */ 1ull, 50ull, 1225ull, 19600ull, 230300ull, 2118760ull, 15890700ull, 99884400ull,
+			536878650ull, 2505433700ull, 10272278170ull, 37353738800ull, 121399651100ull, 354860518600ull,
+			937845656300ull, 2250829575120ull, 4923689695575ull, 9847379391150ull, 18053528883775ull,
+			30405943383200ull, 47129212243960ull, 67327446062800ull, 88749815264600ull, 108043253365600ull,
+			121548660036300ull, 126410606437752ull,
+		/* 51 */ 1ull, 51ull, 1275ull, 20825ull, 249900ull, 2349060ull, 18009460ull, 115775100ull,
+			636763050ull, 3042312350ull, 12777711870ull, 47626016970ull, 158753389900ull, 476260169700ull,
+			1292706174900ull, 3188675231420ull, 7174519270695ull, 14771069086725ull, 27900908274925ull,
+			48459472266975ull, 77535155627160ull, 114456658306760ull, 156077261327400ull, 196793068630200ull,
+			229591913401900ull, 247959266474052ull,
+		/* 52 */ 1ull, 52ull, 1326ull, 22100ull, 270725ull, 2598960ull, 20358520ull, 133784560ull,
+			752538150ull, 3679075400ull, 15820024220ull, 60403728840ull, 206379406870ull, 635013559600ull,
+			1768966344600ull, 4481381406320ull, 10363194502115ull, 21945588357420ull, 42671977361650ull,
+			76360380541900ull, 125994627894135ull, 191991813933920ull, 270533919634160ull, 352870329957600ull,
+			426384982032100ull, 477551179875952ull, 495918532948104ull,
+		/* 53 */ 1ull, 53ull, 1378ull, 23426ull, 292825ull, 2869685ull, 22957480ull, 154143080ull,
+			886322710ull, 4431613550ull, 19499099620ull, 76223753060ull, 266783135710ull, 841392966470ull,
+			2403979904200ull, 6250347750920ull, 14844575908435ull, 32308782859535ull, 64617565719070ull,
+			119032357903550ull, 202355008436035ull, 317986441828055ull, 462525733568080ull,
+			623404249591760ull, 779255311989700ull, 903936161908052ull, 973469712824056ull,
+		/* 54 */ 1ull, 54ull, 1431ull, 24804ull, 316251ull, 3162510ull, 25827165ull, 177100560ull,
+			1040465790ull, 5317936260ull, 23930713170ull, 95722852680ull, 343006888770ull, 1108176102180ull,
+			3245372870670ull, 8654327655120ull, 21094923659355ull, 47153358767970ull, 96926348578605ull,
+			183649923622620ull, 321387366339585ull, 520341450264090ull, 780512175396135ull,
+			1085929983159840ull, 1402659561581460ull, 1683191473897752ull, 1877405874732108ull,
+			1946939425648112ull,
+		/* 55 */ 1ull, 55ull, 1485ull, 26235ull, 341055ull, 3478761ull, 28989675ull, 202927725ull,
+			1217566350ull, 6358402050ull, 29248649430ull, 119653565850ull, 438729741450ull, 1451182990950ull,
+			4353548972850ull, 11899700525790ull, 29749251314475ull, 68248282427325ull, 144079707346575ull,
+			280576272201225ull, 505037289962205ull, 841728816603675ull, 1300853625660225ull,
+			1866442158555975ull, 2488589544741300ull, 3085851035479212ull, 3560597348629860ull,
+			3824345300380220ull,
+		/* 56 */ 1ull, 56ull, 1540ull, 27720ull, 367290ull, 3819816ull, 32468436ull, 231917400ull,
+			1420494075ull, 7575968400ull, 35607051480ull, 148902215280ull, 558383307300ull, 1889912732400ull,
+			5804731963800ull, 16253249498640ull, 41648951840265ull, 97997533741800ull, 212327989773900ull,
+			424655979547800ull, 785613562163430ull, 1346766106565880ull, 2142582442263900ull,
+			3167295784216200ull, 4355031703297275ull, 5574440580220512ull, 6646448384109072ull,
+			7384942649010080ull, 7648690600760440ull,
+		/* 57 */ 1ull, 57ull, 1596ull, 29260ull, 395010ull, 4187106ull, 36288252ull, 264385836ull,
+			1652411475ull, 8996462475ull, 43183019880ull, 184509266760ull, 707285522580ull, 2448296039700ull,
+			7694644696200ull, 22057981462440ull, 57902201338905ull, 139646485582065ull, 310325523515700ull,
+			636983969321700ull, 1210269541711230ull, 2132379668729310ull, 3489348548829780ull,
+			5309878226480100ull, 7522327487513475ull, 9929472283517787ull, 12220888964329584ull,
+			14031391033119152ull, 15033633249770520ull,
+		/* 58 */ 1ull, 58ull, 1653ull, 30856ull, 424270ull, 4582116ull, 40475358ull, 300674088ull,
+			1916797311ull, 10648873950ull, 52179482355ull, 227692286640ull, 891794789340ull, 3155581562280ull,
+			10142940735900ull, 29752626158640ull, 79960182801345ull, 197548686920970ull, 449972009097765ull,
+			947309492837400ull, 1847253511032930ull, 3342649210440540ull, 5621728217559090ull,
+			8799226775309880ull, 12832205713993575ull, 17451799771031262ull, 22150361247847371ull,
+			26252279997448736ull, 29065024282889672ull, 30067266499541040ull,
+		/* 59 */ 1ull, 59ull, 1711ull, 32509ull, 455126ull, 5006386ull, 45057474ull, 341149446ull,
+			2217471399ull, 12565671261ull, 62828356305ull, 279871768995ull, 1119487075980ull,
+			4047376351620ull, 13298522298180ull, 39895566894540ull, 109712808959985ull, 277508869722315ull,
+			647520696018735ull, 1397281501935165ull, 2794563003870330ull, 5189902721473470ull,
+			8964377427999630ull, 14420954992868970ull, 21631432489303455ull, 30284005485024837ull,
+			39602161018878633ull, 48402641245296107ull, 55317304280338408ull, 59132290782430712ull,
+		/* 60 */ 1ull, 60ull, 1770ull, 34220ull, 487635ull, 5461512ull, 50063860ull, 386206920ull,
+			2558620845ull, 14783142660ull, 75394027566ull, 342700125300ull, 1399358844975ull,
+			5166863427600ull, 17345898649800ull, 53194089192720ull, 149608375854525ull, 387221678682300ull,
+			925029565741050ull, 2044802197953900ull, 4191844505805495ull, 7984465725343800ull,
+			14154280149473100ull, 23385332420868600ull, 36052387482172425ull, 51915437974328292ull,
+			69886166503903470ull, 88004802264174740ull, 103719945525634515ull, 114449595062769120ull,
+			118264581564861424ull,
+		/* 61 */ 1ull, 61ull, 1830ull, 35990ull, 521855ull, 5949147ull, 55525372ull, 436270780ull,
+			2944827765ull, 17341763505ull, 90177170226ull, 418094152866ull, 1742058970275ull,
+			6566222272575ull, 22512762077400ull, 70539987842520ull, 202802465047245ull, 536830054536825ull,
+			1312251244423350ull, 2969831763694950ull, 6236646703759395ull, 12176310231149295ull,
+			22138745874816900ull, 37539612570341700ull, 59437719903041025ull, 87967825456500717ull,
+			121801604478231762ull, 157890968768078210ull, 191724747789809255ull, 218169540588403635ull,
+			232714176627630544ull,
+		/* 62 */ 1ull, 62ull, 1891ull, 37820ull, 557845ull, 6471002ull, 61474519ull, 491796152ull,
+			3381098545ull, 20286591270ull, 107518933731ull, 508271323092ull, 2160153123141ull,
+			8308281242850ull, 29078984349975ull, 93052749919920ull, 273342452889765ull, 739632519584070ull,
+			1849081298960175ull, 4282083008118300ull, 9206478467454345ull, 18412956934908690ull,
+			34315056105966195ull, 59678358445158600ull, 96977332473382725ull, 147405545359541742ull,
+			209769429934732479ull, 279692573246309972ull, 349615716557887465ull, 409894288378212890ull,
+			450883717216034179ull, 465428353255261088ull,
+		/* 63 */ 1ull, 63ull, 1953ull, 39711ull, 595665ull, 7028847ull, 67945521ull, 553270671ull,
+			3872894697ull, 23667689815ull, 127805525001ull, 615790256823ull, 2668424446233ull,
+			10468434365991ull, 37387265592825ull, 122131734269895ull, 366395202809685ull, 1012974972473835ull,
+			2588713818544245ull, 6131164307078475ull, 13488561475572645ull, 27619435402363035ull,
+			52728013040874885ull, 93993414551124795ull, 156655690918541325ull, 244382877832924467ull,
+			357174975294274221ull, 489462003181042451ull, 629308289804197437ull, 759510004936100355ull,
+			860778005594247069ull, 916312070471295267ull,
+		/* 64 */ 1ull, 64ull, 2016ull, 41664ull, 635376ull, 7624512ull, 74974368ull, 621216192ull,
+			4426165368ull, 27540584512ull, 151473214816ull, 743595781824ull, 3284214703056ull,
+			13136858812224ull, 47855699958816ull, 159518999862720ull, 488526937079580ull, 1379370175283520ull,
+			3601688791018080ull, 8719878125622720ull, 19619725782651120ull, 41107996877935680ull,
+			80347448443237920ull, 146721427591999680ull, 250649105469666120ull, 401038568751465792ull,
+			601557853127198688ull, 846636978475316672ull, 1118770292985239888ull, 1388818294740297792ull,
+			1620288010530347424ull, 1777090076065542336ull, 1832624140942590534ull,
+		/* 65 */ 1ull, 65ull, 2080ull, 43680ull, 677040ull, 8259888ull, 82598880ull, 696190560ull,
+			5047381560ull, 31966749880ull, 179013799328ull, 895068996640ull, 4027810484880ull,
+			16421073515280ull, 60992558771040ull, 207374699821536ull, 648045936942300ull, 1867897112363100ull,
+			4981058966301600ull, 12321566916640800ull, 28339603908273840ull, 60727722660586800ull,
+			121455445321173600ull, 227068876035237600ull, 397370533061665800ull, 651687674221131912ull,
+			1002596421878664480ull, 1448194831602515360ull, 1965407271460556560ull, 2507588587725537680ull,
+			3009106305270645216ull, 3397378086595889760ull, 3609714217008132870ull,
+		/* 66 */ 1ull, 66ull, 2145ull, 45760ull, 720720ull, 8936928ull, 90858768ull, 778789440ull,
+			5743572120ull, 37014131440ull, 210980549208ull, 1074082795968ull, 4922879481520ull,
+			20448884000160ull, 77413632286320ull, 268367258592576ull, 855420636763836ull, 2515943049305400ull,
+			6848956078664700ull, 17302625882942400ull, 40661170824914640ull, 89067326568860640ull,
+			182183167981760400ull, 348524321356411200ull, 624439409096903400ull, 1049058207282797712ull,
+			1654284096099796392ull, 2450791253481179840ull, 3413602103063071920ull, 4472995859186094240ull,
+			5516694892996182896ull, 6406484391866534976ull, 7007092303604022630ull, 7219428434016265740ull,
+		/* 67 */ 1ull, 67ull, 2211ull, 47905ull, 766480ull, 9657648ull, 99795696ull, 869648208ull,
+			6522361560ull, 42757703560ull, 247994680648ull, 1285063345176ull, 5996962277488ull,
+			25371763481680ull, 97862516286480ull, 345780890878896ull, 1123787895356412ull,
+			3371363686069236ull, 9364899127970100ull, 24151581961607100ull, 57963796707857040ull,
+			129728497393775280ull, 271250494550621040ull, 530707489338171600ull, 972963730453314600ull,
+			1673497616379701112ull, 2703342303382594104ull, 4105075349580976232ull, 5864393356544251760ull,
+			7886597962249166160ull, 9989690752182277136ull, 11923179284862717872ull, 13413576695470557606ull,
+			14226520737620288370ull,
+	};
+#endif
@@ -0,0 +1,145 @@
+/**
+ *
+ * @Name : MysqlCalc
+ * @Version : 1.0
+ * @Programmer : Max
+ * @Date : 2019-11-02
+ * @Released under : https://github.com/BaseMax/MysqlCalc/blob/master/LICENSE
+ * @Repository : https://github.com/BaseMax/MysqlCalc
+ *
+**/
+/*
+** Process-wide registry of the functions of mcalc_define().
+**
+** Every compile may look functions up while they only change when someone
+** defines one, so readers take no lock. The functions are an immutable set
+** behind an atomic pointer: a change copies the set, swaps the pointer and
+** frees the old set once the readers that may still hold it are gone, as in
+** RCU. Readers count themselves in one of two counters picked by the parity
+** of a global epoch, in a per-thread stripe as for the statistics, and the
+** writer moves the epoch on and waits for the counter of the one it closed.
+*/
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "definitions.h"
+
+struct mcalc_definitions_set {
+	std::unordered_map<std::string, std::shared_ptr<mcalc_definition> > functions;
+	unsigned long long generation;
+};
+
+namespace {
+
+const unsigned stripe_count = 16;
+
+struct alignas(64) stripe {
+	std::atomic<unsigned long> readers[2]; // By parity of the epoch they entered in.
+};
+
+stripe stripes[stripe_count];
+std::atomic<unsigned> next_stripe(0);
+thread_local int own_stripe = -1;
+
+std::atomic<unsigned> epoch(0);
+std::atomic<const mcalc_definitions_set *> current(nullptr); // No set while nothing is defined.
+std::atomic<unsigned long long> generation(0);
+std::mutex writers; // Changes are made one at a time.
+
+stripe &own() {
+	if (own_stripe < 0) own_stripe = next_stripe.fetch_add(1, std::memory_order_relaxed) % stripe_count;
+	return stripes[own_stripe];
+}
+
+const mcalc_definition *resolve(void *context, const char *name, size_t length) {
+	const mcalc_definitions_set *set = (const mcalc_definitions_set *)context;
+	auto found = set->functions.find(std::string(name, length));
+	return found == set->functions.end() ? 0 : found->second.get();
+}
+
+// A copy of the current set to change, with `writers` locked.
+mcalc_definitions_set *copy_current() {
+	const mcalc_definitions_set *set = current.load();
+	return set ? new mcalc_definitions_set(*set) : new mcalc_definitions_set();
+}
+
+// Replaces the current set, with `writers` locked.
+void publish(mcalc_definitions_set *next) {
+	next->generation = generation.load() + 1;
+	const mcalc_definitions_set *old = current.exchange(next);
+	generation.store(next->generation);
+	// Readers entering from now on see `next`; those of the closed epoch may still hold `old`.
+	// The previous change already waited for the ones of the epoch before.
+	const unsigned closed = epoch.fetch_add(1);
+	for (;;) {
+		unsigned long readers = 0;
+		for (unsigned i = 0; i < stripe_count; i++) readers += stripes[i].readers[closed & 1].load();
+		if (!readers) break;
+		std::this_thread::yield();
+	}
+	delete old;
+}
+
+} // namespace
+
+mcalc_definitions_reader::mcalc_definitions_reader() {
+	stripe &s = own();
+	// Counted in the epoch read, unless a writer closed it meanwhile and might not have seen us.
+	for (;;) {
+		entered = epoch.load();
+		s.readers[entered & 1].fetch_add(1);
+		if (epoch.load() == entered) break;
+		s.readers[entered & 1].fetch_sub(1);
+	}
+	held = current.load();
+}
+
+mcalc_definitions_reader::~mcalc_definitions_reader() {
+	own().readers[entered & 1].fetch_sub(1, std::memory_order_release);
+}
+
+void mcalc_definitions_reader::bind(mcalc_options *options) const {
+	if (!held) return;
+	options->resolve = resolve;
+	options->resolve_context = (void *)held;
+}
+
+unsigned long long mcalc_definitions_reader::generation() const {
+	return held ? held->generation : 0;
+}
+
+bool mcalc_definitions_define(const std::string &text, int *error) {
+	mcalc_definition *d;
+	{
+		// Calls of other functions are inlined now, with their current bodies.
+		mcalc_definitions_reader reader;
+		mcalc_options options = {};
+		reader.bind(&options);
+		d = mcalc_definition_create(text.data(), text.size(), &options, error);
+	}
+	if (!d) return false;
+	std::shared_ptr<mcalc_definition> owned(d, mcalc_definition_free);
+	std::lock_guard<std::mutex> guard(writers);
+	mcalc_definitions_set *next = copy_current();
+	next->functions[mcalc_definition_name(d)] = owned;
+	publish(next);
+	return true;
+}
+
+bool mcalc_definitions_remove(const std::string &name) {
+	std::lock_guard<std::mutex> guard(writers);
+	const mcalc_definitions_set *set = current.load();
+	if (!set || !set->functions.count(name)) return false;
+	mcalc_definitions_set *next = copy_current();
+	next->functions.erase(name);
+	publish(next);
+	return true;
+}
+
+unsigned long long mcalc_definitions_generation() {
+	return generation.load();
+}
@@ -0,0 +1,37 @@
+#ifndef __MCALC_DEFINITIONS_H__
+	#define __MCALC_DEFINITIONS_H__
+
+	#include <stddef.h>
+
+	#include <string>
+
+	#include "evaluation.h"
+
+	// The process-wide functions of mcalc_define(), e.g. 'margin(p, c) = (p - c)/p'.
+	// Defining replaces any function of the same name, for the formulas compiled from then on.
+	// On a syntax error false is returned and *error holds the position.
+	bool mcalc_definitions_define(const std::string &text, int *error);
+	// False if there is no function of that name.
+	bool mcalc_definitions_remove(const std::string &name);
+	// Bumped by every change, for caches of compiled formulas.
+	unsigned long long mcalc_definitions_generation();
+
+	struct mcalc_definitions_set;
+
+	// Keeps the functions defined when it was created for as long as it lives, without taking
+	// a lock: changes publish a new set and only free the old one once no reader holds it.
+	class mcalc_definitions_reader {
+	public:
+		mcalc_definitions_reader();
+		~mcalc_definitions_reader();
+		// Lets formulas compiled with `options` call the functions.
+		void bind(mcalc_options *options) const;
+		unsigned long long generation() const;
+
+	private:
+		mcalc_definitions_reader(const mcalc_definitions_reader &);
+		mcalc_definitions_reader &operator=(const mcalc_definitions_reader &);
+		unsigned entered; // Epoch the reader is counted in.
+		const mcalc_definitions_set *held;
+	};
+#endif
@@ -1,9 +1,19 @@
 #include "evaluation.h"
+#include "program.h"
+#include "stats.h"
+#include "combinatorics.h"
+#include "vmath.h"
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
 #include <stdio.h>
 #include <limits.h>
+#include <float.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <locale.h>
+#include <stdarg.h>
+#include <assert.h>
 
 #ifndef NAN
 	#define NAN (0.0/0.0)
@@ -17,99 +27,250 @@ typedef double (*mcalc_fun2)(double, double);
 
 enum {
 	TOK_NULL = MCALC_CLOSURE7+1, TOK_ERROR, TOK_END, TOK_SEP,
-	TOK_OPEN, TOK_CLOSE, TOK_NUMBER, TOK_VARIABLE, TOK_INFIX
+	TOK_OPEN, TOK_CLOSE, TOK_NUMBER, TOK_VARIABLE, TOK_INFIX, TOK_END_FORMULA,
+	TOK_AND, TOK_OR, TOK_QUESTION, TOK_COLON, TOK_IF, TOK_CALL
 };
 
-enum {MCALC_CONSTANT = 1};
+/* MCALC_BRANCH evaluates parameters[0], then only one of parameters[1] (not zero) or parameters[2] (zero). */
+enum {MCALC_CONSTANT = 1, MCALC_BRANCH = 2};
 
 typedef struct state {
 	const char *start;
 	const char *next;
+	const char *end;
 	int type;
 	union {double value; const double *bound; const void *function;};
 	void *context;
 	const mcalc_variable *lookup;
 	int lookup_len;
+	const mcalc_scope *scope;
+	const mcalc_scope *lookup_scope; /* Hashed `lookup` when it is long. */
+	mcalc_arena *arena;
+	int flags;
+	unsigned nodes; /* Allocated so far, for the statistics. */
+	unsigned expanded; /* Copied from definition bodies, at most EXPANDED_NODES. */
+	double *results; /* mcalc_compile_multi: where the formulas store their values, */
+	int capacity, count; /* how many fit there and how many were parsed. */
+	mcalc_resolver resolve; /* Finds the definitions, */
+	void *resolve_context;
+	const mcalc_definition *definition; /* and the one called by a TOK_CALL. */
+	int max_depth; /* Frames the parser may stack. */
+	int out_of_memory; /* An allocation failed, the compile fails with it. */
+	int too_deep; /* max_depth was reached, the compile fails with MCALC_TOO_DEEP. */
 } state;
 
 #define TYPE_MASK(TYPE) ((TYPE)&0x0000001F)
 #define IS_PURE(TYPE) (((TYPE) & MCALC_FLAG_PURE) != 0)
 #define IS_FUNCTION(TYPE) (((TYPE) & MCALC_FUNCTION0) != 0)
 #define IS_CLOSURE(TYPE) (((TYPE) & MCALC_CLOSURE0) != 0)
-#define ARITY(TYPE) ( ((TYPE) & (MCALC_FUNCTION0 | MCALC_CLOSURE0)) ? ((TYPE) & 0x00000007) : 0 )
-#define NEW_EXPR(type, ...) new_expr((type), (const mcalc_expr*[]){__VA_ARGS__})
+#define ARITY(TYPE) ( ((TYPE) & (MCALC_FUNCTION0 | MCALC_CLOSURE0)) ? ((TYPE) & 0x00000007) : TYPE_MASK(TYPE) == MCALC_BRANCH ? 3 : 0 )
+#define NEW_EXPR(type, ...) new_expr(s, (type), (const mcalc_expr*[]){__VA_ARGS__})
 
-static mcalc_expr *new_expr(const int type, const mcalc_expr *parameters[]) {
+struct mcalc_arena_block {
+	mcalc_arena_block *next;
+	size_t size;
+	double data[1];
+};
+
+#define ARENA_ALIGN(SIZE) (((SIZE) + sizeof(double) - 1) & ~(sizeof(double) - 1))
+#define ARENA_BLOCK 4096
+
+void mcalc_arena_init(mcalc_arena *a, void *buffer, size_t size) {
+	a->buffer = buffer;
+	a->buffer_size = buffer ? size : 0;
+	a->blocks = 0;
+	mcalc_arena_reset(a);
+}
+
+void mcalc_arena_reset(mcalc_arena *a) {
+	/* Start over from the caller's buffer, or the first block; the blocks are kept for reuse. */
+	if (a->buffer) {
+		a->current = 0;
+		a->next = a->buffer;
+		a->end = a->next + a->buffer_size;
+	} else if (a->blocks) {
+		a->current = a->blocks;
+		a->next = (char*)a->blocks->data;
+		a->end = a->next + a->blocks->size;
+	} else {
+		a->current = 0;
+		a->next = a->end = 0;
+	}
+}
+
+static void free_blocks(mcalc_arena_block *b) {
+	while (b) {
+		mcalc_arena_block *next = b->next;
+		free(b);
+		b = next;
+	}
+}
+
+void mcalc_arena_release(mcalc_arena *a) {
+	free_blocks(a->blocks);
+	a->blocks = 0;
+	mcalc_arena_reset(a);
+}
+
+void *mcalc_arena_alloc(mcalc_arena *a, size_t size) {
+	size = ARENA_ALIGN(size);
+	if ((size_t)(a->end - a->next) < size) {
+		/* Move on to the next kept block if it is big enough, else chain a new one in front of it. */
+		mcalc_arena_block **link = a->current ? &a->current->next : &a->blocks;
+		mcalc_arena_block *b = *link;
+		if (!b || b->size < size) {
+			const size_t bytes = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+			b = malloc(sizeof(mcalc_arena_block) - sizeof(double) + bytes);
+			if (!b) return 0;
+			b->size = bytes;
+			b->next = *link;
+			*link = b;
+		}
+		a->current = b;
+		a->next = (char*)b->data;
+		a->end = a->next + b->size;
+	}
+	void *ret = a->next;
+	a->next += size;
+	return ret;
+}
+
+static size_t expr_size(const int type) {
+	return (sizeof(mcalc_expr) - sizeof(void*)) + sizeof(void*) * ARITY(type) + (IS_CLOSURE(type) ? sizeof(void*) : 0);
+}
+
+static void *allocate(state *s, size_t size) {
+	/* Out of memory stops the parser like a syntax error, see compile(). */
+	void *ret = mcalc_arena_alloc(s->arena, size);
+	if (!ret) {
+		s->out_of_memory = 1;
+		s->type = TOK_ERROR;
+	}
+	return ret;
+}
+
+static int depth_of(const mcalc_expr *n) {
+	/* One more than the deepest operand, from the depths the operands have now. */
+	const int arity = ARITY(n->type);
+	int i, depth = 0;
+	for (i = 0; i < arity; i++) {
+		const mcalc_expr *p = n->parameters[i];
+		if (p && p->depth > depth) depth = p->depth;
+	}
+	return depth + 1;
+}
+
+static mcalc_expr *measure(state *s, mcalc_expr *n) {
+	/* Sets the depth of a node once its operands are in place. Every pass over a tree recurses
+	 * into it, so a node deeper than max_depth stops the parser like a syntax error. */
+	if (!n) return 0;
+	n->depth = depth_of(n);
+	if (n->depth > s->max_depth) {
+		s->too_deep = 1;
+		s->type = TOK_ERROR;
+		return 0;
+	}
+	return n;
+}
+
+static mcalc_expr *new_expr(state *s, const int type, const mcalc_expr *parameters[]) {
 	const int arity = ARITY(type);
-	const int psize = sizeof(void*) * arity;
-	const int size = (sizeof(mcalc_expr) - sizeof(void*)) + psize + (IS_CLOSURE(type) ? sizeof(void*) : 0);
-	mcalc_expr *ret = malloc(size);
+	const size_t size = expr_size(type);
+	mcalc_expr *ret = allocate(s, size);
+	if (!ret) return 0;
 	memset(ret, 0, size);
 	if (arity && parameters) {
-		memcpy(ret->parameters, parameters, psize);
+		memcpy(ret->parameters, parameters, sizeof(void*) * arity);
 	}
 	ret->type = type;
+	ret->depth = 1;
 	ret->bound = 0;
-	return ret;
+	s->nodes++;
+	return arity && parameters ? measure(s, ret) : ret;
 }
 
-void mcalc_free_parameters(mcalc_expr *n) {
-	if (!n) return;
-	switch (TYPE_MASK(n->type)) {
-		case MCALC_FUNCTION7: case MCALC_CLOSURE7: mcalc_free(n->parameters[6]);     /* Falls through. */
-		case MCALC_FUNCTION6: case MCALC_CLOSURE6: mcalc_free(n->parameters[5]);     /* Falls through. */
-		case MCALC_FUNCTION5: case MCALC_CLOSURE5: mcalc_free(n->parameters[4]);     /* Falls through. */
-		case MCALC_FUNCTION4: case MCALC_CLOSURE4: mcalc_free(n->parameters[3]);     /* Falls through. */
-		case MCALC_FUNCTION3: case MCALC_CLOSURE3: mcalc_free(n->parameters[2]);     /* Falls through. */
-		case MCALC_FUNCTION2: case MCALC_CLOSURE2: mcalc_free(n->parameters[1]);     /* Falls through. */
-		case MCALC_FUNCTION1: case MCALC_CLOSURE1: mcalc_free(n->parameters[0]);
-	}
-}
+/* A tree returned by mcalc_compile owns its arena: the block list is stored right before the root. */
+typedef struct owned_root {
+	mcalc_arena_block *blocks;
+	mcalc_expr root;
+} owned_root;
 
 void mcalc_free(mcalc_expr *n) {
 	if (!n) return;
-	mcalc_free_parameters(n);
-	free(n);
+	free_blocks(((owned_root*)((char*)n - offsetof(owned_root, root)))->blocks);
 }
 
 static double pi(void) {return 3.14159265358979323846;}
 
 static double e(void) {return 2.71828182845904523536;}
 
-static double fac(double a) {/* simplest version of fac */
+/* Exact n!, 0 when it does not fit in 64 bits. */
+static uint64_t int_fac(uint64_t n) {
+	return n <= MCALC_FAC_MAX ? mcalc_fac_table[n] : 0;
+}
+
+/* Exact ncr(n, r) for r <= n, 0 when it (or, past the table, an intermediate product) does not fit in 64 bits. */
+static uint64_t int_ncr(uint64_t n, uint64_t r) {
+	uint64_t result = 1, i;
+	if (r > n / 2) r = n - r;
+	if (n <= MCALC_NCR_MAX) return mcalc_ncr_table[mcalc_ncr_rows[n] + r];
+	for (i = 1; i <= r; i++) {
+		if (result > UINT64_MAX / (n - r + i)) return 0;
+		result = result * (n - r + i) / i; /* ncr(n - r + i, i) * i, divisible by i */
+	}
+	return result;
+}
+
+/* Exact npr(n, r) = n!/(n-r)! for r <= n, 0 when it does not fit in 64 bits. */
+static uint64_t int_npr(uint64_t n, uint64_t r) {
+	uint64_t result = 1, i;
+	if (n <= MCALC_FAC_MAX) return mcalc_fac_table[n] / mcalc_fac_table[n - r];
+	for (i = n - r + 1; i <= n; i++) {
+		if (result > UINT64_MAX / i) return 0;
+		result *= i;
+	}
+	return result;
+}
+
+static double fac(double a) {
 	if (a < 0.0)
 		return NAN;
 	if (a > UINT_MAX)
 		return INFINITY;
-	unsigned int ua = (unsigned int)(a);
-	unsigned long int result = 1, i;
-	for (i = 1; i <= ua; i++) {
-		if (i > ULONG_MAX / result)
-			return INFINITY;
-		result *= i;
-	}
-	return (double)result;
+	const uint64_t result = int_fac((unsigned int)a);
+	return result ? (double)result : INFINITY;
 }
 
 static double ncr(double n, double r) {
 	if (n < 0.0 || r < 0.0 || n < r) return NAN;
 	if (n > UINT_MAX || r > UINT_MAX) return INFINITY;
-	unsigned long int un = (unsigned int)(n), ur = (unsigned int)(r), i;
-	unsigned long int result = 1;
-	if (ur > un / 2) ur = un - ur;
-	for (i = 1; i <= ur; i++) {
-		if (result > ULONG_MAX / (un - ur + i))
-			return INFINITY;
-		result *= un - ur + i;
-		result /= i;
-	}
-	return result;
+	const uint64_t result = int_ncr((unsigned int)n, (unsigned int)r);
+	return result ? (double)result : INFINITY;
+}
+
+static double npr(double n, double r) {
+	if (n < 0.0 || r < 0.0 || n < r) return NAN;
+	if (n > UINT_MAX || r > UINT_MAX) return INFINITY;
+	const unsigned int un = (unsigned int)n, ur = (unsigned int)r;
+	const uint64_t result = int_npr(un, ur);
+	if (result) return (double)result;
+	/* Past 64 bits: exact in 128 bits while it fits, then rounded at every step. */
+	unsigned __int128 exact = 1;
+	unsigned int i = un - ur + 1;
+	for (; i <= un && exact <= ~(unsigned __int128)0 / i; i++) exact *= i;
+	double product = (double)exact;
+	for (; i <= un && product < INFINITY; i++) product *= i;
+	return product;
 }
 
-static double npr(double n, double r) {return ncr(n, r) * fac(r);}
+double mcalc_fac(double a) {return fac(a);}
+
+double mcalc_ncr(double n, double r) {return ncr(n, r);}
+
+double mcalc_npr(double n, double r) {return npr(n, r);}
 
 static const mcalc_variable functions[] = {
-	/* must be in alphabetical order */
+	/* alphabetical order; builtin_slots indexes into this table */
 	{"abs", fabs,     MCALC_FUNCTION1 | MCALC_FLAG_PURE, 0},
 	{"acos", acos,    MCALC_FUNCTION1 | MCALC_FLAG_PURE, 0},
 	{"asin", asin,    MCALC_FUNCTION1 | MCALC_FLAG_PURE, 0},
@@ -141,20 +302,99 @@ static const mcalc_variable functions[] = {
 	{0, 0, 0, 0}
 };
 
+/* Perfect hash of the builtin names: slot = (first + 13 * last + 28 * length + middle) % 64.
+ * Indexes into functions[], -1 is empty. Recompute the factors if a builtin is added. */
+static const signed char builtin_slots[64] = {
+	-1, -1, -1, -1, -1, -1, 19,  8,  3, -1, -1, -1, -1, -1,  7, 14,
+	 2, -1, -1, -1, -1, -1, -1,  1,  4, 20, 23, -1, -1, -1, -1, -1,
+	-1,  9, 10, -1, -1, -1, 17, -1, 12, -1, 13, 11, -1, -1,  0, 15,
+	-1, -1, -1, -1, -1, -1, -1, -1,  5, 21, -1, -1, 16,  6, 18, 22,
+};
+
 static const mcalc_variable *find_builtin(const char *name, int len) {
-	int imin = 0;
-	int imax = sizeof(functions) / sizeof(mcalc_variable) - 2;
-	/*Binary search.*/
-	while (imax >= imin) {
-		const int i = (imin + ((imax-imin)/2));
-		int c = strncmp(name, functions[i].name, len);
-		if (!c) c = '\0' - functions[i].name[len];
-		if (c == 0) {
-			return functions + i;
-		} else if (c > 0) {
-			imin = i + 1;
-		} else {
-			imax = i - 1;
+	const unsigned char *u = (const unsigned char*)name;
+	const int i = builtin_slots[(u[0] + 13 * u[len - 1] + 28 * len + u[len / 2]) % 64];
+	if (i < 0 || strncmp(name, functions[i].name, len) != 0 || functions[i].name[len] != '\0') return 0;
+	return functions + i;
+}
+
+#ifndef NDEBUG
+/* builtin_slots is computed by hand: every builtin has to find itself. */
+__attribute__((constructor)) static void check_builtin_slots(void) {
+	const mcalc_variable *f;
+	for (f = functions; f->name; f++) assert(find_builtin(f->name, strlen(f->name)) == f);
+}
+#endif
+
+typedef struct scope_slot {
+	unsigned hash;
+	const mcalc_variable *var;
+} scope_slot;
+
+struct mcalc_scope {
+	unsigned mask;
+	scope_slot slots[1];
+};
+
+static unsigned hash_name(const char *name, int len) {
+	/* FNV-1a */
+	unsigned h = 2166136261u;
+	int i;
+	for (i = 0; i < len; i++) h = (h ^ (unsigned char)name[i]) * 16777619u;
+	return h;
+}
+
+static size_t scope_size(int var_count) {
+	unsigned capacity = 8;
+	while (capacity < 2u * var_count) capacity *= 2;
+	return sizeof(mcalc_scope) + sizeof(scope_slot) * (capacity - 1);
+}
+
+static mcalc_scope *fill_scope(mcalc_scope *scope, const mcalc_variable *variables, int var_count) {
+	/* Open addressing; the first of several variables with the same name wins, as in a linear search. */
+	unsigned capacity = 8;
+	int i;
+	if (!scope) return 0;
+	while (capacity < 2u * var_count) capacity *= 2;
+	scope->mask = capacity - 1;
+	memset(scope->slots, 0, sizeof(scope_slot) * capacity);
+	for (i = 0; i < var_count; i++) {
+		const char *name = variables[i].name;
+		const int len = strlen(name);
+		const unsigned h = hash_name(name, len);
+		unsigned j = h & scope->mask;
+		for (; scope->slots[j].var; j = (j + 1) & scope->mask) {
+			if (scope->slots[j].hash == h && strcmp(scope->slots[j].var->name, name) == 0) break;
+		}
+		if (!scope->slots[j].var) {
+			scope->slots[j].hash = h;
+			scope->slots[j].var = variables + i;
+		}
+	}
+	return scope;
+}
+
+mcalc_scope *mcalc_scope_create(const mcalc_variable *variables, int var_count) {
+	/* The entries are copied next to the table; only their names must outlive the scope. */
+	const size_t size = scope_size(var_count);
+	mcalc_scope *scope = malloc(size + sizeof(mcalc_variable) * var_count);
+	if (!scope) return 0;
+	mcalc_variable *copy = (mcalc_variable*)((char*)scope + size);
+	memcpy(copy, variables, sizeof(mcalc_variable) * var_count);
+	return fill_scope(scope, copy, var_count);
+}
+
+void mcalc_scope_free(mcalc_scope *scope) {
+	free(scope);
+}
+
+static const mcalc_variable *find_in_scope(const mcalc_scope *scope, const char *name, int len) {
+	const unsigned h = hash_name(name, len);
+	unsigned j = h & scope->mask;
+	for (; scope->slots[j].var; j = (j + 1) & scope->mask) {
+		const mcalc_variable *var = scope->slots[j].var;
+		if (scope->slots[j].hash == h && strncmp(name, var->name, len) == 0 && var->name[len] == '\0') {
+			return var;
 		}
 	}
 	return 0;
@@ -163,6 +403,8 @@ static const mcalc_variable *find_builtin(const char *name, int len) {
 static const mcalc_variable *find_lookup(const state *s, const char *name, int len) {
 	int iters;
 	const mcalc_variable *var;
+	if (s->scope && (var = find_in_scope(s->scope, name, len))) return var;
+	if (s->lookup_scope) return find_in_scope(s->lookup_scope, name, len);
 	if (!s->lookup) return 0;
 	for (var = s->lookup, iters = s->lookup_len; iters; ++var, --iters) {
 		if (strncmp(name, var->name, len) == 0 && var->name[len] == '\0') {
@@ -182,25 +424,177 @@ static double divide(double a, double b) {return a / b;}
 
 static double negate(double a) {return -a;}
 
+/* fmod, through int64 when both sides are integers below 2^53, where it is exact and much cheaper. */
+static double mod(double a, double b) {
+	if (fabs(a) < 9007199254740992.0 && fabs(b) < 9007199254740992.0 && b != 0 && a == (int64_t)a && b == (int64_t)b) {
+		const int64_t r = (int64_t)a % (int64_t)b;
+		return r ? (double)r : copysign(0.0, a);
+	}
+	return fmod(a, b);
+}
+
 static double comma(double a, double b) {(void)a; return b;}
 
+/* Comparisons give 1 or 0, and are false when either side is NaN except for !=. */
+static double less(double a, double b) {return a < b;}
+
+static double less_equal(double a, double b) {return a <= b;}
+
+static double greater(double a, double b) {return a > b;}
+
+static double greater_equal(double a, double b) {return a >= b;}
+
+static double equal(double a, double b) {return a == b;}
+
+static double not_equal(double a, double b) {return a != b;}
+
+/* A branch whose sides are cheap enough to compute both, see simplify(). */
+static double choose(double c, double a, double b) {return c != 0 ? a : b;}
+
+double mcalc_mod(double a, double b) {return mod(a, b);}
+
+const mcalc_builtin mcalc_builtins[] = {
+	{pow, 2}, {mod, 2}, {negate, 1}, {comma, 2}, {add, 2}, {sub, 2}, {mul, 2}, {divide, 2},
+	{fabs, 1}, {acos, 1}, {asin, 1}, {atan, 1}, {atan2, 2}, {ceil, 1}, {cos, 1}, {cosh, 1},
+	{e, 0}, {exp, 1}, {fac, 1}, {floor, 1}, {log, 1}, {log10, 1}, {ncr, 2}, {npr, 2},
+	{pi, 0}, {sin, 1}, {sinh, 1}, {sqrt, 1}, {tan, 1}, {tanh, 1},
+	{mcalc_vmath_exp, 1}, {mcalc_vmath_log, 1}, {mcalc_vmath_sin, 1}, {mcalc_vmath_cos, 1},
+	{mcalc_vmath_pow, 2}, {mcalc_vmath_log10, 1}, {mcalc_vmath_tan, 1}, {mcalc_vmath_sinh, 1},
+	{mcalc_vmath_cosh, 1}, {mcalc_vmath_tanh, 1},
+	{less, 2}, {less_equal, 2}, {greater, 2}, {greater_equal, 2}, {equal, 2}, {not_equal, 2},
+};
+
+const int mcalc_builtin_count = sizeof(mcalc_builtins) / sizeof(mcalc_builtins[0]);
+
+#define IS_DIGIT(C) ((C) >= '0' && (C) <= '9')
+
+static const double exact_powers[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static locale_t c_locale(void) {
+	/* Created once and shared; newlocale and uselocale, unlike localeconv, are thread-safe. */
+	static locale_t shared;
+	locale_t l = __atomic_load_n(&shared, __ATOMIC_ACQUIRE), expected = 0;
+	if (l) return l;
+	l = newlocale(LC_NUMERIC_MASK, "C", 0);
+	if (l && !__atomic_compare_exchange_n(&shared, &expected, l, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		freelocale(l);
+		l = expected;
+	}
+	return l;
+}
+
+static double slow_number(const char *start, const char *end) {
+	/* Rare: more than 19 significant digits or a large exponent. strtod rounds correctly,
+	 * but wants a terminated copy and is run in the "C" locale of this thread only. */
+	char buffer[128];
+	const size_t size = end - start + 1;
+	char *copy = size <= sizeof(buffer) ? buffer : malloc(size);
+	const locale_t l = c_locale();
+	locale_t old = 0;
+	double ret;
+	if (!copy) return NAN;
+	memcpy(copy, start, size - 1);
+	copy[size - 1] = '\0';
+	if (l) old = uselocale(l);
+	ret = strtod(copy, 0);
+	if (l) uselocale(old);
+	if (copy != buffer) free(copy);
+	return ret;
+}
+
+static int parse_number(state *s) {
+	/* <number>    =    <digits> {"." <digits>} {("e" | "E") {"+" | "-"} <digits>}
+	 * Locale-independent. Up to 19 significant digits scaled by an exact power of ten
+	 * are converted with a single correctly rounded operation (Clinger's fast path). */
+	const char *p = s->next, *const end = s->end;
+	uint64_t mantissa = 0;
+	int digits = 0, exponent = 0, any = 0, dropped = 0;
+	for (; p != end && IS_DIGIT(*p); p++, any = 1) {
+		if (digits < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa) digits++;
+		} else {
+			exponent++;
+			dropped |= *p != '0';
+		}
+	}
+	if (p != end && *p == '.') {
+		for (p++; p != end && IS_DIGIT(*p); p++, any = 1) {
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa) digits++;
+				exponent--;
+			} else {
+				dropped |= *p != '0';
+			}
+		}
+	}
+	if (!any) return 0;
+	if (p != end && (*p == 'e' || *p == 'E')) {
+		/* Only an exponent if digits follow, "2e" is 2 times e. */
+		const char *q = p + 1;
+		int sign = 1, value = 0;
+		if (q != end && (*q == '+' || *q == '-')) sign = *q++ == '-' ? -1 : 1;
+		if (q != end && IS_DIGIT(*q)) {
+			for (; q != end && IS_DIGIT(*q); q++) {
+				if (value < 100000) value = value * 10 + (*q - '0');
+			}
+			exponent += sign * value;
+			p = q;
+		}
+	}
+	if (!dropped && mantissa <= (UINT64_C(1) << 53)) {
+		if (!mantissa) {
+			s->value = 0;
+		} else if (exponent >= 0 && exponent <= 22) {
+			s->value = (double)mantissa * exact_powers[exponent];
+		} else if (exponent < 0 && exponent >= -22) {
+			s->value = (double)mantissa / exact_powers[-exponent];
+		} else {
+			s->value = slow_number(s->next, p);
+		}
+	} else {
+		s->value = slow_number(s->next, p);
+	}
+	s->next = p;
+	return 1;
+}
+
+/* Consumes `c` if it comes next, for the two-character operators. */
+static int next_is(state *s, char c) {
+	if (s->next == s->end || s->next[0] != c) return 0;
+	s->next++;
+	return 1;
+}
+
 void next_token(state *s) {
 	s->type = TOK_NULL;
 	do {
-		if (!*s->next){
+		if (s->next == s->end){
 			s->type = TOK_END;
 			return;
 		}
 		if ((s->next[0] >= '0' && s->next[0] <= '9') || s->next[0] == '.') {
-			s->value = strtod(s->next, (char**)&s->next);
-			s->type = TOK_NUMBER;
+			s->type = parse_number(s) ? TOK_NUMBER : TOK_ERROR;
 		} else {
-			if (s->next[0] >= 'a' && s->next[0] <= 'z') {
+			/* Identifiers are lowercase names, or "$n" for positional variables. */
+			if ((s->next[0] >= 'a' && s->next[0] <= 'z') || s->next[0] == '$') {
 				const char *start;
-				start = s->next;
-				while ((s->next[0] >= 'a' && s->next[0] <= 'z') || (s->next[0] >= '0' && s->next[0] <= '9') || (s->next[0] == '_')) s->next++;
+				start = s->next++;
+				while (s->next != s->end && ((s->next[0] >= 'a' && s->next[0] <= 'z') || (s->next[0] >= '0' && s->next[0] <= '9') || (s->next[0] == '_'))) s->next++;
 				const mcalc_variable *var = find_lookup(s, start, s->next - start);
+				if (!var && s->next - start == 2 && start[0] == 'i' && start[1] == 'f') {
+					s->type = TOK_IF;
+					continue;
+				}
 				if (!var) var = find_builtin(start, s->next - start);
+				if (!var && s->resolve && (s->definition = s->resolve(s->resolve_context, start, s->next - start))) {
+					s->type = TOK_CALL;
+					continue;
+				}
 				if (!var) {
 					s->type = TOK_ERROR;
 				} else {
@@ -228,10 +622,19 @@ void next_token(state *s) {
 					case '*': s->type = TOK_INFIX; s->function = mul; break;
 					case '/': s->type = TOK_INFIX; s->function = divide; break;
 					case '^': s->type = TOK_INFIX; s->function = pow; break;
-					case '%': s->type = TOK_INFIX; s->function = fmod; break;
+					case '%': s->type = TOK_INFIX; s->function = mod; break;
+					case '<': s->type = TOK_INFIX; s->function = next_is(s, '=') ? less_equal : less; break;
+					case '>': s->type = TOK_INFIX; s->function = next_is(s, '=') ? greater_equal : greater; break;
+					case '=': s->type = next_is(s, '=') ? TOK_INFIX : TOK_ERROR; s->function = equal; break;
+					case '!': s->type = next_is(s, '=') ? TOK_INFIX : TOK_ERROR; s->function = not_equal; break;
+					case '&': s->type = next_is(s, '&') ? TOK_AND : TOK_ERROR; break;
+					case '|': s->type = next_is(s, '|') ? TOK_OR : TOK_ERROR; break;
+					case '?': s->type = TOK_QUESTION; break;
+					case ':': s->type = TOK_COLON; break;
 					case '(': s->type = TOK_OPEN; break;
 					case ')': s->type = TOK_CLOSE; break;
 					case ',': s->type = TOK_SEP; break;
+					case ';': s->type = TOK_END_FORMULA; break;
 					case ' ': case '\t': case '\n': case '\r': break;
 					default: s->type = TOK_ERROR; break;
 				}
@@ -240,186 +643,434 @@ void next_token(state *s) {
 	} while (s->type == TOK_NULL);
 }
 
-static mcalc_expr *list(state *s);
-static mcalc_expr *expr(state *s);
-static mcalc_expr *power(state *s);
-static mcalc_expr *base(state *s) {
-	/* <base>      =    <constant> | <variable> | <function-0> {"(" ")"} | <function-1> <power> | <function-X> "(" <expr> {"," <expr>} ")" | "(" <list> ")" */
-	mcalc_expr *ret;
+static int is_comparison(const void *function) {
+	return function == less || function == less_equal || function == greater || function == greater_equal || function == equal || function == not_equal;
+}
+
+static mcalc_expr *truth(state *s, mcalc_expr *n) {
+	/* n != 0, the value of n as the last operand of && or ||. */
+	mcalc_expr *zero = new_expr(s, MCALC_CONSTANT, 0);
+	mcalc_expr *ret = zero ? NEW_EXPR(MCALC_FUNCTION2 | MCALC_FLAG_PURE, n, zero) : 0;
+	if (ret) ret->function = not_equal;
+	return ret;
+}
+
+/* Functions written as formulas, parsed once and copied into every formula calling them. */
+#define DEFINITION_PARAMETERS 16
+#define DEFINITION_NODES 4096
+/* Arguments used more than once are copied each time, so calls nested in arguments can grow a
+ * formula exponentially: the calls of one compile copy at most this many nodes, or it fails. */
+#define EXPANDED_NODES (1 << 16)
+
+struct mcalc_definition {
+	const char *name;
 	int arity;
-	switch (TYPE_MASK(s->type)) {
+	const mcalc_expr *body; /* As parsed, reading the parameters below. */
+	double parameters[DEFINITION_PARAMETERS]; /* Only their addresses are used, to find them in the body. */
+	mcalc_arena arena; /* Holds the name and the body. */
+};
+
+/* A copy of `n` in the formula being compiled, with the arguments in place of the parameters
+ * of `d` (if any). An argument used twice is copied again, the optimizer shares it if it is pure. */
+static mcalc_expr *expand(state *s, const mcalc_definition *d, const mcalc_expr *n, mcalc_expr **arguments, int *uses) {
+	const int arity = ARITY(n->type);
+	const size_t size = expr_size(n->type);
+	mcalc_expr *ret;
+	int i;
+	if (d && TYPE_MASK(n->type) == MCALC_VARIABLE) {
+		for (i = 0; i < d->arity; i++) {
+			if (n->bound == d->parameters + i) return uses[i]++ ? expand(s, 0, arguments[i], 0, 0) : arguments[i];
+		}
+	}
+	if (s->expanded >= EXPANDED_NODES) {
+		s->type = TOK_ERROR;
+		return 0;
+	}
+	if (!(ret = allocate(s, size))) return 0;
+	memcpy(ret, n, size);
+	s->nodes++;
+	s->expanded++;
+	for (i = 0; i < arity; i++) ret->parameters[i] = expand(s, d, n->parameters[i], arguments, uses);
+	return measure(s, ret);
+}
+
+/* The parser reads a formula left to right with an explicit stack instead of recursion, building
+ * each node as soon as its operands are known:
+ *
+ * <list>        =  <conditional> {"," <conditional>}
+ * <conditional> =  <disjunction> {"?" <conditional> ":" <conditional>}, the same as if().
+ * <disjunction> =  <conjunction> {"||" <conjunction>}, a || b is if(a, 1, b != 0).
+ * <conjunction> =  <comparison> {"&&" <comparison>}, a && b is if(a, b != 0, 0).
+ * <comparison>  =  <expr> {("<" | "<=" | ">" | ">=" | "==" | "!=") <expr>}
+ * <expr>        =  <term> {("+" | "-") <term>}
+ * <term>        =  <factor> {("*" | "/" | "%") <factor>}
+ * <factor>      =  <power> {"^" <power>}, from the left unless MCALC_POW_RIGHT.
+ * <power>       =  {("-" | "+")} <base>
+ * <base>        =  <constant> | <variable> | <function-0> {"(" ")"} | <function-1> <power> | <function-X> "(" <conditional> {"," <conditional>} ")"
+ *                  | "if" "(" <conditional> "," <conditional> "," <conditional> ")" | "(" <list> ")"
+ *                  | <definition-0> {"(" ")"} | <definition-X> "(" <conditional> {"," <conditional>} ")"
+ *
+ * Every operator waiting for its right operand and every open bracket is a frame, the formula
+ * fails when it needs more than max_depth of them. */
+enum {
+	/* Operators, applied to the operand that follows, */
+	FRAME_BINARY, FRAME_AND, FRAME_OR, FRAME_ELSE, FRAME_NEGATE, FRAME_PREFIX,
+	/* and brackets, closed by ")" or turned into an operator by ":". */
+	FRAME_GROUP, FRAME_THEN, FRAME_CALL
+};
+
+/* How tightly the operators bind, brackets are 0. Under MCALC_POW_RIGHT a sign at the start of a
+ * factor covers its powers, -x^2 is -(x^2); in the exponent and after a function-1 it stays tight,
+ * 2^-x^2 is 2^((-x)^2). */
+enum {
+	PREC_COMMA = 1, PREC_CONDITIONAL, PREC_OR, PREC_AND, PREC_COMPARISON,
+	PREC_SUM, PREC_PRODUCT, PREC_SIGN, PREC_POWER, PREC_PREFIX
+};
+
+typedef struct frame {
+	int kind;
+	int precedence;
+	int right; /* Right-associative. */
+	const void *function; /* FRAME_BINARY */
+	mcalc_expr *left; /* The left operand or condition, the node of a FRAME_PREFIX or FRAME_CALL. */
+	mcalc_expr *then; /* FRAME_ELSE */
+	mcalc_expr **arguments; /* FRAME_CALL: where the arguments go, */
+	int index, arity; /* the one being parsed and how many there are, */
+	const mcalc_definition *definition; /* and the definition called, if any. */
+} frame;
+
+#define LOCAL_FRAMES 32
+
+typedef struct parser {
+	frame *frames; /* `local` until it is full. */
+	int count, size;
+	frame local[LOCAL_FRAMES];
+} parser;
+
+static frame *push(state *s, parser *p, int kind, int precedence, int right) {
+	frame *f;
+	if (p->count == s->max_depth) {
+		s->too_deep = 1;
+		s->type = TOK_ERROR;
+		return 0;
+	}
+	if (p->count == p->size) {
+		f = p->frames == p->local ? malloc(sizeof(frame) * p->size * 2) : realloc(p->frames, sizeof(frame) * p->size * 2);
+		if (!f) {
+			s->out_of_memory = 1;
+			s->type = TOK_ERROR;
+			return 0;
+		}
+		if (p->frames == p->local) memcpy(f, p->local, sizeof(p->local));
+		p->frames = f;
+		p->size *= 2;
+	}
+	f = p->frames + p->count++;
+	f->kind = kind;
+	f->precedence = precedence;
+	f->right = right;
+	return f;
+}
+
+static frame *top(parser *p) {
+	return p->count ? p->frames + p->count - 1 : 0;
+}
+
+static int precedence(const void *function) {
+	if (function == pow) return PREC_POWER;
+	if (function == mul || function == divide || function == mod) return PREC_PRODUCT;
+	if (function == add || function == sub) return PREC_SUM;
+	return PREC_COMPARISON;
+}
+
+static mcalc_expr *reduce(state *s, parser *p, mcalc_expr *operand, int precedence) {
+	/* Applies the operators on top of the stack that take `operand` before an operator of
+	 * `precedence` does, all of them down to the innermost bracket for 0. */
+	const frame *f;
+	while ((f = top(p)) && f->precedence && (f->precedence > precedence || (f->precedence == precedence && !f->right))) {
+		mcalc_expr *constant;
+		switch (f->kind) {
+			case FRAME_BINARY:
+				if ((operand = NEW_EXPR(MCALC_FUNCTION2 | MCALC_FLAG_PURE, f->left, operand))) operand->function = f->function;
+				break;
+			case FRAME_AND:
+				if (!(constant = new_expr(s, MCALC_CONSTANT, 0)) || !(operand = truth(s, operand))) return 0;
+				operand = NEW_EXPR(MCALC_BRANCH | MCALC_FLAG_PURE, f->left, operand, constant);
+				break;
+			case FRAME_OR:
+				if (!(constant = new_expr(s, MCALC_CONSTANT, 0)) || !(operand = truth(s, operand))) return 0;
+				constant->value = 1;
+				operand = NEW_EXPR(MCALC_BRANCH | MCALC_FLAG_PURE, f->left, constant, operand);
+				break;
+			case FRAME_ELSE:
+				operand = NEW_EXPR(MCALC_BRANCH | MCALC_FLAG_PURE, f->left, f->then, operand);
+				break;
+			case FRAME_NEGATE:
+				if ((operand = NEW_EXPR(MCALC_FUNCTION1 | MCALC_FLAG_PURE, operand))) operand->function = negate;
+				break;
+			case FRAME_PREFIX:
+				f->left->parameters[0] = operand;
+				operand = measure(s, f->left);
+				break;
+		}
+		if (!operand) return 0;
+		p->count--;
+	}
+	return operand;
+}
+
+static void empty_parentheses(state *s) {
+	/* The optional "()" after a function without arguments. */
+	next_token(s);
+	if (s->type == TOK_OPEN) {
+		next_token(s);
+		if (s->type != TOK_CLOSE) {
+			s->type = TOK_ERROR;
+		} else {
+			next_token(s);
+		}
+	}
+}
+
+static void open_call(state *s, parser *p, mcalc_expr *node, mcalc_expr **arguments, int arity, const mcalc_definition *d) {
+	/* The "(" after a function taking arguments. */
+	frame *f;
+	next_token(s);
+	if (s->type != TOK_OPEN) {
+		s->type = TOK_ERROR;
+	} else if ((f = push(s, p, FRAME_CALL, 0, 0))) {
+		f->left = node;
+		f->arguments = arguments;
+		f->index = 0;
+		f->arity = arity;
+		f->definition = d;
+		next_token(s);
+	}
+}
+
+static mcalc_expr *power(state *s, parser *p) {
+	/* <power> up to where it needs another operand: returns the constant, variable or function
+	 * without arguments, 0 once it has pushed a sign, function-1 or opening bracket (or failed). */
+	const mcalc_definition *d;
+	mcalc_expr *ret;
+	frame *f;
+	int arity, sign = 1;
+	if (s->type == TOK_INFIX && (s->function == add || s->function == sub)) {
+		while (s->type == TOK_INFIX && (s->function == add || s->function == sub)) {
+			if (s->function == sub) sign = -sign;
+			next_token(s);
+		}
+		if (sign < 0) {
+			const frame *t = top(p);
+			const int tight = !(s->flags & MCALC_POW_RIGHT) || (t && (t->kind == FRAME_PREFIX || (t->kind == FRAME_BINARY && t->function == pow)));
+			push(s, p, FRAME_NEGATE, tight ? PREC_PREFIX : PREC_SIGN, 0);
+		}
+		return 0;
+	}
+	/* TYPE_MASK drops MCALC_FLAG_PURE from function tokens, the other tokens are below it but these three. */
+	switch (s->type == TOK_IF || s->type == TOK_CALL || s->type == TOK_INFIX ? s->type : TYPE_MASK(s->type)) {
 		case TOK_NUMBER:
-			ret = new_expr(MCALC_CONSTANT, 0);
+			if (!(ret = new_expr(s, MCALC_CONSTANT, 0))) return 0;
 			ret->value = s->value;
 			next_token(s);
-			break;
+			return ret;
 		case TOK_VARIABLE:
-			ret = new_expr(MCALC_VARIABLE, 0);
+			if (!(ret = new_expr(s, MCALC_VARIABLE, 0))) return 0;
 			ret->bound = s->bound;
 			next_token(s);
-			break;
+			return ret;
 		case MCALC_FUNCTION0:
 		case MCALC_CLOSURE0:
-			ret = new_expr(s->type, 0);
+			if (!(ret = new_expr(s, s->type, 0))) return 0;
 			ret->function = s->function;
 			if (IS_CLOSURE(s->type)) ret->parameters[0] = s->context;
-			next_token(s);
-			if (s->type == TOK_OPEN) {
-				next_token(s);
-				if (s->type != TOK_CLOSE) {
-					s->type = TOK_ERROR;
-				} else {
-					next_token(s);
-				}
-			}
-			break;
+			empty_parentheses(s);
+			return s->type == TOK_ERROR ? 0 : ret;
 		case MCALC_FUNCTION1:
 		case MCALC_CLOSURE1:
-			ret = new_expr(s->type, 0);
+			if (!(ret = new_expr(s, s->type, 0))) return 0;
 			ret->function = s->function;
 			if (IS_CLOSURE(s->type)) ret->parameters[1] = s->context;
-			next_token(s);
-			ret->parameters[0] = power(s);
-			break;
+			if ((f = push(s, p, FRAME_PREFIX, PREC_PREFIX, 0))) {
+				f->left = ret;
+				next_token(s);
+			}
+			return 0;
 		case MCALC_FUNCTION2: case MCALC_FUNCTION3: case MCALC_FUNCTION4:
 		case MCALC_FUNCTION5: case MCALC_FUNCTION6: case MCALC_FUNCTION7:
 		case MCALC_CLOSURE2: case MCALC_CLOSURE3: case MCALC_CLOSURE4:
 		case MCALC_CLOSURE5: case MCALC_CLOSURE6: case MCALC_CLOSURE7:
 			arity = ARITY(s->type);
-			ret = new_expr(s->type, 0);
+			if (!(ret = new_expr(s, s->type, 0))) return 0;
 			ret->function = s->function;
 			if (IS_CLOSURE(s->type)) ret->parameters[arity] = s->context;
-			next_token(s);
-			if (s->type != TOK_OPEN) {
-				s->type = TOK_ERROR;
-			} else {
-				int i;
-				for(i = 0; i < arity; i++) {
+			open_call(s, p, ret, (mcalc_expr**)ret->parameters, arity, 0);
+			return 0;
+		case TOK_IF:
+			if ((ret = NEW_EXPR(MCALC_BRANCH | MCALC_FLAG_PURE, 0, 0, 0))) open_call(s, p, ret, (mcalc_expr**)ret->parameters, 3, 0);
+			return 0;
+		case TOK_CALL:
+			/* The definition's body takes the place of the call, see close_call(). */
+			d = s->definition;
+			if (d->arity) {
+				mcalc_expr **arguments = allocate(s, sizeof(mcalc_expr*) * d->arity);
+				if (arguments) open_call(s, p, 0, arguments, d->arity, d);
+				return 0;
+			}
+			empty_parentheses(s);
+			return s->type == TOK_ERROR ? 0 : expand(s, d, d->body, 0, 0);
+		case TOK_OPEN:
+			if (push(s, p, FRAME_GROUP, 0, 0)) next_token(s);
+			return 0;
+	}
+	s->type = TOK_ERROR;
+	return 0;
+}
+
+static mcalc_expr *close_call(state *s, frame *f, mcalc_expr *operand) {
+	/* The ")" of a FRAME_CALL, `operand` being its last argument. */
+	int uses[DEFINITION_PARAMETERS] = {0};
+	if (f->index != f->arity - 1) {
+		s->type = TOK_ERROR;
+		return 0;
+	}
+	f->arguments[f->index] = operand;
+	return f->definition ? expand(s, f->definition, f->definition->body, f->arguments, uses) : measure(s, f->left);
+}
+
+static mcalc_expr *list(state *s) {
+	/* Stops before a token that can't continue the formula, the caller checks which it is. */
+	parser p;
+	mcalc_expr *ret = 0;
+	frame *f;
+	int done = 0;
+	p.frames = p.local;
+	p.count = 0;
+	p.size = LOCAL_FRAMES;
+	while (!done && s->type != TOK_ERROR) {
+		if (!ret) {
+			ret = power(s, &p);
+			continue;
+		}
+		switch (s->type) {
+			case TOK_INFIX: {
+				const int prec = precedence(s->function);
+				ret = reduce(s, &p, ret, prec);
+				if (!ret) break;
+				if ((f = push(s, &p, FRAME_BINARY, prec, prec == PREC_POWER && (s->flags & MCALC_POW_RIGHT) != 0))) {
+					f->function = s->function;
+					f->left = ret;
+					ret = 0;
+					next_token(s);
+				}
+				break;
+			}
+			case TOK_AND:
+			case TOK_OR: {
+				const int prec = s->type == TOK_AND ? PREC_AND : PREC_OR;
+				ret = reduce(s, &p, ret, prec);
+				if (!ret) break;
+				if ((f = push(s, &p, prec == PREC_AND ? FRAME_AND : FRAME_OR, prec, 0))) {
+					f->left = ret;
+					ret = 0;
+					next_token(s);
+				}
+				break;
+			}
+			case TOK_QUESTION:
+				ret = reduce(s, &p, ret, PREC_CONDITIONAL);
+				if (!ret) break;
+				if ((f = push(s, &p, FRAME_THEN, 0, 0))) {
+					f->left = ret;
+					ret = 0;
 					next_token(s);
-					ret->parameters[i] = expr(s);
-					if(s->type != TOK_SEP) {
-						break;
-					}
 				}
-				if(s->type != TOK_CLOSE || i != arity - 1) {
+				break;
+			case TOK_COLON:
+				ret = reduce(s, &p, ret, 0);
+				if (!ret) break;
+				if (!(f = top(&p))) {
+					done = 1;
+				} else if (f->kind != FRAME_THEN) {
 					s->type = TOK_ERROR;
 				} else {
+					f->kind = FRAME_ELSE;
+					f->precedence = PREC_CONDITIONAL;
+					f->right = 1;
+					f->then = ret;
+					ret = 0;
 					next_token(s);
 				}
-			}
-			break;
-		case TOK_OPEN:
-			next_token(s);
-			ret = list(s);
-			if (s->type != TOK_CLOSE) {
-				s->type = TOK_ERROR;
-			} else {
-				next_token(s);
-			}
-			break;
-		default:
-			ret = new_expr(0, 0);
-			s->type = TOK_ERROR;
-			ret->value = NAN;
-			break;
+				break;
+			case TOK_SEP:
+				ret = reduce(s, &p, ret, 0);
+				if (!ret) break;
+				f = top(&p);
+				if (!f || f->kind == FRAME_GROUP) {
+					if ((f = push(s, &p, FRAME_BINARY, PREC_COMMA, 0))) {
+						f->function = comma;
+						f->left = ret;
+						ret = 0;
+						next_token(s);
+					}
+				} else if (f->kind == FRAME_CALL && f->index < f->arity - 1) {
+					f->arguments[f->index++] = ret;
+					ret = 0;
+					next_token(s);
+				} else {
+					s->type = TOK_ERROR;
+				}
+				break;
+			case TOK_CLOSE:
+				ret = reduce(s, &p, ret, 0);
+				if (!ret) break;
+				if (!(f = top(&p))) {
+					done = 1;
+				} else if (f->kind == FRAME_THEN) {
+					s->type = TOK_ERROR;
+				} else {
+					if (f->kind == FRAME_CALL) ret = close_call(s, f, ret);
+					if (s->type != TOK_ERROR) {
+						p.count--;
+						next_token(s);
+					}
+				}
+				break;
+			default:
+				ret = reduce(s, &p, ret, 0);
+				if (p.count) s->type = TOK_ERROR;
+				done = 1;
+				break;
+		}
 	}
+	if (p.frames != p.local) free(p.frames);
 	return ret;
 }
 
-static mcalc_expr *power(state *s) {
-	/* <power>     =    {("-" | "+")} <base> */
-	int sign = 1;
-	while (s->type == TOK_INFIX && (s->function == add || s->function == sub)) {
-		if (s->function == sub) sign = -sign;
-		next_token(s);
-	}
-	mcalc_expr *ret;
-	if (sign == 1) {
-		ret = base(s);
-	} else {
-		ret = NEW_EXPR(MCALC_FUNCTION1 | MCALC_FLAG_PURE, base(s));
-		ret->function = negate;
-	}
+/* Root of a formula of mcalc_compile_multi, hands its value to the caller. */
+static double output(void *result, double value) {return *(double*)result = value;}
+
+static mcalc_expr *formula(state *s) {
+	mcalc_expr *ret = NEW_EXPR(MCALC_CLOSURE1, list(s));
+	if (!ret) return 0;
+	ret->function = output;
+	ret->parameters[1] = s->results + s->count++;
 	return ret;
 }
-#ifdef MCALC_POW_FROM_RIGHT
-static mcalc_expr *factor(state *s) {
-	/* <factor>    =    <power> {"^" <power>} */
-	mcalc_expr *ret = power(s);
-	int neg = 0;
-	mcalc_expr *insertion = 0;
-	if (ret->type == (MCALC_FUNCTION1 | MCALC_FLAG_PURE) && ret->function == negate) {
-		mcalc_expr *se = ret->parameters[0];
-		free(ret);
-		ret = se;
-		neg = 1;
-	}
-	while (s->type == TOK_INFIX && (s->function == pow)) {
-		mcalc_fun2 t = s->function;
+
+static mcalc_expr *formulas(state *s) {
+	/* <formulas>  =    <list> {";" <list>} [";"]
+	 * One tree for all of them, so that the optimizer shares what they have in common. */
+	mcalc_expr *ret = formula(s);
+	while (s->type == TOK_END_FORMULA) {
 		next_token(s);
-		if (insertion) {
-			/* Make exponentiation go right-to-left. */
-			mcalc_expr *insert = NEW_EXPR(MCALC_FUNCTION2 | MCALC_FLAG_PURE, insertion->parameters[1], power(s));
-			insert->function = t;
-			insertion->parameters[1] = insert;
-			insertion = insert;
-		} else {
-			ret = NEW_EXPR(MCALC_FUNCTION2 | MCALC_FLAG_PURE, ret, power(s));
-			ret->function = t;
-			insertion = ret;
+		if (s->type == TOK_END) break;
+		if (s->count == s->capacity) {
+			s->type = TOK_ERROR;
+			break;
 		}
-	}
-	if (neg) {
-		ret = NEW_EXPR(MCALC_FUNCTION1 | MCALC_FLAG_PURE, ret);
-		ret->function = negate;
-	}
-	return ret;
-}
-#else
-static mcalc_expr *factor(state *s) {
-	/* <factor>    =    <power> {"^" <power>} */
-	mcalc_expr *ret = power(s);
-	while (s->type == TOK_INFIX && (s->function == pow)) {
-		mcalc_fun2 t = s->function;
-		next_token(s);
-		ret = NEW_EXPR(MCALC_FUNCTION2 | MCALC_FLAG_PURE, ret, power(s));
-		ret->function = t;
-	}
-	return ret;
-}
-#endif
-
-static mcalc_expr *term(state *s) {
-	/* <term>      =    <factor> {("*" | "/" | "%") <factor>} */
-	mcalc_expr *ret = factor(s);
-	while (s->type == TOK_INFIX && (s->function == mul || s->function == divide || s->function == fmod)) {
-		mcalc_fun2 t = s->function;
-		next_token(s);
-		ret = NEW_EXPR(MCALC_FUNCTION2 | MCALC_FLAG_PURE, ret, factor(s));
-		ret->function = t;
-	}
-	return ret;
-}
-
-static mcalc_expr *expr(state *s) {
-	/* <expr>      =    <term> {("+" | "-") <term>} */
-	mcalc_expr *ret = term(s);
-	while (s->type == TOK_INFIX && (s->function == add || s->function == sub)) {
-		mcalc_fun2 t = s->function;
-		next_token(s);
-		ret = NEW_EXPR(MCALC_FUNCTION2 | MCALC_FLAG_PURE, ret, term(s));
-		ret->function = t;
-	}
-	return ret;
-}
-
-static mcalc_expr *list(state *s) {
-	/* <list>      =    <expr> {"," <expr>} */
-	mcalc_expr *ret = expr(s);
-	while (s->type == TOK_SEP) {
-		next_token(s);
-		ret = NEW_EXPR(MCALC_FUNCTION2 | MCALC_FLAG_PURE, ret, expr(s));
-		ret->function = comma;
+		if (!(ret = NEW_EXPR(MCALC_FUNCTION2 | MCALC_FLAG_PURE, ret, formula(s)))) break;
+		ret->function = comma;
 	}
 	return ret;
 }
@@ -432,6 +1083,7 @@ double mcalc_eval(const mcalc_expr *n) {
 	switch(TYPE_MASK(n->type)) {
 		case MCALC_CONSTANT: return n->value;
 		case MCALC_VARIABLE: return *n->bound;
+		case MCALC_BRANCH: return M(0) != 0 ? M(1) : M(2);
 		case MCALC_FUNCTION0: case MCALC_FUNCTION1: case MCALC_FUNCTION2: case MCALC_FUNCTION3:
 		case MCALC_FUNCTION4: case MCALC_FUNCTION5: case MCALC_FUNCTION6: case MCALC_FUNCTION7:
 			switch(ARITY(n->type)) {
@@ -463,68 +1115,902 @@ double mcalc_eval(const mcalc_expr *n) {
 }
 #undef MCALC_FUN
 #undef M
-static void optimize(mcalc_expr *n) {
-	/* Evaluates as much as possible. */
-	if (n->type == MCALC_CONSTANT) return;
-	if (n->type == MCALC_VARIABLE) return;
-	/* Only optimize out functions flagged as pure. */
-	if (IS_PURE(n->type)) {
-		const int arity = ARITY(n->type);
-		int known = 1;
-		int i;
-		for (i = 0; i < arity; ++i) {
-			optimize(n->parameters[i]);
-			if (((mcalc_expr*)(n->parameters[i]))->type != MCALC_CONSTANT) {
-				known = 0;
+static int count_nodes(const mcalc_expr *n) {
+	int i, count = 1;
+	const int arity = ARITY(n->type);
+	for (i = 0; i < arity; i++) count += count_nodes(n->parameters[i]);
+	return count;
+}
+
+/* Optimizer: constant folding, exact algebraic identities and hash-consing of pure
+ * subtrees, so that repeated subexpressions become one shared node of a DAG.
+ * MCALC_FAST_MATH also allows rewrites that may change the last bits of a result. */
+typedef struct optimizer {
+	state *s;
+	mcalc_expr **table; /* Canonical nodes, open addressing. */
+	unsigned mask;
+	unsigned used;
+} optimizer;
+
+static int shareable(const mcalc_expr *n) {
+	return n->type == MCALC_CONSTANT || n->type == MCALC_VARIABLE || (IS_PURE(n->type) && !IS_CLOSURE(n->type));
+}
+
+static unsigned hash_node(const mcalc_expr *n) {
+	const int arity = ARITY(n->type);
+	size_t h = (size_t)n->type * 31;
+	size_t word;
+	int i;
+	memcpy(&word, &n->value, sizeof(word) < sizeof(n->value) ? sizeof(word) : sizeof(n->value));
+	h = (h ^ word) * 0x9E3779B1u;
+	for (i = 0; i < arity; i++) h = (h ^ (size_t)n->parameters[i]) * 0x9E3779B1u;
+	return (unsigned)(h ^ (h >> 16));
+}
+
+static int same_node(const mcalc_expr *a, const mcalc_expr *b) {
+	const int arity = ARITY(a->type);
+	int i;
+	if (a->type != b->type) return 0;
+	if (a->type == MCALC_CONSTANT) {
+		if (memcmp(&a->value, &b->value, sizeof(a->value)) != 0) return 0;
+	} else if (a->function != b->function) {
+		return 0;
+	}
+	for (i = 0; i < arity; i++) {
+		if (a->parameters[i] != b->parameters[i]) return 0;
+	}
+	return 1;
+}
+
+static mcalc_expr *intern(optimizer *o, mcalc_expr *n) {
+	/* Returns the canonical node equal to `n`, which becomes canonical if there is none. */
+	unsigned i;
+	if (!o->table || !shareable(n)) return n;
+	for (i = hash_node(n) & o->mask; o->table[i]; i = (i + 1) & o->mask) {
+		if (o->table[i] == n || same_node(o->table[i], n)) return o->table[i];
+	}
+	/* Past 3/4 full, later nodes are simply not shared. */
+	if (4 * (o->used + 1) <= 3 * (o->mask + 1)) {
+		o->table[i] = n;
+		o->used++;
+	}
+	return n;
+}
+
+static mcalc_expr *constant(optimizer *o, double value) {
+	state *s = o->s;
+	mcalc_expr *n = new_expr(s, MCALC_CONSTANT, 0);
+	if (!n) return 0;
+	n->value = value;
+	return intern(o, n);
+}
+
+static mcalc_expr *binary(optimizer *o, const void *function, mcalc_expr *a, mcalc_expr *b) {
+	state *s = o->s;
+	/* 0 when out of memory, as are the rewrites using it. */
+	mcalc_expr *n = a && b ? NEW_EXPR(MCALC_FUNCTION2 | MCALC_FLAG_PURE, a, b) : 0;
+	if (!n) return 0;
+	n->function = function;
+	return intern(o, n);
+}
+
+static int pure_tree(const mcalc_expr *n) {
+	/* Without side effects, so it may be evaluated once for several uses. */
+	const int arity = ARITY(n->type);
+	int i;
+	if (!shareable(n)) return 0;
+	for (i = 0; i < arity; i++) {
+		if (!pure_tree(n->parameters[i])) return 0;
+	}
+	return 1;
+}
+
+static int is_value(const mcalc_expr *n, double value) {
+	return n->type == MCALC_CONSTANT && n->value == value && signbit(n->value) == signbit(value);
+}
+
+static int exact_reciprocal(double c) {
+	/* 1/c is exact when c is a power of two whose reciprocal is a normal number. */
+	int exponent;
+	return isfinite(c) && frexp(c, &exponent) == (c < 0 ? -0.5 : 0.5) && exponent > DBL_MIN_EXP && exponent < DBL_MAX_EXP - 1;
+}
+
+static mcalc_expr *power_chain(optimizer *o, mcalc_expr *x, unsigned k) {
+	/* x^k by repeated squaring; the squares are interned, so they are computed once. */
+	mcalc_expr *result = 0;
+	while (k) {
+		if ((k & 1) && !(result = result ? binary(o, mul, result, x) : x)) return 0;
+		k >>= 1;
+		if (k && !(x = binary(o, mul, x, x))) return 0;
+	}
+	return result;
+}
+
+static mcalc_expr *rewrite(optimizer *o, mcalc_expr *n) {
+	/* Algebraic identities of a pure binary operator whose operands are already simplified. */
+	const int fast = (o->s->flags & MCALC_FAST_MATH) != 0;
+	mcalc_expr *a, *b;
+	if (!n) return 0;
+	a = n->parameters[0];
+	b = n->parameters[1];
+	if (n->function == add || n->function == mul) {
+		/* Constants go right, so chains and commuted forms look alike. */
+		if (a->type == MCALC_CONSTANT && b->type != MCALC_CONSTANT) {
+			mcalc_expr *t = a; a = b; b = t;
+			n->parameters[0] = a;
+			n->parameters[1] = b;
+		}
+	}
+	if (n->function == add) {
+		/* x + -0 is x for every x, x + 0 only differs for x = -0. */
+		if (is_value(b, -0.0) || (fast && is_value(b, 0.0))) return a;
+	} else if (n->function == sub) {
+		if (is_value(b, 0.0)) return a;
+		if (fast && b->type == MCALC_CONSTANT) return rewrite(o, binary(o, add, a, constant(o, -b->value)));
+	} else if (n->function == mul) {
+		if (is_value(b, 1.0)) return a;
+	} else if (n->function == divide) {
+		if (is_value(b, 1.0)) return a;
+		if (b->type == MCALC_CONSTANT && exact_reciprocal(b->value)) return binary(o, mul, a, constant(o, 1.0 / b->value));
+	} else if (n->function == pow && b->type == MCALC_CONSTANT) {
+		const double k = b->value;
+		if (k == 1.0) return a;
+		if (k == -1.0) return binary(o, divide, constant(o, 1.0), a);
+		if (!pure_tree(a)) return n;
+		if (k == 0.0) return constant(o, 1.0); /* Even for NaN and infinities. */
+		if (k == 2.0) return binary(o, mul, a, a);
+		/* Higher integer powers round once per multiplication instead of once. */
+		if (fast && k == floor(k) && fabs(k) <= 64) {
+			mcalc_expr *chain = power_chain(o, a, (unsigned)fabs(k));
+			return k < 0 ? binary(o, divide, constant(o, 1.0), chain) : chain;
+		}
+	}
+	if (fast && (n->function == add || n->function == mul) && b->type == MCALC_CONSTANT) {
+		/* (x op c1) op c2 -> x op (c1 op c2) */
+		if (IS_PURE(a->type) && ARITY(a->type) == 2 && a->function == n->function) {
+			mcalc_expr *c1 = a->parameters[1];
+			if (c1->type == MCALC_CONSTANT) {
+				const double c = n->function == add ? c1->value + b->value : c1->value * b->value;
+				return rewrite(o, binary(o, n->function, a->parameters[0], constant(o, c)));
 			}
 		}
-		if (known) {
-			const double value = mcalc_eval(n);
-			mcalc_free_parameters(n);
-			n->type = MCALC_CONSTANT;
-			n->value = value;
+	}
+	return n;
+}
+
+/* Nodes of arithmetic both sides of a branch may have together to be computed without one. */
+#define SELECT_NODES 8
+
+static int cheap(const mcalc_expr *n, int *budget) {
+	const int arity = ARITY(n->type);
+	int i;
+	if (--*budget < 0) return 0;
+	if (n->type != MCALC_CONSTANT && n->type != MCALC_VARIABLE) {
+		if (!IS_FUNCTION(n->type) || !IS_PURE(n->type)) return 0;
+		if (n->function != add && n->function != sub && n->function != mul && n->function != divide && n->function != negate && n->function != choose && !is_comparison(n->function)) return 0;
+	}
+	for (i = 0; i < arity; i++) {
+		if (!cheap(n->parameters[i], budget)) return 0;
+	}
+	return 1;
+}
+
+static mcalc_expr *branch(optimizer *o, mcalc_expr *n) {
+	mcalc_expr *c = n->parameters[0], *a = n->parameters[1], *b = n->parameters[2];
+	int budget = SELECT_NODES;
+	if (c->type == MCALC_CONSTANT) return c->value != 0 ? a : b;
+	if (a == b && pure_tree(c)) return a;
+	/* Computing both sides and picking one costs less than a mispredicted jump. */
+	if (cheap(a, &budget) && cheap(b, &budget)) {
+		n->type = MCALC_FUNCTION3 | MCALC_FLAG_PURE;
+		n->function = choose;
+	}
+	return intern(o, n);
+}
+
+static mcalc_expr *simplify(optimizer *o, mcalc_expr *n) {
+	const int arity = ARITY(n->type);
+	int known = 1;
+	int i;
+	if (n->type == MCALC_CONSTANT || n->type == MCALC_VARIABLE) {
+		n->depth = 1;
+		return intern(o, n);
+	}
+	for (i = 0; i < arity; ++i) {
+		n->parameters[i] = simplify(o, n->parameters[i]);
+		if (((mcalc_expr*)(n->parameters[i]))->type != MCALC_CONSTANT) {
+			known = 0;
 		}
 	}
+	/* Only the rewrites of x^n into products deepen a tree, compile() checks the root. */
+	n->depth = depth_of(n);
+	/* Only optimize out functions flagged as pure. */
+	if (!IS_PURE(n->type)) return n;
+	if (TYPE_MASK(n->type) == MCALC_BRANCH) return branch(o, n);
+	if (known) {
+		/* The folded operands stay in the arena until the whole tree is released. */
+		const double value = mcalc_eval(n);
+		n->type = MCALC_CONSTANT;
+		n->depth = 1;
+		n->value = value;
+		return intern(o, n);
+	}
+	if (IS_FUNCTION(n->type) && arity == 2) {
+		mcalc_expr *r = rewrite(o, n);
+		if (r && r != n) return r;
+	}
+	/* Folded and rewritten above as libm, computed at the requested accuracy from here on. */
+	if (IS_FUNCTION(n->type) && (o->s->flags & (MCALC_MATH_ULP1 | MCALC_MATH_ULP4))) {
+		n->function = mcalc_vmath_function(n->function, o->s->flags);
+	}
+	return intern(o, n);
 }
 
-mcalc_expr *mcalc_compile(const char *expression, const mcalc_variable *variables, int var_count, int *error) {
+/* Integer folding: a subtree made only of integer constants and operations that map integers
+ * to integers is evaluated exactly in int64 and rounded to double once at its root, rather than
+ * after every operation. Overflow, inexact division and zero results (whose sign only the double
+ * arithmetic gets right) are left to the double folding of simplify(). */
+static int integral(double value, int64_t *out) {
+	if (!(value >= -9223372036854775808.0 && value < 9223372036854775808.0)) return 0;
+	if (value == 0 && signbit(value)) return 0;
+	*out = (int64_t)value;
+	return *out == value;
+}
+
+static int int_pow(int64_t a, int64_t b, int64_t *out) {
+	int64_t result = 1;
+	if (b < 0) return 0;
+	for (;;) {
+		if ((b & 1) && __builtin_mul_overflow(result, a, &result)) return 0;
+		b >>= 1;
+		if (!b) break;
+		if (__builtin_mul_overflow(a, a, &a)) return 0;
+	}
+	*out = result;
+	return 1;
+}
+
+static int int_apply(const mcalc_expr *n, const int64_t *v, int64_t *out) {
+	const void *f = n->function;
+	uint64_t u;
+	if (!IS_FUNCTION(n->type) || !IS_PURE(n->type)) return 0;
+	if (ARITY(n->type) == 1) {
+		if (f == negate) {
+			if (v[0] == INT64_MIN) return 0;
+			*out = -v[0];
+		} else if (f == fac) {
+			if (v[0] < 0 || v[0] > UINT_MAX || !(u = int_fac(v[0])) || u > INT64_MAX) return 0;
+			*out = (int64_t)u;
+		} else {
+			return 0;
+		}
+	} else if (ARITY(n->type) == 2) {
+		if (f == add) {
+			if (__builtin_add_overflow(v[0], v[1], out)) return 0;
+		} else if (f == sub) {
+			if (__builtin_sub_overflow(v[0], v[1], out)) return 0;
+		} else if (f == mul) {
+			if (__builtin_mul_overflow(v[0], v[1], out)) return 0;
+		} else if (f == divide || f == mod) {
+			if (v[1] == 0 || (v[1] == -1 && v[0] == INT64_MIN)) return 0;
+			if (f == divide && v[0] % v[1]) return 0;
+			*out = f == divide ? v[0] / v[1] : v[0] % v[1];
+		} else if (f == pow) {
+			if (!int_pow(v[0], v[1], out)) return 0;
+		} else if (f == ncr || f == npr) {
+			/* Same domain as the double versions, which give NAN or INFINITY outside of it. */
+			if (v[1] < 0 || v[0] < v[1] || v[0] > UINT_MAX) return 0;
+			u = f == ncr ? int_ncr(v[0], v[1]) : int_npr(v[0], v[1]);
+			if (!u || u > INT64_MAX) return 0;
+			*out = (int64_t)u;
+		} else {
+			return 0;
+		}
+	} else {
+		return 0;
+	}
+	return *out != 0;
+}
+
+static int fold_integers(mcalc_expr *n, int64_t *out) {
+	const int arity = ARITY(n->type);
+	int64_t values[8];
+	int known[8], all = 1, i;
+	if (n->type == MCALC_CONSTANT) return integral(n->value, out);
+	for (i = 0; i < arity; i++) {
+		known[i] = fold_integers(n->parameters[i], &values[i]);
+		all &= known[i];
+	}
+	if (arity && all && int_apply(n, values, out)) return 1;
+	/* `n` is not done in integers, its integer operands are rounded here. */
+	for (i = 0; i < arity; i++) {
+		mcalc_expr *p = n->parameters[i];
+		if (known[i] && p->type != MCALC_CONSTANT) {
+			p->type = MCALC_CONSTANT;
+			p->value = (double)values[i];
+		}
+	}
+	return 0;
+}
+
+static mcalc_expr *optimize(state *s, mcalc_expr *n) {
+	optimizer o;
+	int64_t value;
+	unsigned capacity = 64;
+	const unsigned count = count_nodes(n);
+	while (capacity < 4 * count) capacity *= 2;
+	o.s = s;
+	o.mask = capacity - 1;
+	o.used = 0;
+	o.table = mcalc_arena_alloc(s->arena, sizeof(mcalc_expr*) * capacity);
+	if (o.table) memset(o.table, 0, sizeof(mcalc_expr*) * capacity);
+	if (fold_integers(n, &value)) {
+		n->type = MCALC_CONSTANT;
+		n->value = (double)value;
+	}
+	return simplify(&o, n);
+}
+
+/* Variable tables longer than this are hashed for the duration of a compile. */
+#define LINEAR_LOOKUP 16
+
+/* MCALC_MAX_DEPTH in the environment (of mysqld) replaces the default max_depth, for a
+ * server whose threads have the stack for deeper formulas. */
+static int default_max_depth = MCALC_MAX_DEPTH;
+
+__attribute__((constructor)) static void max_depth_from_environment(void) {
+	const char *env = getenv("MCALC_MAX_DEPTH");
+	const long depth = env && *env ? strtol(env, 0, 10) : 0;
+	if (depth > 0 && depth <= INT_MAX) default_max_depth = (int)depth;
+}
+
+static void init_state(state *s, mcalc_arena *arena, const char *expression, size_t length, const mcalc_variable *variables, int var_count, const mcalc_options *options) {
+	s->start = s->next = expression;
+	s->end = expression + length;
+	s->lookup = variables;
+	s->lookup_len = var_count;
+	s->scope = options ? options->scope : 0;
+	s->lookup_scope = 0;
+	s->arena = arena;
+	s->flags = options ? options->flags : 0;
+#ifdef MCALC_POW_FROM_RIGHT
+	s->flags |= MCALC_POW_RIGHT;
+#endif
+	s->max_depth = options && options->max_depth > 0 ? options->max_depth : default_max_depth;
+	s->out_of_memory = s->too_deep = 0;
+	s->nodes = s->expanded = 0;
+	s->results = 0;
+	s->capacity = s->count = 0;
+	s->resolve = options ? options->resolve : 0;
+	s->resolve_context = options ? options->resolve_context : 0;
+	s->definition = 0;
+}
+
+static mcalc_expr *compile(mcalc_arena *arena, const char *expression, size_t length, const mcalc_variable *variables, int var_count, const mcalc_options *options, double *results, int *count, int *error) {
 	state s;
-	s.start = s.next = expression;
-	s.lookup = variables;
-	s.lookup_len = var_count;
+	init_state(&s, arena, expression, length, variables, var_count, options);
+	s.results = results;
+	s.capacity = count ? *count : 0;
+	const int stats = MCALC_STATS_ON();
+	unsigned long long start = stats ? mcalc_stats_clock() : 0;
+	if (variables && var_count > LINEAR_LOOKUP) {
+		s.lookup_scope = fill_scope(mcalc_arena_alloc(arena, scope_size(var_count)), variables, var_count);
+	}
 	next_token(&s);
-	mcalc_expr *root = list(&s);
+	mcalc_expr *root = results && s.capacity > 0 ? formulas(&s) : list(&s);
+	if (stats) {
+		mcalc_stats_time(MCALC_PHASE_PARSE, start);
+		mcalc_stats_count(MCALC_STAT_COMPILES, 1);
+	}
 	if (s.type != TOK_END) {
-		mcalc_free(root);
+		if (stats) {
+			mcalc_stats_count(MCALC_STAT_PARSE_ERRORS, 1);
+			mcalc_stats_count(MCALC_STAT_NODES, s.nodes);
+		}
 		if (error) {
 			*error = (s.next - s.start);
 			if (*error == 0) *error = 1;
+			if (s.too_deep) *error = MCALC_TOO_DEEP;
+			if (s.out_of_memory) *error = MCALC_OUT_OF_MEMORY;
 		}
 		return 0;
 	} else {
-		optimize(root);
+		if (stats) start = mcalc_stats_clock();
+		root = optimize(&s, root);
+		if (stats) {
+			mcalc_stats_time(MCALC_PHASE_OPTIMIZE, start);
+			mcalc_stats_count(MCALC_STAT_NODES, s.nodes);
+		}
+		if (s.out_of_memory) {
+			if (error) *error = MCALC_OUT_OF_MEMORY;
+			return 0;
+		}
+		if (root->depth > s.max_depth) {
+			if (error) *error = MCALC_TOO_DEEP;
+			return 0;
+		}
 		if (error) *error = 0;
+		if (count) *count = s.count;
 		return root;
 	}
 }
 
-double mcalc_interp(const char *expression, int *error) {
-	mcalc_expr *n = mcalc_compile(expression, 0, 0, error);
-	double ret;
-	if (n) {
-		ret = mcalc_eval(n);
-		mcalc_free(n);
+static mcalc_expr *compile_owned(const char *expression, size_t length, const mcalc_variable *variables, int var_count, const mcalc_options *options, double *results, int *count, int *error) {
+	mcalc_arena a;
+	mcalc_arena_init(&a, 0, 0);
+	mcalc_expr *root = compile(&a, expression, length, variables, var_count, options, results, count, error);
+	if (!root) {
+		mcalc_arena_release(&a);
+		return 0;
+	}
+	/* Move the root behind the arena header so mcalc_free can find the blocks. */
+	const size_t size = expr_size(root->type);
+	owned_root *owned = mcalc_arena_alloc(&a, offsetof(owned_root, root) + size);
+	if (!owned) {
+		mcalc_arena_release(&a);
+		if (error) *error = MCALC_OUT_OF_MEMORY;
+		return 0;
+	}
+	memcpy(&owned->root, root, size);
+	owned->blocks = a.blocks;
+	return &owned->root;
+}
+
+static const char *skip_spaces(const char *p, const char *end) {
+	while (p != end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+	return p;
+}
+
+/* Length of the lowercase name at p, as the lexer reads them, 0 if there is none. */
+static int name_length(const char *p, const char *end) {
+	const char *q = p;
+	if (q == end || *q < 'a' || *q > 'z') return 0;
+	for (q++; q != end && ((*q >= 'a' && *q <= 'z') || IS_DIGIT(*q) || *q == '_'); q++);
+	return (int)(q - p);
+}
+
+static char *copy_name(mcalc_arena *arena, const char *name, int length) {
+	char *ret = mcalc_arena_alloc(arena, length + 1);
+	if (ret) {
+		memcpy(ret, name, length);
+		ret[length] = '\0';
+	}
+	return ret;
+}
+
+mcalc_definition *mcalc_definition_create(const char *text, size_t length, const mcalc_options *options, int *error) {
+	/* <definition> =   <name> "(" [<name> {"," <name>}] ")" "=" <list> */
+	const char *const end = text + length;
+	const char *p = skip_spaces(text, end), *names[DEFINITION_PARAMETERS];
+	int lengths[DEFINITION_PARAMETERS];
+	mcalc_variable parameters[DEFINITION_PARAMETERS];
+	mcalc_definition *d;
+	state s;
+	int arity = 0, i;
+	const int name = name_length(p, end);
+	const char *const start = p;
+	p = skip_spaces(p + name, end);
+	/* Builtins and the keyword can't be redefined. */
+	if (!name || find_builtin(start, name) || (name == 2 && start[0] == 'i' && start[1] == 'f')) goto invalid;
+	if (p == end || *p != '(') goto invalid;
+	p = skip_spaces(p + 1, end);
+	if (p != end && *p == ')') {
+		p++;
 	} else {
-		ret = NAN;
+		for (;;) {
+			if (arity == DEFINITION_PARAMETERS || !(lengths[arity] = name_length(p, end))) goto invalid;
+			names[arity] = p;
+			for (i = 0; i < arity; i++) {
+				if (lengths[i] == lengths[arity] && memcmp(names[i], p, lengths[i]) == 0) goto invalid;
+			}
+			p = skip_spaces(p + lengths[arity++], end);
+			if (p == end || (*p != ',' && *p != ')')) goto invalid;
+			if (*p++ == ')') break;
+			p = skip_spaces(p, end);
+		}
+	}
+	p = skip_spaces(p, end);
+	if (p == end || *p != '=' || (p + 1 != end && p[1] == '=')) goto invalid;
+	d = malloc(sizeof(mcalc_definition));
+	if (!d) goto out_of_memory;
+	mcalc_arena_init(&d->arena, 0, 0);
+	d->arity = arity;
+	d->name = copy_name(&d->arena, start, name);
+	for (i = 0; i < arity; i++) {
+		parameters[i].name = copy_name(&d->arena, names[i], lengths[i]);
+		parameters[i].address = d->parameters + i;
+		parameters[i].type = MCALC_VARIABLE;
+		parameters[i].context = 0;
+		if (!parameters[i].name) d->name = 0;
+	}
+	if (!d->name) {
+		mcalc_definition_free(d);
+		goto out_of_memory;
 	}
+	/* The body's positions count from the start of the text. */
+	init_state(&s, &d->arena, text, length, parameters, arity, options);
+	s.next = p + 1;
+	s.scope = 0;
+	next_token(&s);
+	d->body = list(&s);
+	if (s.type != TOK_END || s.nodes > DEFINITION_NODES) {
+		if (error) *error = s.out_of_memory ? MCALC_OUT_OF_MEMORY : s.too_deep ? MCALC_TOO_DEEP : s.next - s.start ? (int)(s.next - s.start) : 1;
+		mcalc_definition_free(d);
+		return 0;
+	}
+	if (error) *error = 0;
+	return d;
+invalid:
+	if (error) *error = (int)(p - text) + 1;
+	return 0;
+out_of_memory:
+	if (error) *error = MCALC_OUT_OF_MEMORY;
+	return 0;
+}
+
+const char *mcalc_definition_name(const mcalc_definition *d) {
+	return d->name;
+}
+
+int mcalc_definition_arity(const mcalc_definition *d) {
+	return d->arity;
+}
+
+void mcalc_definition_free(mcalc_definition *d) {
+	if (!d) return;
+	mcalc_arena_release(&d->arena);
+	free(d);
+}
+
+mcalc_expr *mcalc_compile_ex(const char *expression, size_t length, const mcalc_variable *variables, int var_count, const mcalc_options *options, int *error) {
+	if (options && options->arena) {
+		return compile(options->arena, expression, length, variables, var_count, options, 0, 0, error);
+	}
+	return compile_owned(expression, length, variables, var_count, options, 0, 0, error);
+}
+
+mcalc_expr *mcalc_compile_multi(const char *expression, size_t length, const mcalc_variable *variables, int var_count, const mcalc_options *options, double *results, int *count, int *error) {
+	if (options && options->arena) {
+		return compile(options->arena, expression, length, variables, var_count, options, results, count, error);
+	}
+	return compile_owned(expression, length, variables, var_count, options, results, count, error);
+}
+
+mcalc_expr *mcalc_compile_arena_n(mcalc_arena *arena, const char *expression, size_t length, const mcalc_variable *variables, int var_count, int *error) {
+	return compile(arena, expression, length, variables, var_count, 0, 0, 0, error);
+}
+
+mcalc_expr *mcalc_compile_arena(mcalc_arena *arena, const char *expression, const mcalc_variable *variables, int var_count, int *error) {
+	return mcalc_compile_arena_n(arena, expression, strlen(expression), variables, var_count, error);
+}
+
+mcalc_expr *mcalc_compile_n(const char *expression, size_t length, const mcalc_variable *variables, int var_count, int *error) {
+	return compile_owned(expression, length, variables, var_count, 0, 0, 0, error);
+}
+
+mcalc_expr *mcalc_compile(const char *expression, const mcalc_variable *variables, int var_count, int *error) {
+	return mcalc_compile_n(expression, strlen(expression), variables, var_count, error);
+}
+
+double mcalc_interp(const char *expression, int *error) {
+	/* Small formulas fit in the on-stack buffer and compile without touching the heap. */
+	double buffer[ARENA_BLOCK / sizeof(double)];
+	mcalc_arena a;
+	mcalc_arena_init(&a, buffer, sizeof(buffer));
+	mcalc_expr *n = mcalc_compile_arena(&a, expression, 0, 0, error);
+	const double ret = n ? mcalc_eval(n) : NAN;
+	mcalc_arena_release(&a);
+	return ret;
+}
+
+#define STACK_DEPTH 64
+
+/* Lowering: a node reached more than once (a subexpression shared by the optimizer)
+ * is computed on its first use and kept in a slot for the later ones. */
+typedef struct node_info {
+	const mcalc_expr *node;
+	int refs;
+	int slot;
+} node_info;
+
+typedef struct assembler {
+	mcalc_arena *arena; /* Temporary memory comes from here when set, else from the heap. */
+	node_info *table;
+	unsigned mask;
+	unsigned used;
+	int length;
+	int slots;
+	int pure;
+	int branches, deepest_branch; /* Open and most nested branches. */
+	mcalc_op *code; /* 0 while only measuring. */
+} assembler;
+
+static node_info *new_table(assembler *a, unsigned capacity) {
+	const size_t size = sizeof(node_info) * capacity;
+	node_info *table = a->arena ? mcalc_arena_alloc(a->arena, size) : malloc(size);
+	if (table) memset(table, 0, size);
+	return table;
+}
+
+static node_info *node_of(assembler *a, const mcalc_expr *n) {
+	unsigned i = (unsigned)(((size_t)n >> 3) * 0x9E3779B1u) & a->mask;
+	for (; a->table[i].node; i = (i + 1) & a->mask) {
+		if (a->table[i].node == n) return a->table + i;
+	}
+	return 0;
+}
+
+static int add_node(assembler *a, const mcalc_expr *n) {
+	/* Returns 1 if `n` was already known. */
+	unsigned i;
+	if (2 * (a->used + 1) > a->mask + 1) {
+		/* Grow to keep the table at most half full. */
+		node_info *old = a->table;
+		const unsigned old_capacity = a->mask + 1;
+		node_info *table = new_table(a, 2 * old_capacity);
+		if (!table) return -1;
+		a->table = table;
+		a->mask = 2 * old_capacity - 1;
+		for (i = 0; i < old_capacity; i++) {
+			if (!old[i].node) continue;
+			unsigned j = (unsigned)(((size_t)old[i].node >> 3) * 0x9E3779B1u) & a->mask;
+			while (a->table[j].node) j = (j + 1) & a->mask;
+			a->table[j] = old[i];
+		}
+		if (!a->arena) free(old);
+	}
+	i = (unsigned)(((size_t)n >> 3) * 0x9E3779B1u) & a->mask;
+	for (; a->table[i].node; i = (i + 1) & a->mask) {
+		if (a->table[i].node == n) {
+			a->table[i].refs++;
+			return 1;
+		}
+	}
+	a->table[i].node = n;
+	a->table[i].refs = 1;
+	a->table[i].slot = -1;
+	a->used++;
+	return 0;
+}
+
+static int count_refs(assembler *a, const mcalc_expr *n) {
+	const int arity = ARITY(n->type);
+	int i, known = add_node(a, n);
+	if (known) return known < 0 ? -1 : 0;
+	if ((IS_FUNCTION(n->type) || IS_CLOSURE(n->type)) && !IS_PURE(n->type)) a->pure = 0;
+	for (i = 0; i < arity; i++) {
+		if (count_refs(a, n->parameters[i]) < 0) return -1;
+	}
+	return 0;
+}
+
+static mcalc_op *next_op(assembler *a) {
+	mcalc_op *op = a->code ? a->code + a->length : 0;
+	a->length++;
+	if (op) {
+		op->slot = 0;
+		op->context = 0;
+	}
+	return op;
+}
+
+static void keep(assembler *a, node_info *info) {
+	/* Stores the value of a node used again later. */
+	mcalc_op *op;
+	if (!info || info->refs < 2) return;
+	info->slot = a->slots++;
+	op = next_op(a);
+	if (op) {
+		op->code = OP_STORE;
+		op->slot = info->slot;
+	}
+}
+
+static void forget(assembler *a, int first) {
+	/* Slots from `first` on were stored on one side of a branch, their nodes are computed again where used next. */
+	unsigned i;
+	for (i = 0; i <= a->mask; i++) {
+		if (a->table[i].slot >= first) a->table[i].slot = -1;
+	}
+}
+
+static int emit(assembler *a, const mcalc_expr *n, int depth);
+
+static int emit_branch(assembler *a, const mcalc_expr *n, int depth) {
+	/* c JUMP_ZERO(else) a JUMP(end) else: b end: */
+	const int first = a->slots;
+	int deepest = emit(a, n->parameters[0], depth), d;
+	mcalc_op *skip = next_op(a), *jump;
+	if (skip) skip->code = OP_JUMP_ZERO;
+	if (++a->branches > a->deepest_branch) a->deepest_branch = a->branches;
+	d = emit(a, n->parameters[1], depth);
+	if (d > deepest) deepest = d;
+	forget(a, first);
+	jump = next_op(a);
+	if (jump) jump->code = OP_JUMP;
+	if (skip) skip->target = a->length;
+	d = emit(a, n->parameters[2], depth);
+	if (d > deepest) deepest = d;
+	forget(a, first);
+	if (jump) jump->target = a->length;
+	a->branches--;
+	return deepest;
+}
+
+static int emit(assembler *a, const mcalc_expr *n, int depth) {
+	/* Emits the code of `n` with `depth` values already on the stack, returns the deepest level reached. */
+	const int arity = ARITY(n->type);
+	node_info *info = arity ? node_of(a, n) : 0;
+	int i, deepest = depth + 1;
+	mcalc_op *op;
+	if (info && info->refs > 1 && info->slot >= 0) {
+		op = next_op(a);
+		if (op) {
+			op->code = OP_LOAD;
+			op->slot = info->slot;
+		}
+		return deepest;
+	}
+	if (TYPE_MASK(n->type) == MCALC_BRANCH) {
+		const int d = emit_branch(a, n, depth);
+		keep(a, info);
+		return d > deepest ? d : deepest;
+	}
+	for (i = 0; i < arity; i++) {
+		const int d = emit(a, n->parameters[i], depth + i);
+		if (d > deepest) deepest = d;
+	}
+	op = next_op(a);
+	if (op) switch (TYPE_MASK(n->type)) {
+		case MCALC_CONSTANT: op->code = OP_CONSTANT; op->value = n->value; break;
+		case MCALC_VARIABLE: op->code = OP_VARIABLE; op->bound = n->bound; break;
+		case MCALC_FUNCTION0: case MCALC_FUNCTION1: case MCALC_FUNCTION2: case MCALC_FUNCTION3:
+		case MCALC_FUNCTION4: case MCALC_FUNCTION5: case MCALC_FUNCTION6: case MCALC_FUNCTION7:
+			op->code = OP_CALL0 + arity;
+			op->function = n->function;
+			if (arity == 2) {
+				if (n->function == add) op->code = OP_ADD;
+				else if (n->function == sub) op->code = OP_SUB;
+				else if (n->function == mul) op->code = OP_MUL;
+				else if (n->function == divide) op->code = OP_DIV;
+				else if (n->function == comma) op->code = OP_COMMA;
+			} else if (arity == 3 && n->function == choose) {
+				op->code = OP_SELECT;
+			} else if (arity == 1 && n->function == negate) {
+				op->code = OP_NEG;
+			}
+			break;
+		case MCALC_CLOSURE0: case MCALC_CLOSURE1: case MCALC_CLOSURE2: case MCALC_CLOSURE3:
+		case MCALC_CLOSURE4: case MCALC_CLOSURE5: case MCALC_CLOSURE6: case MCALC_CLOSURE7:
+			op->code = OP_CLOSURE0 + arity;
+			op->function = n->function;
+			op->context = n->parameters[arity];
+			break;
+		default: op->code = OP_CONSTANT; op->value = NAN; break;
+	}
+	keep(a, info);
+	return deepest;
+}
+
+static mcalc_program *assemble(mcalc_arena *arena, const mcalc_expr *n) {
+	assembler a;
+	mcalc_program *p = 0;
+	unsigned i;
+	const unsigned long long start = MCALC_STATS_ON() ? mcalc_stats_clock() : 0;
+	a.arena = arena;
+	a.mask = 63;
+	a.used = 0;
+	a.pure = 1;
+	a.table = new_table(&a, a.mask + 1);
+	if (!a.table || count_refs(&a, n) < 0) goto done;
+	/* Measure first, then emit into a program of the exact size. */
+	a.code = 0;
+	a.length = a.slots = 0;
+	a.branches = a.deepest_branch = 0;
+	emit(&a, n, 0);
+	const size_t size = sizeof(mcalc_program) + sizeof(mcalc_op) * (a.length - 1);
+	p = arena ? mcalc_arena_alloc(arena, size) : malloc(size);
+	if (!p) goto done;
+	for (i = 0; i <= a.mask; i++) a.table[i].slot = -1;
+	a.code = p->code;
+	a.length = a.slots = 0;
+	a.branches = a.deepest_branch = 0;
+	p->depth = emit(&a, n, 0);
+	p->length = a.length;
+	p->slots = a.slots;
+	p->pure = a.pure;
+	p->branches = a.deepest_branch;
+done:
+	if (!arena) free(a.table);
+	if (start) mcalc_stats_time(MCALC_PHASE_ASSEMBLE, start);
+	return p;
+}
+
+mcalc_program *mcalc_assemble(const mcalc_expr *n) {
+	if (!n) return 0;
+	return assemble(0, n);
+}
+
+mcalc_program *mcalc_assemble_arena(mcalc_arena *arena, const mcalc_expr *n) {
+	if (!n) return 0;
+	return assemble(arena, n);
+}
+
+#define MCALC_FUN(...) ((double(*)(__VA_ARGS__))op->function)
+
+double mcalc_run_row(const mcalc_program *p, double *stack, const double *const *columns, size_t row) {
+	const mcalc_op *op = p->code, *end = p->code + p->length;
+	double *top = stack - 1;
+	double *slots = stack + p->depth;
+	for (; op != end; ++op) {
+		switch (op->code) {
+			case OP_CONSTANT: *++top = op->value; break;
+			case OP_VARIABLE: *++top = columns && columns[op - p->code] ? columns[op - p->code][row] : *op->bound; break;
+			case OP_ADD: top[-1] += top[0]; --top; break;
+			case OP_SUB: top[-1] -= top[0]; --top; break;
+			case OP_MUL: top[-1] *= top[0]; --top; break;
+			case OP_DIV: top[-1] /= top[0]; --top; break;
+			case OP_NEG: top[0] = -top[0]; break;
+			case OP_COMMA: top[-1] = top[0]; --top; break;
+			case OP_STORE: slots[op->slot] = top[0]; break;
+			case OP_LOAD: *++top = slots[op->slot]; break;
+			case OP_SELECT: top -= 2; top[0] = top[0] != 0 ? top[1] : top[2]; break;
+			case OP_JUMP_ZERO: if (*top-- == 0) op = p->code + op->target - 1; break;
+			case OP_JUMP: op = p->code + op->target - 1; break;
+			case OP_CALL0 + 0: *++top = MCALC_FUN(void)(); break;
+			case OP_CALL0 + 1: top[0] = MCALC_FUN(double)(top[0]); break;
+			case OP_CALL0 + 2: top -= 1; top[0] = MCALC_FUN(double, double)(top[0], top[1]); break;
+			case OP_CALL0 + 3: top -= 2; top[0] = MCALC_FUN(double, double, double)(top[0], top[1], top[2]); break;
+			case OP_CALL0 + 4: top -= 3; top[0] = MCALC_FUN(double, double, double, double)(top[0], top[1], top[2], top[3]); break;
+			case OP_CALL0 + 5: top -= 4; top[0] = MCALC_FUN(double, double, double, double, double)(top[0], top[1], top[2], top[3], top[4]); break;
+			case OP_CALL0 + 6: top -= 5; top[0] = MCALC_FUN(double, double, double, double, double, double)(top[0], top[1], top[2], top[3], top[4], top[5]); break;
+			case OP_CALL0 + 7: top -= 6; top[0] = MCALC_FUN(double, double, double, double, double, double, double)(top[0], top[1], top[2], top[3], top[4], top[5], top[6]); break;
+			case OP_CLOSURE0 + 0: *++top = MCALC_FUN(void*)(op->context); break;
+			case OP_CLOSURE0 + 1: top[0] = MCALC_FUN(void*, double)(op->context, top[0]); break;
+			case OP_CLOSURE0 + 2: top -= 1; top[0] = MCALC_FUN(void*, double, double)(op->context, top[0], top[1]); break;
+			case OP_CLOSURE0 + 3: top -= 2; top[0] = MCALC_FUN(void*, double, double, double)(op->context, top[0], top[1], top[2]); break;
+			case OP_CLOSURE0 + 4: top -= 3; top[0] = MCALC_FUN(void*, double, double, double, double)(op->context, top[0], top[1], top[2], top[3]); break;
+			case OP_CLOSURE0 + 5: top -= 4; top[0] = MCALC_FUN(void*, double, double, double, double, double)(op->context, top[0], top[1], top[2], top[3], top[4]); break;
+			case OP_CLOSURE0 + 6: top -= 5; top[0] = MCALC_FUN(void*, double, double, double, double, double, double)(op->context, top[0], top[1], top[2], top[3], top[4], top[5]); break;
+			case OP_CLOSURE0 + 7: top -= 6; top[0] = MCALC_FUN(void*, double, double, double, double, double, double, double)(op->context, top[0], top[1], top[2], top[3], top[4], top[5], top[6]); break;
+		}
+	}
+	return top[0];
+}
+#undef MCALC_FUN
+
+double mcalc_run(const mcalc_program *p) {
+	if (!p) return NAN;
+	if (p->depth + p->slots <= STACK_DEPTH) {
+		double stack[STACK_DEPTH];
+		return mcalc_run_row(p, stack, 0, 0);
+	}
+	/* Only very deeply nested or shared formulas need more than the fixed stack. */
+	double *stack = malloc(sizeof(double) * (p->depth + p->slots));
+	if (!stack) return NAN;
+	const double ret = mcalc_run_row(p, stack, 0, 0);
+	free(stack);
 	return ret;
 }
+
+int mcalc_program_pure(const mcalc_program *p) {
+	return p->pure;
+}
+
+void mcalc_program_free(mcalc_program *p) {
+	free(p);
+}
+
 static void pn (const mcalc_expr *n, int depth) {
 	int i, arity;
 	printf("%*s", depth, "");
 	switch(TYPE_MASK(n->type)) {
 	case MCALC_CONSTANT: printf("%f\n", n->value); break;
 	case MCALC_VARIABLE: printf("bound %p\n", n->bound); break;
+	case MCALC_BRANCH:
+		printf("if %p %p %p\n", n->parameters[0], n->parameters[1], n->parameters[2]);
+		for (i = 0; i < 3; i++) pn(n->parameters[i], depth + 1);
+		break;
 	case MCALC_FUNCTION0: case MCALC_FUNCTION1: case MCALC_FUNCTION2: case MCALC_FUNCTION3:
 	case MCALC_FUNCTION4: case MCALC_FUNCTION5: case MCALC_FUNCTION6: case MCALC_FUNCTION7:
 	case MCALC_CLOSURE0: case MCALC_CLOSURE1: case MCALC_CLOSURE2: case MCALC_CLOSURE3:
@@ -545,3 +2031,249 @@ static void pn (const mcalc_expr *n, int depth) {
 void mcalc_print(const mcalc_expr *n) {
 	pn(n, 0);
 }
+
+/* Profiler: a copy of mcalc_eval counting the evaluations of every node, and timing one node
+ * (in turn) on every `period`-th evaluation, so that the timed node's children are not slowed
+ * down by clock reads of their own. Shared subtrees are unfolded, as mcalc_eval evaluates them
+ * once per occurrence. */
+#define PROFILE_NODES 65536
+
+typedef struct profile_node {
+	const mcalc_expr *expr;
+	struct profile_node *parameters[7];
+	unsigned long long calls, samples, ns; /* ns: sum of the sampled times, children included. */
+} profile_node;
+
+struct mcalc_profiler {
+	const mcalc_variable *variables;
+	int var_count;
+	int period, countdown; /* The next evaluation timed is the countdown-th. */
+	size_t count, next; /* Nodes, and the next one to time. */
+	const profile_node *timed; /* In the current evaluation, if any. */
+	unsigned long long clock_cost; /* Of one mcalc_stats_clock(), taken out of every sample. */
+	profile_node nodes[1]; /* In preorder, nodes[0] is the root. */
+};
+
+/* Nodes of the unfolded tree, or more than `limit` if there are too many. */
+static size_t unfolded(const mcalc_expr *n, size_t limit) {
+	size_t count = 1;
+	int i;
+	for (i = 0; i < ARITY(n->type) && count <= limit; i++) count += unfolded(n->parameters[i], limit - count);
+	return count;
+}
+
+static profile_node *unfold(profile_node **next, const mcalc_expr *n) {
+	profile_node *node = (*next)++;
+	int i;
+	node->expr = n;
+	for (i = 0; i < ARITY(n->type); i++) node->parameters[i] = unfold(next, n->parameters[i]);
+	return node;
+}
+
+static double profiled(mcalc_profiler *p, profile_node *node);
+
+#define MCALC_FUN(...) ((double(*)(__VA_ARGS__))n->function)
+
+static double measured(mcalc_profiler *p, profile_node *node) {
+	const mcalc_expr *n = node->expr;
+	const int arity = ARITY(n->type);
+	double a[7];
+	int i;
+	node->calls++;
+	switch (TYPE_MASK(n->type)) {
+		case MCALC_CONSTANT: return n->value;
+		case MCALC_VARIABLE: return *n->bound;
+		case MCALC_BRANCH:
+			return profiled(p, node->parameters[0]) != 0 ? profiled(p, node->parameters[1]) : profiled(p, node->parameters[2]);
+	}
+	/* Left to right, which mcalc_eval does not promise. */
+	for (i = 0; i < arity; i++) a[i] = profiled(p, node->parameters[i]);
+	if (IS_FUNCTION(n->type)) {
+		switch (arity) {
+			case 0: return MCALC_FUN(void)();
+			case 1: return MCALC_FUN(double)(a[0]);
+			case 2: return MCALC_FUN(double, double)(a[0], a[1]);
+			case 3: return MCALC_FUN(double, double, double)(a[0], a[1], a[2]);
+			case 4: return MCALC_FUN(double, double, double, double)(a[0], a[1], a[2], a[3]);
+			case 5: return MCALC_FUN(double, double, double, double, double)(a[0], a[1], a[2], a[3], a[4]);
+			case 6: return MCALC_FUN(double, double, double, double, double, double)(a[0], a[1], a[2], a[3], a[4], a[5]);
+			case 7: return MCALC_FUN(double, double, double, double, double, double, double)(a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+		}
+	} else if (IS_CLOSURE(n->type)) {
+		void *context = n->parameters[arity];
+		switch (arity) {
+			case 0: return MCALC_FUN(void*)(context);
+			case 1: return MCALC_FUN(void*, double)(context, a[0]);
+			case 2: return MCALC_FUN(void*, double, double)(context, a[0], a[1]);
+			case 3: return MCALC_FUN(void*, double, double, double)(context, a[0], a[1], a[2]);
+			case 4: return MCALC_FUN(void*, double, double, double, double)(context, a[0], a[1], a[2], a[3]);
+			case 5: return MCALC_FUN(void*, double, double, double, double, double)(context, a[0], a[1], a[2], a[3], a[4]);
+			case 6: return MCALC_FUN(void*, double, double, double, double, double, double)(context, a[0], a[1], a[2], a[3], a[4], a[5]);
+			case 7: return MCALC_FUN(void*, double, double, double, double, double, double, double)(context, a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+		}
+	}
+	return NAN;
+}
+#undef MCALC_FUN
+
+static double profiled(mcalc_profiler *p, profile_node *node) {
+	if (node != p->timed) return measured(p, node);
+	const unsigned long long start = mcalc_stats_clock();
+	const double value = measured(p, node);
+	const unsigned long long ns = mcalc_stats_clock() - start;
+	node->samples++;
+	node->ns += ns > p->clock_cost ? ns - p->clock_cost : 0;
+	return value;
+}
+
+mcalc_profiler *mcalc_profiler_create(const mcalc_expr *n, const mcalc_variable *variables, int var_count, int period) {
+	mcalc_profiler *p;
+	profile_node *next;
+	size_t count;
+	unsigned long long start;
+	int i;
+	if (!n) return 0;
+	count = unfolded(n, PROFILE_NODES);
+	if (count > PROFILE_NODES) return 0;
+	p = malloc(offsetof(mcalc_profiler, nodes) + count * sizeof(profile_node));
+	if (!p) return 0;
+	p->variables = variables;
+	p->var_count = variables ? var_count : 0;
+	p->period = period > 0 ? period : 1;
+	p->count = count;
+	next = p->nodes;
+	unfold(&next, n);
+	start = mcalc_stats_clock();
+	for (i = 0; i < 255; i++) mcalc_stats_clock();
+	p->clock_cost = (mcalc_stats_clock() - start) / 256;
+	mcalc_profiler_reset(p);
+	return p;
+}
+
+double mcalc_profiler_eval(mcalc_profiler *p) {
+	if (!p) return NAN;
+	p->timed = 0;
+	if (--p->countdown == 0) {
+		p->countdown = p->period;
+		p->timed = p->nodes + p->next;
+		if (++p->next == p->count) p->next = 0;
+	}
+	return profiled(p, p->nodes);
+}
+
+void mcalc_profiler_reset(mcalc_profiler *p) {
+	size_t i;
+	if (!p) return;
+	for (i = 0; i < p->count; i++) p->nodes[i].calls = p->nodes[i].samples = p->nodes[i].ns = 0;
+	p->countdown = 1;
+	p->next = 0;
+}
+
+void mcalc_profiler_free(mcalc_profiler *p) {
+	free(p);
+}
+
+typedef struct report {
+	char *buffer;
+	size_t size, written;
+} report;
+
+static void put_text(report *r, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	r->written += vsnprintf(r->written < r->size ? r->buffer + r->written : 0, r->written < r->size ? r->size - r->written : 0, format, args);
+	va_end(args);
+}
+
+/* What the node computes: an operator, a builtin, or the caller's name for a variable or function. */
+static void label(const mcalc_profiler *p, const mcalc_expr *n, char *text, size_t size) {
+	static const struct {const void *function; const char *name;} operators[] = {
+		{add, "+"}, {sub, "-"}, {mul, "*"}, {divide, "/"}, {mod, "%"}, {negate, "-"}, {comma, ","},
+		{less, "<"}, {less_equal, "<="}, {greater, ">"}, {greater_equal, ">="}, {equal, "=="}, {not_equal, "!="},
+		{choose, "select"}
+	};
+	const int type = TYPE_MASK(n->type);
+	int i;
+	if (type == MCALC_CONSTANT) {
+		snprintf(text, size, "%.17g", n->value);
+		return;
+	}
+	if (type == MCALC_BRANCH) {
+		snprintf(text, size, "if");
+		return;
+	}
+	for (i = 0; i < p->var_count; i++) {
+		const mcalc_variable *v = p->variables + i;
+		if (TYPE_MASK(v->type) == type && v->address == (type == MCALC_VARIABLE ? (const void *)n->bound : n->function)) {
+			snprintf(text, size, "%s", v->name);
+			return;
+		}
+	}
+	if (type == MCALC_VARIABLE) {
+		snprintf(text, size, "bound %p", (const void *)n->bound);
+		return;
+	}
+	for (i = 0; i < (int)(sizeof(operators) / sizeof(operators[0])); i++) {
+		if (operators[i].function == n->function) {
+			snprintf(text, size, "%s", operators[i].name);
+			return;
+		}
+	}
+	for (i = 0; functions[i].name; i++) {
+		if (functions[i].address == n->function || mcalc_vmath_function(functions[i].address, MCALC_MATH_ULP4) == n->function) {
+			snprintf(text, size, "%s", functions[i].name);
+			return;
+		}
+	}
+	snprintf(text, size, "f%d", ARITY(n->type));
+}
+
+/* Time spent in the node over all its calls, children included, going by its samples. */
+static double node_total(const profile_node *node) {
+	return node->samples ? (double)node->ns / node->samples * node->calls : 0;
+}
+
+static void report_node(report *r, const mcalc_profiler *p, const profile_node *node, double root, int depth, int json) {
+	const int arity = ARITY(node->expr->type);
+	double self = node_total(node);
+	char text[64];
+	int i;
+	for (i = 0; i < arity; i++) self -= node_total(node->parameters[i]);
+	if (self < 0) self = 0;
+	label(p, node->expr, text, sizeof(text));
+	if (json) {
+		put_text(r, "{\"node\":\"");
+		for (i = 0; text[i]; i++) put_text(r, text[i] == '"' || text[i] == '\\' ? "\\%c" : "%c", text[i]);
+		put_text(r, "\",\"calls\":%llu", node->calls);
+		if (node->samples) {
+			put_text(r, ",\"ns\":%.1f,\"self_ns\":%.1f,\"share\":%.1f", (double)node->ns / node->samples,
+				node->calls ? self / node->calls : 0, root > 0 ? 100 * node_total(node) / root : 0);
+		} else {
+			put_text(r, ",\"ns\":null,\"self_ns\":null,\"share\":null");
+		}
+		put_text(r, ",\"children\":[");
+		for (i = 0; i < arity; i++) {
+			if (i) put_text(r, ",");
+			report_node(r, p, node->parameters[i], root, depth + 1, json);
+		}
+		put_text(r, "]}");
+	} else {
+		put_text(r, "%*s%s: %llu calls", 2 * depth, "", text, node->calls);
+		if (node->samples) {
+			put_text(r, ", %.1f ns, self %.1f ns, %.1f%%", (double)node->ns / node->samples,
+				node->calls ? self / node->calls : 0, root > 0 ? 100 * node_total(node) / root : 0);
+		} else if (node->calls) {
+			put_text(r, ", not timed");
+		}
+		put_text(r, "\n");
+		for (i = 0; i < arity; i++) report_node(r, p, node->parameters[i], root, depth + 1, json);
+	}
+}
+
+size_t mcalc_profiler_report(const mcalc_profiler *p, int json, char *buffer, size_t size) {
+	report r = {buffer, size, 0};
+	if (!p) return 0;
+	if (size) buffer[0] = '\0';
+	report_node(&r, p, p->nodes, node_total(p->nodes), 0, json);
+	return r.written;
+}
@@ -1,12 +1,15 @@
 #ifndef __MCALC_H__
 	#define __MCALC_H__
 	
+	#include <stddef.h>
+
 	#ifdef __cplusplus
 	extern "C" {
 	#endif
 
 	typedef struct mcalc_expr {
 		int type;
+		int depth; /* Nodes on the longest path down from this one, at most mcalc_options.max_depth. */
 		union {double value; const double *bound; const void *function;};
 		void *parameters[1];
 	} mcalc_expr;
@@ -30,12 +33,149 @@
 		void *context;
 	} mcalc_variable;
 
+	/* Bump allocator for trees and programs, released in one go.
+	 * An optional caller buffer (e.g. on the stack) is used before any heap block,
+	 * and mcalc_arena_reset keeps the heap blocks so a reused arena stops allocating. */
+	typedef struct mcalc_arena_block mcalc_arena_block;
+	typedef struct mcalc_arena {
+		char *next, *end;
+		char *buffer;
+		size_t buffer_size;
+		mcalc_arena_block *blocks, *current;
+	} mcalc_arena;
+
+	/* Hashed set of variables, built once and shared by any number of compiles. */
+	typedef struct mcalc_scope mcalc_scope;
+
+	/* A function written as a formula, see mcalc_definition_create. */
+	typedef struct mcalc_definition mcalc_definition;
+
+	/* The definition called `name` (`length` bytes, not NUL-terminated), 0 if there is none. */
+	typedef const mcalc_definition *(*mcalc_resolver)(void *context, const char *name, size_t length);
+
+	/* Optional settings of mcalc_compile_ex, zero-initialize the fields that aren't used. */
+	typedef struct mcalc_options {
+		mcalc_arena *arena; /* Build the tree in this arena instead of one owned by the tree. */
+		const mcalc_scope *scope; /* Searched before the `variables` table. */
+		int flags; /* MCALC_FAST_MATH, MCALC_MATH_ULP1 or MCALC_MATH_ULP4, and MCALC_POW_RIGHT */
+		/* Asked for the names that are neither variables nor builtins; the definitions
+		 * it returns are only read during the compile. */
+		mcalc_resolver resolve;
+		void *resolve_context;
+		/* Open brackets and operators waiting for an operand the parser may hold at once, e.g.
+		 * 3 for "(a+(b", and levels of the tree, 3 for "a+b+c": deeper formulas fail to compile
+		 * with MCALC_TOO_DEEP. MCALC_MAX_DEPTH, or the MCALC_MAX_DEPTH environment variable, when 0. */
+		int max_depth;
+	} mcalc_options;
+
+	#define MCALC_MAX_DEPTH 1000 /* Trees this deep are compiled, run and profiled in about 200 KiB of thread stack. */
+
+	enum {
+		/* Allow rewrites that may change the last bits of a result: reassociating
+		 * constant chains, x^n as multiplications, x+0 as x (wrong sign for x = -0). */
+		MCALC_FAST_MATH = 1,
+		/* Accuracy of the transcendental builtins, libm's by default. The vmath.c kernels run
+		 * 4 rows at a time in mcalc_run_batch: with ULP1 exp, ln, sin and cos are within 1 ulp,
+		 * with ULP4 also pow, log10, tan, sinh, cosh and tanh, within 4. */
+		MCALC_MATH_ULP1 = 2,
+		MCALC_MATH_ULP4 = 4,
+		/* x^y^z is x^(y^z) and -x^2 is -(x^2), instead of (x^y)^z and (-x)^2.
+		 * The default when built with -DMCALC_POW_FROM_RIGHT. */
+		MCALC_POW_RIGHT = 8
+	};
+
+	/* A compiled expression lowered to flat code, independent of the tree it came from. */
+	typedef struct mcalc_program mcalc_program;
+
+	void mcalc_arena_init(mcalc_arena *a, void *buffer, size_t size);
+	void *mcalc_arena_alloc(mcalc_arena *a, size_t size);
+	void mcalc_arena_reset(mcalc_arena *a);
+	void mcalc_arena_release(mcalc_arena *a);
+
+	/* The scope copies the table, the names must outlive it. */
+	mcalc_scope *mcalc_scope_create(const mcalc_variable *variables, int var_count);
+	void mcalc_scope_free(mcalc_scope *scope);
+
+	/* The compiles set *error to 0, to the position of a syntax error (from 1) or to one of these. */
+	#define MCALC_OUT_OF_MEMORY (-1)
+	#define MCALC_TOO_DEEP (-2) /* Nested deeper than mcalc_options.max_depth. */
+
 	double mcalc_interp(const char *expression, int *error);
 	mcalc_expr *mcalc_compile(const char *expression, const mcalc_variable *variables, int var_count, int *error);
+	/* Same, for `length` bytes that need not be NUL-terminated (e.g. a MySQL argument buffer). */
+	mcalc_expr *mcalc_compile_n(const char *expression, size_t length, const mcalc_variable *variables, int var_count, int *error);
 	double mcalc_eval(const mcalc_expr *n);
+	/* Trees and programs built in a caller's arena live until it is reset or released, never mcalc_free them. */
+	mcalc_expr *mcalc_compile_arena(mcalc_arena *arena, const char *expression, const mcalc_variable *variables, int var_count, int *error);
+	mcalc_expr *mcalc_compile_arena_n(mcalc_arena *arena, const char *expression, size_t length, const mcalc_variable *variables, int var_count, int *error);
+	mcalc_expr *mcalc_compile_ex(const char *expression, size_t length, const mcalc_variable *variables, int var_count, const mcalc_options *options, int *error);
+	/* Formulas separated by ';' (e.g. "a*b; a*b*c") compiled into one tree, sharing their common
+	 * subexpressions. Evaluating it stores the value of the i-th formula in results[i] and returns
+	 * the last one. *count is the size of `results` on entry, the number of formulas on return. */
+	mcalc_expr *mcalc_compile_multi(const char *expression, size_t length, const mcalc_variable *variables, int var_count, const mcalc_options *options, double *results, int *count, int *error);
+	/* The builtins that are not in libm, for code computing the same values as a formula. */
+	double mcalc_fac(double a);
+	double mcalc_ncr(double n, double r);
+	double mcalc_npr(double n, double r);
+	double mcalc_mod(double a, double b); /* The % operator. */
 	void mcalc_print(const mcalc_expr *n);
 	void mcalc_free(mcalc_expr *n);
 
+	/* Parses "name(a, b, ...) = formula", with up to 16 parameters and no other variables. Calls of
+	 * the function are replaced by a copy of the formula when compiling, so the optimizer works across
+	 * them; each argument is evaluated as often as the formula uses it, and a compile whose calls copy
+	 * more than 65536 nodes fails. Of `options`, `resolve` calls
+	 * earlier definitions, `max_depth` and MCALC_POW_RIGHT apply to the formula, the rest is ignored.
+	 * 0 with *error set like mcalc_compile on error. */
+	mcalc_definition *mcalc_definition_create(const char *text, size_t length, const mcalc_options *options, int *error);
+	const char *mcalc_definition_name(const mcalc_definition *d);
+	int mcalc_definition_arity(const mcalc_definition *d);
+	void mcalc_definition_free(mcalc_definition *d);
+
+	/* Where the time of a tree goes: mcalc_profiler_eval is mcalc_eval counting the calls of every
+	 * node and timing one node in turn on every `period`-th evaluation, mcalc_eval is unchanged.
+	 * `variables` names the variables and functions in the report and must outlive the profiler.
+	 * 0 when out of memory or when the tree has more than 65536 nodes, shared ones unfolded. */
+	typedef struct mcalc_profiler mcalc_profiler;
+	mcalc_profiler *mcalc_profiler_create(const mcalc_expr *n, const mcalc_variable *variables, int var_count, int period);
+	double mcalc_profiler_eval(mcalc_profiler *p);
+	/* Writes the tree like mcalc_print (or as JSON) like snprintf, returns the full length: per node
+	 * the calls, mean ns with and without the children, and share of the whole formula's time. */
+	size_t mcalc_profiler_report(const mcalc_profiler *p, int json, char *buffer, size_t size);
+	void mcalc_profiler_reset(mcalc_profiler *p);
+	void mcalc_profiler_free(mcalc_profiler *p);
+
+	mcalc_program *mcalc_assemble(const mcalc_expr *n);
+	mcalc_program *mcalc_assemble_arena(mcalc_arena *arena, const mcalc_expr *n);
+	double mcalc_run(const mcalc_program *p);
+	/* True when every function called is MCALC_FLAG_PURE: the result only depends on the variables. */
+	int mcalc_program_pure(const mcalc_program *p);
+	void mcalc_program_free(mcalc_program *p);
+
+	/* Native code for a program (x86-64 System V only), holding no reference to it.
+	 * Where no code can be generated, calling it runs a private copy of the program. */
+	typedef struct mcalc_jit mcalc_jit;
+	mcalc_jit *mcalc_jit_compile(const mcalc_program *p);
+	int mcalc_jit_native(const mcalc_jit *j);
+	double mcalc_jit_call(const mcalc_jit *j);
+	void mcalc_jit_free(mcalc_jit *j);
+
+	/* Runs a program over `rows` rows at once. The variable variables[i] reads its value
+	 * from columns[i][row], other bound variables keep their current value for all rows.
+	 * Returns 0, or -1 when the working memory can't be allocated. */
+	int mcalc_run_batch(const mcalc_program *p, const mcalc_variable *variables, const double *const *columns, int count, double *out, size_t rows);
+
+	/* Position-independent encoding of a program, e.g. for a VARBINARY column: constants, inputs by
+	 * index and builtins by a stable number, versioned and checksummed. The program's variables must
+	 * be bound to inputs[0..count-1]; it must not call closures or functions of the caller.
+	 * Writes at most `size` bytes, returns the size of the whole blob or -1 if it can't be encoded. */
+	#define MCALC_BLOB_STACK 256 /* Stack entries plus slots a blob may need, always on the C stack. */
+	long mcalc_blob_write(const mcalc_program *p, const double *inputs, int count, unsigned char *blob, size_t size);
+	/* 0 if the blob is well-formed and reads at most `count` inputs, -1 if it would be unsafe to run. */
+	int mcalc_blob_check(const unsigned char *blob, size_t size, int count);
+	/* Evaluates a blob that passed mcalc_blob_check, straight from its buffer and without allocating. */
+	double mcalc_blob_eval(const unsigned char *blob, size_t size, const double *inputs);
+
 	#ifdef __cplusplus
 	}
 	#endif
@@ -0,0 +1,246 @@
+#include "evaluation.h"
+#include "program.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* Native code generation for x86-64 System V targets (Linux, BSD, macOS).
+ * Elsewhere mcalc_jit_compile still returns a callable that runs the program. */
+#if defined(__x86_64__) && !defined(_WIN32) && (defined(__unix__) || defined(__APPLE__))
+	#define MCALC_JIT_X86_64 1
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
+struct mcalc_jit {
+	double (*code)(void);
+	size_t size;
+	mcalc_program *program; /* Used when no native code could be generated. */
+};
+
+#ifdef MCALC_JIT_X86_64
+
+/* Stack entry i of the program lives in xmm<i>, xmm15 is scratch. */
+#define JIT_REGISTERS 15
+/* Upper bound of the bytes emitted per instruction. */
+#define OP_BYTES 512
+
+typedef struct emitter {
+	unsigned char *at;
+	unsigned char **labels; /* Where the code of each instruction starts, and of the end. */
+	unsigned char **jumps; /* The rel32 of each jump instruction, 0 for the others. */
+} emitter;
+
+static void byte(emitter *e, int b) {*e->at++ = (unsigned char)b;}
+
+static void imm64(emitter *e, uint64_t v) {memcpy(e->at, &v, 8); e->at += 8;}
+
+static void imm32(emitter *e, uint32_t v) {memcpy(e->at, &v, 4); e->at += 4;}
+
+/* prefix [REX] 0F opcode modrm, for two xmm registers. */
+static void sse_rr(emitter *e, int prefix, int opcode, int reg, int rm) {
+	byte(e, prefix);
+	if (reg >= 8 || rm >= 8) byte(e, 0x40 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0));
+	byte(e, 0x0F);
+	byte(e, opcode);
+	byte(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* movsd xmm, [rax] */
+static void load_rax(emitter *e, int reg) {
+	byte(e, 0xF2);
+	if (reg >= 8) byte(e, 0x44);
+	byte(e, 0x0F); byte(e, 0x10);
+	byte(e, (reg & 7) << 3);
+}
+
+/* movsd [rsp+disp], xmm (0x11) / movsd xmm, [rsp+disp] (0x10)
+ * The frame holds the registers spilled around calls, then the program's slots. */
+static void spill(emitter *e, int opcode, int reg, int disp) {
+	byte(e, 0xF2);
+	if (reg >= 8) byte(e, 0x44);
+	byte(e, 0x0F); byte(e, opcode);
+	byte(e, 0x84 | ((reg & 7) << 3)); byte(e, 0x24); imm32(e, disp);
+}
+
+#define SLOT(K) (8 * (JIT_REGISTERS + (K)))
+
+/* mov rax, imm64 */
+static void mov_rax(emitter *e, uint64_t v) {byte(e, 0x48); byte(e, 0xB8); imm64(e, v);}
+
+/* movq xmm, rax */
+static void movq_rax(emitter *e, int reg) {
+	byte(e, 0x66); byte(e, reg >= 8 ? 0x4C : 0x48); byte(e, 0x0F); byte(e, 0x6E);
+	byte(e, 0xC0 | ((reg & 7) << 3));
+}
+
+static void movapd(emitter *e, int to, int from) {
+	if (to != from) sse_rr(e, 0x66, 0x28, to, from);
+}
+
+/* rel32 of a jump to instruction `target`, resolved once every instruction is placed. */
+static void jump_to(emitter *e, int pc) {
+	e->jumps[pc] = e->at;
+	imm32(e, 0);
+}
+
+/* Calls op->function with the top `arity` slots as arguments, the result replaces them. */
+static void call(emitter *e, const mcalc_op *op, int arity, int closure, int top) {
+	const int base = top - arity + 1;
+	int i;
+	for (i = 0; i < base; i++) spill(e, 0x11, i, 8 * i);
+	for (i = 0; i < arity; i++) movapd(e, i, base + i);
+	if (closure) {
+		byte(e, 0x48); byte(e, 0xBF); imm64(e, (uint64_t)(uintptr_t)op->context); /* mov rdi, imm64 */
+	}
+	mov_rax(e, (uint64_t)(uintptr_t)op->function);
+	byte(e, 0xFF); byte(e, 0xD0); /* call rax */
+	movapd(e, base, 0);
+	for (i = 0; i < base; i++) spill(e, 0x10, i, 8 * i);
+}
+
+static int generate(emitter *e, const mcalc_program *p) {
+	/* With the return address, rsp stays 16-byte aligned at calls. */
+	const int frame = (8 * (JIT_REGISTERS + p->slots) + 15) / 16 * 16 + 8;
+	int pc, top = -1;
+	byte(e, 0x48); byte(e, 0x81); byte(e, 0xEC); imm32(e, frame); /* sub rsp, frame */
+	for (pc = 0; pc < p->length; pc++) {
+		const mcalc_op *op = p->code + pc;
+		uint64_t bits;
+		e->labels[pc] = e->at;
+		e->jumps[pc] = 0;
+		switch (op->code) {
+			case OP_CONSTANT:
+				memcpy(&bits, &op->value, 8);
+				mov_rax(e, bits);
+				movq_rax(e, ++top);
+				break;
+			case OP_VARIABLE:
+				mov_rax(e, (uint64_t)(uintptr_t)op->bound);
+				load_rax(e, ++top);
+				break;
+			case OP_ADD: sse_rr(e, 0xF2, 0x58, top - 1, top); --top; break;
+			case OP_SUB: sse_rr(e, 0xF2, 0x5C, top - 1, top); --top; break;
+			case OP_MUL: sse_rr(e, 0xF2, 0x59, top - 1, top); --top; break;
+			case OP_DIV: sse_rr(e, 0xF2, 0x5E, top - 1, top); --top; break;
+			case OP_COMMA: movapd(e, top - 1, top); --top; break;
+			case OP_STORE: spill(e, 0x11, top, SLOT(op->slot)); break;
+			case OP_LOAD: spill(e, 0x10, ++top, SLOT(op->slot)); break;
+			case OP_NEG:
+				mov_rax(e, 0x8000000000000000ull);
+				movq_rax(e, 15);
+				sse_rr(e, 0x66, 0x57, top, 15); /* xorpd */
+				break;
+			case OP_SELECT:
+				/* xmm15 = c == 0 as a mask, then (b & mask) | (a & ~mask). NaN is not 0. */
+				sse_rr(e, 0x66, 0x57, 15, 15); /* xorpd */
+				sse_rr(e, 0xF2, 0xC2, 15, top - 2); byte(e, 0); /* cmpeqsd */
+				sse_rr(e, 0x66, 0x54, top, 15); /* andpd */
+				sse_rr(e, 0x66, 0x55, 15, top - 1); /* andnpd */
+				sse_rr(e, 0x66, 0x56, 15, top); /* orpd */
+				movapd(e, top - 2, 15);
+				top -= 2;
+				break;
+			case OP_JUMP_ZERO:
+				sse_rr(e, 0x66, 0x57, 15, 15); /* xorpd */
+				sse_rr(e, 0x66, 0x2E, top, 15); /* ucomisd */
+				byte(e, 0x7A); byte(e, 0x06); /* jp over the je: NaN is not 0 */
+				byte(e, 0x0F); byte(e, 0x84); jump_to(e, pc); /* je */
+				--top;
+				break;
+			case OP_JUMP:
+				/* The other side starts from the height the condition left. */
+				byte(e, 0xE9); jump_to(e, pc);
+				--top;
+				break;
+			default:
+				if (op->code >= OP_CALL0 && op->code < OP_CALL0 + 8) {
+					const int arity = op->code - OP_CALL0;
+					call(e, op, arity, 0, top);
+					top += 1 - arity;
+				} else if (op->code >= OP_CLOSURE0 && op->code < OP_CLOSURE0 + 8) {
+					const int arity = op->code - OP_CLOSURE0;
+					call(e, op, arity, 1, top);
+					top += 1 - arity;
+				} else {
+					return 0;
+				}
+				break;
+		}
+	}
+	e->labels[p->length] = e->at;
+	byte(e, 0x48); byte(e, 0x81); byte(e, 0xC4); imm32(e, frame); /* add rsp, frame */
+	byte(e, 0xC3); /* ret */
+	for (pc = 0; pc < p->length; pc++) {
+		if (e->jumps[pc]) {
+			const int32_t offset = (int32_t)(e->labels[p->code[pc].target] - (e->jumps[pc] + 4));
+			memcpy(e->jumps[pc], &offset, 4);
+		}
+	}
+	return 1;
+}
+
+static void native(mcalc_jit *j, const mcalc_program *p) {
+	if (p->depth > JIT_REGISTERS) return;
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t size = ((size_t)(p->length + 1) * OP_BYTES + page - 1) / page * page;
+	/* Written while writable, then flipped to executable: never both at once. */
+	unsigned char **labels = malloc(sizeof(unsigned char*) * (2 * p->length + 1));
+	if (!labels) return;
+	void *code = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		free(labels);
+		return;
+	}
+	emitter e = {code, labels, labels + p->length + 1};
+	const int generated = generate(&e, p);
+	free(labels);
+	if (!generated || mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(code, size);
+		return;
+	}
+	j->code = (double(*)(void))code;
+	j->size = size;
+}
+
+#endif
+
+mcalc_jit *mcalc_jit_compile(const mcalc_program *p) {
+	if (!p) return 0;
+	mcalc_jit *j = malloc(sizeof(mcalc_jit));
+	if (!j) return 0;
+	j->code = 0;
+	j->size = 0;
+	j->program = 0;
+#ifdef MCALC_JIT_X86_64
+	native(j, p);
+#endif
+	if (!j->code) {
+		/* Keep a private copy so the callable doesn't depend on the caller's program. */
+		const size_t size = sizeof(mcalc_program) + sizeof(mcalc_op) * (p->length - 1);
+		j->program = malloc(size);
+		if (!j->program) {
+			free(j);
+			return 0;
+		}
+		memcpy(j->program, p, size);
+	}
+	return j;
+}
+
+int mcalc_jit_native(const mcalc_jit *j) {
+	return j && j->code;
+}
+
+double mcalc_jit_call(const mcalc_jit *j) {
+	return j->code ? j->code() : mcalc_run(j->program);
+}
+
+void mcalc_jit_free(mcalc_jit *j) {
+	if (!j) return;
+#ifdef MCALC_JIT_X86_64
+	if (j->code) munmap((void*)j->code, j->size);
+#endif
+	free(j->program);
+	free(j);
+}
@@ -25,16 +25,57 @@
 **
 ** CREATE FUNCTION mcalc RETURNS STRING SONAME "mcalc.so";
 **
+** mcalc(formula, args...) binds every trailing argument as a variable of
+** the formula, both by position ($1, $2, ...) and by the lowercase name of
+** the column or its AS alias: mcalc('a*x+b', 2 AS a, price AS x, 1 AS b).
+** Arguments that are constant for the statement are folded in at compile
+** time, so only the parts depending on `price` are evaluated per row.
+**
+** CREATE FUNCTION mcalc_memo RETURNS REAL SONAME "mcalc.so";
+** CREATE FUNCTION mcalc_multi RETURNS STRING SONAME "mcalc.so";
+** CREATE FUNCTION mcalc_compile_blob RETURNS STRING SONAME "mcalc.so";
+** CREATE FUNCTION mcalc_eval_blob RETURNS REAL SONAME "mcalc.so";
+** CREATE FUNCTION mcalc_fixed RETURNS REAL SONAME "mcalc.so";
+** CREATE FUNCTION mcalc_define RETURNS INTEGER SONAME "mcalc.so";
+** CREATE FUNCTION mcalc_undefine RETURNS INTEGER SONAME "mcalc.so";
+** CREATE FUNCTION mcalc_cache_size RETURNS INTEGER SONAME "mcalc.so";
+** CREATE FUNCTION mcalc_stats RETURNS STRING SONAME "mcalc.so";
+** CREATE FUNCTION mcalc_stats_reset RETURNS INTEGER SONAME "mcalc.so";
+** CREATE AGGREGATE FUNCTION mcalc_sum RETURNS REAL SONAME "mcalc.so";
+** CREATE AGGREGATE FUNCTION mcalc_avg RETURNS REAL SONAME "mcalc.so";
+** CREATE AGGREGATE FUNCTION mcalc_min RETURNS REAL SONAME "mcalc.so";
+** CREATE AGGREGATE FUNCTION mcalc_max RETURNS REAL SONAME "mcalc.so";
+** CREATE AGGREGATE FUNCTION mcalc_profile RETURNS STRING SONAME "mcalc.so";
+** CREATE AGGREGATE FUNCTION mcalc_profile_json RETURNS STRING SONAME "mcalc.so";
+**
 ** After this the functions will work exactly like native MySQL functions.
 ** Functions should be created only once.
 **
 ** The functions can be deleted by:
 **
 ** DROP FUNCTION mcalc;
+** DROP FUNCTION mcalc_memo;
+** DROP FUNCTION mcalc_multi;
+** DROP FUNCTION mcalc_compile_blob;
+** DROP FUNCTION mcalc_eval_blob;
+** DROP FUNCTION mcalc_fixed;
+** DROP FUNCTION mcalc_define;
+** DROP FUNCTION mcalc_undefine;
+** DROP FUNCTION mcalc_cache_size;
+** DROP FUNCTION mcalc_stats;
+** DROP FUNCTION mcalc_stats_reset;
+** DROP FUNCTION mcalc_sum;
+** DROP FUNCTION mcalc_avg;
+** DROP FUNCTION mcalc_min;
+** DROP FUNCTION mcalc_max;
+** DROP FUNCTION mcalc_profile;
+** DROP FUNCTION mcalc_profile_json;
 */
 
 #include <assert.h>
 #include <ctype.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -48,6 +89,10 @@
 
 // Evaluation, Math Calc
 #include "evaluation.h"
+#include "cache.h"
+#include "definitions.h"
+#include "mcalc_fixed.h"
+#include "stats.h"
 
 // For MySQL
 #include "mysql.h"
@@ -61,24 +106,937 @@
 	#pragma comment(lib, "ws2_32")
 #endif
 
-extern "C" bool mcalc_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
-	if(args->arg_count != 1 || args->arg_type[0] != STRING_RESULT) {
-		strcpy(message, "Wrong arguments to mcalc!");
-		return 1;
+// A constant formula is compiled to native code after this many rows, 0 never does.
+#ifndef MCALC_JIT_ROWS
+	#define MCALC_JIT_ROWS 4096
+#endif
+
+// mcalc_memo() keeps 2^MCALC_MEMO_BITS results per statement.
+#ifndef MCALC_MEMO_BITS
+	#define MCALC_MEMO_BITS 12
+#endif
+
+// Whether it pays off is checked every this many rows.
+#define MCALC_MEMO_WINDOW 4096
+
+// Results of a pure formula, direct-mapped by the exact bit patterns of the row inputs.
+struct mcalc_memo {
+	std::vector<uint64_t> keys; // The row inputs of each entry.
+	std::vector<uint64_t> row; // The current row's inputs.
+	std::vector<double> results;
+	std::vector<unsigned> stamps; // An entry is valid while its stamp is `stamp`.
+	unsigned stamp;
+	unsigned lookups, hits; // In the current window.
+	unsigned long long started, evaluating; // When the window started, ns spent on misses.
+
+	explicit mcalc_memo(size_t width) : keys(width << MCALC_MEMO_BITS), row(width), results(1 << MCALC_MEMO_BITS),
+		stamps(1 << MCALC_MEMO_BITS), stamp(1), lookups(0), hits(0), started(0), evaluating(0) {}
+
+	// Forgets every result, when the formula changes.
+	void clear() {
+		if (++stamp == 0) {
+			std::fill(stamps.begin(), stamps.end(), 0);
+			stamp = 1;
+		}
 	}
-	return 0;
+};
+
+// Per-statement state, kept in initid->ptr between mcalc_init and mcalc_deinit.
+struct mcalc_udf {
+	const mcalc_program *program; // Program of the constant formula, or of the previous row's formula.
+	bool constant; // The formula is the same for the whole statement.
+	std::string text; // Formula of the previous row, when it comes from a column.
+	mcalc_cached_program cached; // Its program when shared through the process-wide cache.
+	mcalc_arena arena; // Holds formulas compiled for this statement only, reused from row to row.
+	std::vector<std::string> names; // Variable names of the trailing arguments.
+	std::vector<mcalc_variable> variables; // The variables by name, hashed into `scope`.
+	mcalc_scope *scope; // Built once, reused by every compile of the statement.
+	std::vector<double> values; // Bound to the variables, the row inputs are rewritten on every row.
+	std::vector<unsigned int> inputs; // Arguments that are not constant for the statement.
+	unsigned long long rows; // Rows evaluated with the constant formula so far.
+	mcalc_jit *jit; // Native code of the constant formula once it is hot.
+	mcalc_memo *memo; // Results already computed, for mcalc_memo() while it pays off.
+	bool multi; // mcalc_multi(): ';' separates formulas sharing one program.
+	std::vector<double> results; // Where that program stores the value of each formula.
+	std::string json; // The row's results as returned by mcalc_multi().
+};
+
+// ::tolower is undefined for negative chars, such as the bytes of UTF-8 names.
+static char lower(char c) {
+	return (char)::tolower((unsigned char)c);
 }
 
-extern "C" void mcalc_deinit(UDF_INIT *) {}
+static bool is_identifier(const std::string &name) {
+	if (name.empty() || name[0] < 'a' || name[0] > 'z') return false;
+	for (size_t i = 1; i < name.size(); i++) {
+		const char c = name[i];
+		if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_')) return false;
+	}
+	return true;
+}
 
-extern "C" double mcalc(UDF_INIT *, UDF_ARGS *args, char *result, unsigned long *length, unsigned char *is_null, unsigned char *) {
+// Reads an argument that is constant for the whole statement, before its type is forced to REAL.
+static bool constant_argument(const UDF_ARGS *args, unsigned int i, double *value) {
+	const char *arg = args->args[i];
+	if (!arg) return false; // Changes from row to row, or a constant NULL left to the rows.
+	switch (args->arg_type[i]) {
+	case REAL_RESULT:
+		*value = *(const double *)arg;
+		return true;
+	case INT_RESULT:
+		*value = (double)*(const long long *)arg;
+		return true;
+	case STRING_RESULT:
+	case DECIMAL_RESULT:
+		*value = strtod(std::string(arg, args->lengths[i]).c_str(), 0);
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Binds a constant argument as a pure function, so the optimizer folds every subtree using only constants.
+static double constant_value(void *value) {
+	return *(const double *)value;
+}
+
+// Declares the arguments after the formula as variables and asks the server to pass them as doubles.
+static void bind_arguments(mcalc_udf *udf, UDF_ARGS *args) {
+	const unsigned int count = args->arg_count - 1;
+	std::vector<unsigned int> owner;
+	std::vector<bool> constant(count);
+	udf->values.assign(count, 0.0);
+	for (unsigned int i = 0; i < count; i++) {
+		constant[i] = constant_argument(args, i + 1, &udf->values[i]);
+		if (!constant[i]) udf->inputs.push_back(i);
+		args->arg_type[i + 1] = REAL_RESULT;
+		std::string alias;
+		if (args->attributes && args->attributes[i + 1]) {
+			alias.assign(args->attributes[i + 1], args->attribute_lengths[i + 1]);
+			std::transform(alias.begin(), alias.end(), alias.begin(), lower);
+		}
+		// Aliases come first so they win over a later argument's positional name.
+		if (is_identifier(alias)) {
+			udf->names.push_back(alias);
+			owner.push_back(i);
+		}
+		udf->names.push_back("$" + std::to_string(i + 1));
+		owner.push_back(i);
+	}
+	for (size_t n = 0; n < udf->names.size(); n++) {
+		double *value = &udf->values[owner[n]];
+		if (constant[owner[n]]) {
+			mcalc_variable var = {udf->names[n].c_str(), (const void *)constant_value, MCALC_CLOSURE0 | MCALC_FLAG_PURE, value};
+			udf->variables.push_back(var);
+		} else {
+			mcalc_variable var = {udf->names[n].c_str(), value, MCALC_VARIABLE, 0};
+			udf->variables.push_back(var);
+		}
+	}
+	if (count) udf->scope = mcalc_scope_create(udf->variables.data(), (int)udf->variables.size());
+}
+
+// Copies the current row's arguments into the bound variables, false if one of them is NULL.
+static bool load_arguments(mcalc_udf *udf, const UDF_ARGS *args) {
+	for (size_t n = 0; n < udf->inputs.size(); n++) {
+		const unsigned int i = udf->inputs[n];
+		const char *value = args->args[i + 1];
+		if (!value) return false;
+		udf->values[i] = *(const double *)value;
+	}
+	return true;
+}
+
+// Compiles into the statement's arena, replacing the formula compiled there before.
+static const mcalc_program *compile_formula(mcalc_udf *udf, const char *text, size_t size, int *error) {
+	mcalc_arena_reset(&udf->arena);
+	mcalc_definitions_reader definitions;
+	mcalc_options options = {};
+	options.arena = &udf->arena;
+	options.scope = udf->scope;
+	definitions.bind(&options);
+	if (!udf->multi) return mcalc_assemble_arena(&udf->arena, mcalc_compile_ex(text, size, 0, 0, &options, error));
+	// Resizing only ever shrinks `results` once compiled, so the program's pointers into it stay valid.
+	int count = (int)std::count(text, text + size, ';') + 1;
+	udf->results.assign(count, 0.0);
+	mcalc_expr *n = mcalc_compile_multi(text, size, 0, 0, &options, udf->results.data(), &count, error);
+	if (n) udf->results.resize(count);
+	return mcalc_assemble_arena(&udf->arena, n);
+}
+
+// Returns the compiled formula of the current row, 0 if it is NULL or does not parse.
+static const mcalc_program *row_formula(mcalc_udf *udf, const UDF_ARGS *args) {
+	if (udf->constant) return udf->program;
 	const char *input = args->args[0];
 	if (!input) {
 		assert(args->lengths[0] == 0);
+		return 0;
+	}
+	// Consecutive rows often carry the same formula, skip the lookup then.
+	const size_t size = args->lengths[0];
+	if (!udf->program || udf->text.size() != size || memcmp(udf->text.data(), input, size) != 0) {
+		udf->text.assign(input, size);
+		if (udf->variables.empty() && !udf->multi) {
+			udf->cached = mcalc_cache_get(udf->text, 0);
+			udf->program = udf->cached.get();
+		} else {
+			// Programs bound to this statement's variables can't be shared with other threads.
+			udf->program = compile_formula(udf, input, size, 0);
+		}
+		if (udf->memo) udf->memo->clear();
+	}
+	return udf->program;
+}
+
+static void close_formula(mcalc_udf *udf) {
+	// The statement's last rows, counted by this thread since the previous batch.
+	mcalc_stats_flush();
+	delete udf->memo;
+	mcalc_jit_free(udf->jit);
+	mcalc_scope_free(udf->scope);
+	mcalc_arena_release(&udf->arena);
+}
+
+// Binds the arguments and compiles a constant formula, true with `message` set on error.
+static bool open_formula(mcalc_udf *udf, UDF_ARGS *args, const char *name, char *message) {
+	if(args->arg_count < 1 || args->arg_type[0] != STRING_RESULT) {
+		snprintf(message, MYSQL_ERRMSG_SIZE, "Wrong arguments to %s!", name);
+		return 1;
+	}
+	mcalc_arena_init(&udf->arena, 0, 0);
+	bind_arguments(udf, args);
+	if (args->args[0]) {
+		// A constant formula, compiled straight from the server's (not NUL-terminated) buffer.
+		int error;
+		udf->program = compile_formula(udf, args->args[0], args->lengths[0], &error);
+		if (!udf->program) {
+			if (error > 0) {
+				snprintf(message, MYSQL_ERRMSG_SIZE, "Syntax error in %s expression at position %d!", name, error);
+			} else if (error == MCALC_TOO_DEEP) {
+				snprintf(message, MYSQL_ERRMSG_SIZE, "%s expression is nested too deeply (see MCALC_MAX_DEPTH)!", name);
+			} else {
+				// Out of memory compiling or assembling it.
+				snprintf(message, MYSQL_ERRMSG_SIZE, "Couldn't allocate memory for %s!", name);
+			}
+			close_formula(udf);
+			return 1;
+		}
+		udf->constant = true;
+	}
+	return 0;
+}
+
+// Runs the formula on the loaded row, compiling a constant one to native code once it is hot.
+static double compute(mcalc_udf *udf, const mcalc_program *p) {
+	if (udf->jit) return mcalc_jit_call(udf->jit);
+	const double value = mcalc_run(p);
+	if (MCALC_JIT_ROWS && udf->constant && ++udf->rows == MCALC_JIT_ROWS) {
+		udf->jit = mcalc_jit_compile(p);
+	}
+	return value;
+}
+
+// compute() through the memo, which is dropped once a window of rows took longer than
+// evaluating all of them would have, going by the time taken by the misses.
+static double remember(mcalc_udf *udf, const mcalc_program *p) {
+	mcalc_memo *memo = udf->memo;
+	const size_t width = udf->inputs.size();
+	uint64_t *row = memo->row.data();
+	uint64_t hash = 0;
+	for (size_t i = 0; i < width; i++) {
+		memcpy(&row[i], &udf->values[udf->inputs[i]], sizeof(row[i]));
+		// Small integers and powers of two only differ in a few high bits, fold them down first.
+		hash = (hash ^ row[i] ^ (row[i] >> 29)) * 0x9E3779B97F4A7C15ull;
+		hash ^= hash >> 32;
+	}
+	const size_t slot = (size_t)(hash >> (64 - MCALC_MEMO_BITS));
+	uint64_t *key = memo->keys.data() + slot * width;
+	double value;
+	if (!memo->lookups++) memo->started = mcalc_stats_clock();
+	if (memo->stamps[slot] == memo->stamp && std::equal(row, row + width, key)) {
+		memo->hits++;
+		value = memo->results[slot];
+	} else {
+		const unsigned long long start = mcalc_stats_clock();
+		value = compute(udf, p);
+		memo->evaluating += mcalc_stats_clock() - start;
+		std::copy(row, row + width, key);
+		memo->results[slot] = value;
+		memo->stamps[slot] = memo->stamp;
+	}
+	if (memo->lookups == MCALC_MEMO_WINDOW) {
+		const unsigned misses = memo->lookups - memo->hits;
+		const unsigned long long spent = mcalc_stats_clock() - memo->started;
+		if (MCALC_STATS_ON()) {
+			mcalc_stats_count(MCALC_STAT_MEMO_HITS, memo->hits);
+			mcalc_stats_count(MCALC_STAT_MEMO_MISSES, misses);
+		}
+		if (misses && spent >= memo->evaluating / misses * memo->lookups) {
+			delete memo;
+			udf->memo = 0;
+		} else {
+			memo->lookups = memo->hits = 0;
+			memo->evaluating = 0;
+		}
+	}
+	return value;
+}
+
+// Evaluates the formula on the current row, false if the result is NULL.
+static bool run_row(mcalc_udf *udf, const UDF_ARGS *args, double *value) {
+	const mcalc_program *p = row_formula(udf, args);
+	if (!p || !load_arguments(udf, args)) return false;
+	// Impure formulas may return something else for the same inputs.
+	*value = udf->memo && mcalc_program_pure(p) ? remember(udf, p) : compute(udf, p);
+	return true;
+}
+
+// run_row, counted when the statistics are on and timed on one row out of MCALC_STATS_SAMPLE.
+static bool eval_row(mcalc_udf *udf, const UDF_ARGS *args, double *value) {
+	if (!MCALC_STATS_ON()) return run_row(udf, args, value);
+	if (!mcalc_stats_row()) return run_row(udf, args, value);
+	const unsigned long long start = mcalc_stats_clock();
+	const bool ok = run_row(udf, args, value);
+	mcalc_stats_time(MCALC_PHASE_EVAL, start);
+	return ok;
+}
+
+static bool udf_init(UDF_INIT *initid, UDF_ARGS *args, char *message, const char *name, bool memo, bool multi = false) {
+	mcalc_udf *udf = new (std::nothrow) mcalc_udf();
+	if (!udf) {
+		snprintf(message, MYSQL_ERRMSG_SIZE, "Couldn't allocate memory for %s!", name);
+		return 1;
+	}
+	udf->multi = multi;
+	if (open_formula(udf, args, name, message)) {
+		delete udf;
+		return 1;
+	}
+	if (memo) udf->memo = new (std::nothrow) mcalc_memo(udf->inputs.size());
+	initid->maybe_null = 1;
+	initid->ptr = (char *)udf;
+	return 0;
+}
+
+extern "C" bool mcalc_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+	return udf_init(initid, args, message, "mcalc", false);
+}
+
+extern "C" void mcalc_deinit(UDF_INIT *initid) {
+	mcalc_udf *udf = (mcalc_udf *)initid->ptr;
+	if (!udf) return;
+	close_formula(udf);
+	delete udf;
+}
+
+extern "C" double mcalc(UDF_INIT *initid, UDF_ARGS *args, unsigned char *is_null, unsigned char *) {
+	double value;
+	if (!eval_row((mcalc_udf *)initid->ptr, args, &value)) {
+		*is_null = 1;
+		return 0;
+	}
+	return value;
+}
+
+// mcalc() with a per-statement cache of results, for heavy formulas over few distinct inputs.
+extern "C" bool mcalc_memo_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+	return udf_init(initid, args, message, "mcalc_memo", true);
+}
+
+extern "C" void mcalc_memo_deinit(UDF_INIT *initid) {
+	mcalc_deinit(initid);
+}
+
+extern "C" double mcalc_memo(UDF_INIT *initid, UDF_ARGS *args, unsigned char *is_null, unsigned char *error) {
+	return mcalc(initid, args, is_null, error);
+}
+
+// Several formulas separated by ';' over the same arguments, evaluated as one program so that
+// what they have in common is computed once: mcalc_multi('a*b; a*b*c', a, b, c) = '[6,24]'.
+extern "C" bool mcalc_multi_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+	return udf_init(initid, args, message, "mcalc_multi", false, true);
+}
+
+extern "C" void mcalc_multi_deinit(UDF_INIT *initid) {
+	mcalc_deinit(initid);
+}
+
+// The results as a JSON array, null for a NaN or infinite one.
+extern "C" char *mcalc_multi(UDF_INIT *initid, UDF_ARGS *args, char *, unsigned long *length, unsigned char *is_null, unsigned char *) {
+	mcalc_udf *udf = (mcalc_udf *)initid->ptr;
+	double last;
+	if (!eval_row(udf, args, &last)) {
+		*is_null = 1;
+		return 0;
+	}
+	std::string &json = udf->json;
+	json.assign(1, '[');
+	for (size_t i = 0; i < udf->results.size(); i++) {
+		char number[32];
+		const double value = udf->results[i];
+		if (i) json += ',';
+		if (isfinite(value)) {
+			json.append(number, snprintf(number, sizeof(number), "%.17g", value));
+		} else {
+			json += "null";
+		}
+	}
+	json += ']';
+	*length = json.size();
+	return &json[0];
+}
+
+// State of mcalc_compile_blob: the inputs named by the trailing arguments and the last blob.
+struct mcalc_blob_writer {
+	std::vector<std::string> names;
+	std::vector<mcalc_variable> variables;
+	std::vector<double> inputs; // Only the addresses matter, they become the inputs' indexes.
+	mcalc_arena arena;
+	std::string blob;
+	bool constant; // Compiled once by mcalc_compile_blob_init.
+};
+
+// Compiles a formula into `writer->blob`, false if it does not parse or can't be encoded.
+static bool write_blob(mcalc_blob_writer *writer, const char *text, size_t size, int *error) {
+	mcalc_arena_reset(&writer->arena);
+	mcalc_definitions_reader definitions;
+	mcalc_options options = {};
+	options.arena = &writer->arena;
+	definitions.bind(&options);
+	mcalc_expr *n = mcalc_compile_ex(text, size, writer->variables.data(), (int)writer->variables.size(), &options, error);
+	const mcalc_program *p = mcalc_assemble_arena(&writer->arena, n);
+	const int count = (int)writer->inputs.size();
+	const long length = mcalc_blob_write(p, writer->inputs.data(), count, 0, 0);
+	if (length < 0) return false;
+	writer->blob.resize(length);
+	mcalc_blob_write(p, writer->inputs.data(), count, (unsigned char *)&writer->blob[0], length);
+	return true;
+}
+
+// mcalc_compile_blob(formula, 'name', ...): the formula precompiled for mcalc_eval_blob, its
+// variables being the names given (or $1, $2, ...) in the order of mcalc_eval_blob's inputs.
+extern "C" bool mcalc_compile_blob_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+	if (args->arg_count < 1 || args->arg_type[0] != STRING_RESULT) {
+		strcpy(message, "Usage: mcalc_compile_blob(formula, 'name', ...)");
+		return 1;
+	}
+	for (unsigned int i = 1; i < args->arg_count; i++) {
+		if (args->arg_type[i] != STRING_RESULT || !args->args[i]) {
+			strcpy(message, "The variable names of mcalc_compile_blob must be constant strings!");
+			return 1;
+		}
+	}
+	mcalc_blob_writer *writer = new (std::nothrow) mcalc_blob_writer();
+	if (!writer) {
+		strcpy(message, "Couldn't allocate memory for mcalc_compile_blob!");
+		return 1;
+	}
+	const unsigned int count = args->arg_count - 1;
+	writer->inputs.resize(count);
+	for (unsigned int i = 0; i < count; i++) {
+		std::string name(args->args[i + 1], args->lengths[i + 1]);
+		std::transform(name.begin(), name.end(), name.begin(), lower);
+		writer->names.push_back(name);
+		writer->names.push_back("$" + std::to_string(i + 1));
+	}
+	for (size_t n = 0; n < writer->names.size(); n++) {
+		mcalc_variable var = {writer->names[n].c_str(), &writer->inputs[n / 2], MCALC_VARIABLE, 0};
+		writer->variables.push_back(var);
+	}
+	mcalc_arena_init(&writer->arena, 0, 0);
+	if (args->args[0]) {
+		int error = 0;
+		if (!write_blob(writer, args->args[0], args->lengths[0], &error)) {
+			if (error > 0) {
+				snprintf(message, MYSQL_ERRMSG_SIZE, "Syntax error in mcalc_compile_blob expression at position %d!", error);
+			} else if (error == MCALC_TOO_DEEP) {
+				strcpy(message, "mcalc_compile_blob expression is nested too deeply (see MCALC_MAX_DEPTH)!");
+			} else if (error == MCALC_OUT_OF_MEMORY) {
+				strcpy(message, "Couldn't allocate memory for mcalc_compile_blob!");
+			} else {
+				strcpy(message, "mcalc_compile_blob can't encode this formula!");
+			}
+			mcalc_arena_release(&writer->arena);
+			delete writer;
+			return 1;
+		}
+		writer->constant = true;
+	}
+	initid->maybe_null = 1;
+	initid->ptr = (char *)writer;
+	return 0;
+}
+
+extern "C" void mcalc_compile_blob_deinit(UDF_INIT *initid) {
+	mcalc_blob_writer *writer = (mcalc_blob_writer *)initid->ptr;
+	if (!writer) return;
+	mcalc_arena_release(&writer->arena);
+	delete writer;
+}
+
+extern "C" char *mcalc_compile_blob(UDF_INIT *initid, UDF_ARGS *args, char *, unsigned long *length, unsigned char *is_null, unsigned char *) {
+	mcalc_blob_writer *writer = (mcalc_blob_writer *)initid->ptr;
+	if (!args->args[0] || (!writer->constant && !write_blob(writer, args->args[0], args->lengths[0], 0))) {
+		*is_null = 1;
+		return 0;
+	}
+	*length = writer->blob.size();
+	return &writer->blob[0];
+}
+
+// State of mcalc_eval_blob: the blob last checked and the row inputs.
+struct mcalc_blob_reader {
+	std::string checked;
+	bool valid; // Whether `checked` passed mcalc_blob_check.
+	std::vector<double> inputs;
+};
+
+// mcalc_eval_blob(blob, inputs...): a formula from mcalc_compile_blob, NULL if it is NULL or corrupt.
+extern "C" bool mcalc_eval_blob_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+	if (args->arg_count < 1 || args->arg_type[0] != STRING_RESULT) {
+		strcpy(message, "Usage: mcalc_eval_blob(blob, inputs...)");
+		return 1;
+	}
+	mcalc_blob_reader *reader = new (std::nothrow) mcalc_blob_reader();
+	if (!reader) {
+		strcpy(message, "Couldn't allocate memory for mcalc_eval_blob!");
+		return 1;
+	}
+	for (unsigned int i = 1; i < args->arg_count; i++) args->arg_type[i] = REAL_RESULT;
+	reader->inputs.resize(args->arg_count - 1);
+	initid->maybe_null = 1;
+	initid->ptr = (char *)reader;
+	return 0;
+}
+
+extern "C" void mcalc_eval_blob_deinit(UDF_INIT *initid) {
+	delete (mcalc_blob_reader *)initid->ptr;
+}
+
+extern "C" double mcalc_eval_blob(UDF_INIT *initid, UDF_ARGS *args, unsigned char *is_null, unsigned char *) {
+	mcalc_blob_reader *reader = (mcalc_blob_reader *)initid->ptr;
+	const unsigned char *blob = (const unsigned char *)args->args[0];
+	const size_t size = args->lengths[0];
+	if (!blob) {
+		*is_null = 1;
+		return 0;
+	}
+	// Rows usually share a few blobs, only check one that differs from the previous row's.
+	if (reader->checked.size() != size || memcmp(reader->checked.data(), blob, size) != 0) {
+		reader->checked.assign((const char *)blob, size);
+		reader->valid = mcalc_blob_check(blob, size, (int)reader->inputs.size()) == 0;
+	}
+	if (!reader->valid) {
 		*is_null = 1;
 		return 0;
 	}
-	// double r=(double) strlen(input);
-	double r = te_interp(input, 0);
-	return r;
+	for (size_t i = 0; i < reader->inputs.size(); i++) {
+		const char *value = args->args[i + 1];
+		if (!value) {
+			*is_null = 1;
+			return 0;
+		}
+		reader->inputs[i] = *(const double *)value;
+	}
+	// Straight from the server's buffer, which needs no alignment.
+	return mcalc_blob_eval(blob, size, reader->inputs.data());
+}
+
+// State of mcalc_fixed: the native formula and its row inputs.
+struct mcalc_fixed_call {
+	mcalc_fixed_function function;
+	std::vector<double> inputs;
+};
+
+// mcalc_fixed('name', inputs...): a formula compiled into the library with MCALC_FIXED (mcalc_fixed.h).
+extern "C" bool mcalc_fixed_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+	if (args->arg_count < 1 || args->arg_type[0] != STRING_RESULT || !args->args[0]) {
+		strcpy(message, "Usage: mcalc_fixed('name', inputs...)");
+		return 1;
+	}
+	const std::string name(args->args[0], args->lengths[0]);
+	const mcalc_fixed_entry *entry = mcalc_fixed_find(name);
+	if (!entry) {
+		snprintf(message, MYSQL_ERRMSG_SIZE, "No fixed formula named '%s'!", name.c_str());
+		return 1;
+	}
+	if ((int)args->arg_count - 1 != entry->arity) {
+		snprintf(message, MYSQL_ERRMSG_SIZE, "The fixed formula '%s' takes %d inputs!", name.c_str(), entry->arity);
+		return 1;
+	}
+	mcalc_fixed_call *call = new (std::nothrow) mcalc_fixed_call();
+	if (!call) {
+		strcpy(message, "Couldn't allocate memory for mcalc_fixed!");
+		return 1;
+	}
+	call->function = entry->function;
+	call->inputs.resize(entry->arity);
+	for (unsigned int i = 1; i < args->arg_count; i++) args->arg_type[i] = REAL_RESULT;
+	initid->maybe_null = 1;
+	initid->ptr = (char *)call;
+	return 0;
+}
+
+extern "C" void mcalc_fixed_deinit(UDF_INIT *initid) {
+	delete (mcalc_fixed_call *)initid->ptr;
+}
+
+extern "C" double mcalc_fixed(UDF_INIT *initid, UDF_ARGS *args, unsigned char *is_null, unsigned char *) {
+	mcalc_fixed_call *call = (mcalc_fixed_call *)initid->ptr;
+	for (size_t i = 0; i < call->inputs.size(); i++) {
+		const char *value = args->args[i + 1];
+		if (!value) {
+			*is_null = 1;
+			return 0;
+		}
+		call->inputs[i] = *(const double *)value;
+	}
+	return call->function(call->inputs.data());
+}
+
+// State of the aggregate functions: the formula plus the accumulators of the current group.
+struct mcalc_group : mcalc_udf {
+	enum kind {SUM, AVG, MIN, MAX} what;
+	unsigned long long count; // Rows with a non-NULL result.
+	double sum, compensation; // Neumaier summation: the exact sum is sum + compensation.
+	double min, max;
+
+	void clear() {
+		count = 0;
+		sum = compensation = 0;
+		min = max = 0;
+	}
+
+	void add(double value) {
+		if (!count) {
+			min = max = value;
+		} else {
+			if (value < min) min = value;
+			if (value > max) max = value;
+		}
+		count++;
+		const double t = sum + value;
+		if (fabs(sum) >= fabs(value)) {
+			compensation += (sum - t) + value;
+		} else {
+			compensation += (value - t) + sum;
+		}
+		sum = t;
+	}
+
+	double result() const {
+		switch (what) {
+			case SUM: return sum + compensation;
+			case AVG: return (sum + compensation) / count;
+			case MIN: return min;
+			case MAX: return max;
+		}
+		return 0;
+	}
+};
+
+static bool group_init(UDF_INIT *initid, UDF_ARGS *args, char *message, mcalc_group::kind what, const char *name) {
+	mcalc_group *group = new (std::nothrow) mcalc_group();
+	if (!group) {
+		snprintf(message, MYSQL_ERRMSG_SIZE, "Couldn't allocate memory for %s!", name);
+		return 1;
+	}
+	if (open_formula(group, args, name, message)) {
+		delete group;
+		return 1;
+	}
+	group->what = what;
+	group->clear();
+	initid->maybe_null = 1;
+	initid->ptr = (char *)group;
+	return 0;
+}
+
+static void group_deinit(UDF_INIT *initid) {
+	mcalc_group *group = (mcalc_group *)initid->ptr;
+	if (!group) return;
+	close_formula(group);
+	delete group;
+}
+
+static void group_add(UDF_INIT *initid, UDF_ARGS *args) {
+	mcalc_group *group = (mcalc_group *)initid->ptr;
+	double value;
+	// Like SUM(), rows where the formula is NULL are skipped.
+	if (eval_row(group, args, &value)) group->add(value);
+}
+
+static double group_result(UDF_INIT *initid, unsigned char *is_null) {
+	const mcalc_group *group = (const mcalc_group *)initid->ptr;
+	if (!group->count) {
+		*is_null = 1;
+		return 0;
+	}
+	return group->result();
+}
+
+// The aggregate UDF entry points of one accumulator kind.
+#define MCALC_AGGREGATE(NAME, KIND) \
+	extern "C" bool NAME##_init(UDF_INIT *initid, UDF_ARGS *args, char *message) { \
+		return group_init(initid, args, message, mcalc_group::KIND, #NAME); \
+	} \
+	extern "C" void NAME##_deinit(UDF_INIT *initid) { \
+		group_deinit(initid); \
+	} \
+	extern "C" void NAME##_clear(UDF_INIT *initid, unsigned char *, unsigned char *) { \
+		((mcalc_group *)initid->ptr)->clear(); \
+	} \
+	extern "C" void NAME##_add(UDF_INIT *initid, UDF_ARGS *args, unsigned char *, unsigned char *) { \
+		group_add(initid, args); \
+	} \
+	extern "C" void NAME##_reset(UDF_INIT *initid, UDF_ARGS *args, unsigned char *, unsigned char *) { \
+		((mcalc_group *)initid->ptr)->clear(); \
+		group_add(initid, args); \
+	} \
+	extern "C" double NAME(UDF_INIT *initid, UDF_ARGS *, unsigned char *is_null, unsigned char *) { \
+		return group_result(initid, is_null); \
+	}
+
+MCALC_AGGREGATE(mcalc_sum, SUM)
+MCALC_AGGREGATE(mcalc_avg, AVG)
+MCALC_AGGREGATE(mcalc_min, MIN)
+MCALC_AGGREGATE(mcalc_max, MAX)
+
+#undef MCALC_AGGREGATE
+
+// mcalc_profile() and mcalc_profile_json(): the formula's tree annotated with where the time of the group went.
+struct mcalc_profiled : mcalc_udf {
+	mcalc_profiler *profile;
+	unsigned long long count; // Rows evaluated in the group.
+	bool json;
+	std::string report;
+};
+
+static bool profile_init(UDF_INIT *initid, UDF_ARGS *args, char *message, bool json, const char *name) {
+	if (args->arg_count < 1 || args->arg_type[0] != STRING_RESULT || !args->args[0]) {
+		snprintf(message, MYSQL_ERRMSG_SIZE, "%s takes a constant formula!", name);
+		return 1;
+	}
+	mcalc_profiled *profiled = new (std::nothrow) mcalc_profiled();
+	if (!profiled) {
+		snprintf(message, MYSQL_ERRMSG_SIZE, "Couldn't allocate memory for %s!", name);
+		return 1;
+	}
+	mcalc_arena_init(&profiled->arena, 0, 0);
+	bind_arguments(profiled, args);
+	// The tree itself is profiled, not the program the other functions run.
+	mcalc_definitions_reader definitions;
+	mcalc_options options = {};
+	options.arena = &profiled->arena;
+	options.scope = profiled->scope;
+	definitions.bind(&options);
+	int error;
+	const mcalc_expr *n = mcalc_compile_ex(args->args[0], args->lengths[0], 0, 0, &options, &error);
+	if (!n && error == MCALC_OUT_OF_MEMORY) {
+		snprintf(message, MYSQL_ERRMSG_SIZE, "Couldn't allocate memory for %s!", name);
+	} else if (!n && error == MCALC_TOO_DEEP) {
+		snprintf(message, MYSQL_ERRMSG_SIZE, "%s expression is nested too deeply (see MCALC_MAX_DEPTH)!", name);
+	} else if (!n) {
+		snprintf(message, MYSQL_ERRMSG_SIZE, "Syntax error in %s expression at position %d!", name, error);
+	} else if (!(profiled->profile = mcalc_profiler_create(n, profiled->variables.data(), (int)profiled->variables.size(), 1))) {
+		snprintf(message, MYSQL_ERRMSG_SIZE, "%s expression is too large!", name);
+	}
+	if (!profiled->profile) {
+		close_formula(profiled);
+		delete profiled;
+		return 1;
+	}
+	profiled->constant = true;
+	profiled->json = json;
+	initid->maybe_null = 1;
+	initid->ptr = (char *)profiled;
+	return 0;
+}
+
+static void profile_deinit(UDF_INIT *initid) {
+	mcalc_profiled *profiled = (mcalc_profiled *)initid->ptr;
+	if (!profiled) return;
+	mcalc_profiler_free(profiled->profile);
+	close_formula(profiled);
+	delete profiled;
+}
+
+static void profile_clear(UDF_INIT *initid) {
+	mcalc_profiled *profiled = (mcalc_profiled *)initid->ptr;
+	mcalc_profiler_reset(profiled->profile);
+	profiled->count = 0;
+}
+
+static void profile_add(UDF_INIT *initid, UDF_ARGS *args) {
+	mcalc_profiled *profiled = (mcalc_profiled *)initid->ptr;
+	// Rows where an argument is NULL are skipped, as mcalc() would return NULL for them.
+	if (!load_arguments(profiled, args)) return;
+	mcalc_profiler_eval(profiled->profile);
+	profiled->count++;
+}
+
+static char *profile_result(UDF_INIT *initid, unsigned long *length, unsigned char *is_null) {
+	mcalc_profiled *profiled = (mcalc_profiled *)initid->ptr;
+	if (!profiled->count) {
+		*is_null = 1;
+		return 0;
+	}
+	std::string &report = profiled->report;
+	report.resize(mcalc_profiler_report(profiled->profile, profiled->json, 0, 0) + 1);
+	report.resize(mcalc_profiler_report(profiled->profile, profiled->json, &report[0], report.size()));
+	*length = report.size();
+	return &report[0];
+}
+
+#define MCALC_PROFILE(NAME, JSON) \
+	extern "C" bool NAME##_init(UDF_INIT *initid, UDF_ARGS *args, char *message) { \
+		return profile_init(initid, args, message, JSON, #NAME); \
+	} \
+	extern "C" void NAME##_deinit(UDF_INIT *initid) { \
+		profile_deinit(initid); \
+	} \
+	extern "C" void NAME##_clear(UDF_INIT *initid, unsigned char *, unsigned char *) { \
+		profile_clear(initid); \
+	} \
+	extern "C" void NAME##_add(UDF_INIT *initid, UDF_ARGS *args, unsigned char *, unsigned char *) { \
+		profile_add(initid, args); \
+	} \
+	extern "C" void NAME##_reset(UDF_INIT *initid, UDF_ARGS *args, unsigned char *, unsigned char *) { \
+		profile_clear(initid); \
+		profile_add(initid, args); \
+	} \
+	extern "C" char *NAME(UDF_INIT *initid, UDF_ARGS *, char *, unsigned long *length, unsigned char *is_null, unsigned char *) { \
+		return profile_result(initid, length, is_null); \
+	}
+
+MCALC_PROFILE(mcalc_profile, false)
+MCALC_PROFILE(mcalc_profile_json, true)
+
+#undef MCALC_PROFILE
+
+// mcalc_define('margin(p, c) = (p - c)/p') lets the formulas compiled from then on, by any
+// connection, call margin(price, cost); they get a copy of the body, optimized with the rest.
+extern "C" bool mcalc_define_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+	if (args->arg_count != 1 || args->arg_type[0] != STRING_RESULT) {
+		strcpy(message, "Usage: mcalc_define('name(a, b, ...) = formula')");
+		return 1;
+	}
+	if (args->args[0]) {
+		// A constant definition is checked here, for a readable error.
+		mcalc_definitions_reader definitions;
+		mcalc_options options = {};
+		definitions.bind(&options);
+		int error;
+		mcalc_definition *d = mcalc_definition_create(args->args[0], args->lengths[0], &options, &error);
+		if (!d && error == MCALC_OUT_OF_MEMORY) {
+			strcpy(message, "Couldn't allocate memory for mcalc_define!");
+			return 1;
+		}
+		if (!d && error == MCALC_TOO_DEEP) {
+			strcpy(message, "mcalc_define body is nested too deeply (see MCALC_MAX_DEPTH)!");
+			return 1;
+		}
+		if (!d) {
+			snprintf(message, MYSQL_ERRMSG_SIZE, "Syntax error in mcalc_define at position %d!", error);
+			return 1;
+		}
+		mcalc_definition_free(d);
+	}
+	initid->maybe_null = 1;
+	return 0;
+}
+
+// 1 once defined, NULL for a definition that does not parse.
+extern "C" long long mcalc_define(UDF_INIT *, UDF_ARGS *args, unsigned char *is_null, unsigned char *) {
+	if (!args->args[0] || !mcalc_definitions_define(std::string(args->args[0], args->lengths[0]), 0)) {
+		*is_null = 1;
+		return 0;
+	}
+	// Cached programs may hold the previous body.
+	mcalc_cache_clear();
+	return 1;
+}
+
+extern "C" bool mcalc_undefine_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+	if (args->arg_count != 1 || args->arg_type[0] != STRING_RESULT) {
+		strcpy(message, "Usage: mcalc_undefine('name')");
+		return 1;
+	}
+	initid->maybe_null = 0;
+	return 0;
+}
+
+// 1 if the function was defined, 0 otherwise.
+extern "C" long long mcalc_undefine(UDF_INIT *, UDF_ARGS *args, unsigned char *, unsigned char *) {
+	if (!args->args[0] || !mcalc_definitions_remove(std::string(args->args[0], args->lengths[0]))) return 0;
+	mcalc_cache_clear();
+	return 1;
+}
+
+extern "C" bool mcalc_cache_size_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+	if (args->arg_count > 1 || (args->arg_count == 1 && args->arg_type[0] != INT_RESULT)) {
+		strcpy(message, "Usage: mcalc_cache_size([capacity])");
+		return 1;
+	}
+	initid->maybe_null = 0;
+	return 0;
+}
+
+extern "C" long long mcalc_cache_size(UDF_INIT *, UDF_ARGS *args, unsigned char *, unsigned char *) {
+	if (args->arg_count == 1 && args->args[0]) {
+		const long long capacity = *(long long *)args->args[0];
+		mcalc_cache_set_capacity(capacity > 0 ? (size_t)capacity : 0);
+	}
+	return (long long)mcalc_cache_capacity();
+}
+
+extern "C" bool mcalc_stats_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+	if (args->arg_count > 1 || (args->arg_count == 1 && args->arg_type[0] != INT_RESULT)) {
+		strcpy(message, "Usage: mcalc_stats([enable])");
+		return 1;
+	}
+	std::string *json = new (std::nothrow) std::string();
+	if (!json) {
+		strcpy(message, "Couldn't allocate memory for mcalc_stats!");
+		return 1;
+	}
+	initid->maybe_null = 0;
+	initid->const_item = 0;
+	initid->ptr = (char *)json;
+	return 0;
+}
+
+extern "C" void mcalc_stats_deinit(UDF_INIT *initid) {
+	delete (std::string *)initid->ptr;
+}
+
+// The statistics as JSON; mcalc_stats(1) / mcalc_stats(0) switches them on or off first.
+extern "C" char *mcalc_stats(UDF_INIT *initid, UDF_ARGS *args, char *, unsigned long *length, unsigned char *, unsigned char *) {
+	if (args->arg_count == 1 && args->args[0]) {
+		mcalc_stats_enable(*(long long *)args->args[0] != 0);
+	}
+	std::string &json = *(std::string *)initid->ptr;
+	json.resize(1024);
+	size_t size = mcalc_stats_json(&json[0], json.size());
+	if (size >= json.size()) {
+		json.resize(size + 1);
+		size = mcalc_stats_json(&json[0], json.size());
+	}
+	json.resize(size);
+	*length = size;
+	return &json[0];
+}
+
+extern "C" bool mcalc_stats_reset_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
+	if (args->arg_count) {
+		strcpy(message, "Usage: mcalc_stats_reset()");
+		return 1;
+	}
+	initid->maybe_null = 0;
+	return 0;
+}
+
+extern "C" long long mcalc_stats_reset(UDF_INIT *, UDF_ARGS *, unsigned char *, unsigned char *) {
+	mcalc_stats_clear();
+	return 0;
 }
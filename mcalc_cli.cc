@@ -0,0 +1,475 @@
+/*
+** Evaluates a formula over every row of a CSV file or of raw doubles, outside
+** the server, on all cores.
+**
+** gcc -O2 -c evaluation.c batch.c jit.c stats.c vmath.c blob.c
+** g++ -O2 -std=c++11 -o mcalc_cli mcalc_cli.cc evaluation.o batch.o jit.o stats.o vmath.o blob.o -lm -lpthread
+** ./mcalc_cli [-t threads] [-s chunk bytes] [-b x,y,z] formula [file] > results
+**
+** CSV input starts with a header naming the columns, which are the variables
+** of the formula (also $1, $2, ... by position); the output has one result per
+** line. With -b the input is rows of little-endian doubles, one per name given,
+** and the output is one little-endian double per row.
+**
+** A file is mmap'd, stdin is read as it comes. Either way the input is cut
+** into chunks of whole rows, which a work-stealing pool of threads turns into
+** columns and evaluates with mcalc_run_batch. The results are written in input
+** order, and at most 2 chunks per thread are held at once, so memory stays
+** bounded by the chunk size whatever the input size.
+*/
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "evaluation.h"
+
+// Default chunk size, rounded to whole rows.
+#define CHUNK_BYTES (4 << 20)
+
+// Rows of the input, in the mapped file or in `owned` when read from stdin.
+struct chunk {
+	size_t sequence;
+	const char *data;
+	size_t size;
+	std::vector<char> owned;
+	std::string output;
+};
+
+// The chunks of each worker, taken oldest first by their owner so the output keeps flowing;
+// an idle worker steals the newest chunk of another.
+class pool {
+	struct queue {
+		std::mutex lock;
+		std::deque<chunk *> chunks;
+	};
+	std::vector<queue> queues;
+	size_t next;
+	std::mutex lock;
+	std::condition_variable wake;
+	size_t pending; // Chunks queued and not yet claimed by a worker.
+	bool closed;
+
+public:
+	explicit pool(unsigned workers) : queues(workers), next(0), pending(0), closed(false) {}
+
+	void push(chunk *c) {
+		queue &q = queues[next++ % queues.size()];
+		{
+			std::lock_guard<std::mutex> hold(q.lock);
+			q.chunks.push_back(c);
+		}
+		{
+			std::lock_guard<std::mutex> hold(lock);
+			pending++;
+		}
+		wake.notify_one();
+	}
+
+	void close() {
+		{
+			std::lock_guard<std::mutex> hold(lock);
+			closed = true;
+		}
+		wake.notify_all();
+	}
+
+	// The next chunk for worker `self`, 0 once the pool is closed and empty.
+	chunk *pop(unsigned self) {
+		{
+			std::unique_lock<std::mutex> hold(lock);
+			wake.wait(hold, [this] {return pending > 0 || closed;});
+			if (!pending) return 0;
+			pending--;
+		}
+		// One chunk is ours from now on, it is in one of the queues.
+		for (size_t i = 0; ; i++) {
+			queue &q = queues[(self + i) % queues.size()];
+			std::lock_guard<std::mutex> hold(q.lock);
+			if (q.chunks.empty()) continue;
+			chunk *c;
+			if (i % queues.size() == 0) {
+				c = q.chunks.front();
+				q.chunks.pop_front();
+			} else {
+				c = q.chunks.back();
+				q.chunks.pop_back();
+			}
+			return c;
+		}
+	}
+};
+
+// Writes the evaluated chunks in input order and bounds how many are in memory.
+class sequencer {
+	std::mutex lock;
+	std::condition_variable changed;
+	std::map<size_t, chunk *> done;
+	size_t written, read, limit;
+	bool finished;
+
+public:
+	explicit sequencer(size_t in_flight) : written(0), read(0), limit(in_flight), finished(false) {}
+
+	// Waits for room for one more chunk, returns its sequence number.
+	size_t admit() {
+		std::unique_lock<std::mutex> hold(lock);
+		changed.wait(hold, [this] {return read - written < limit;});
+		return read++;
+	}
+
+	void finish() {
+		std::lock_guard<std::mutex> hold(lock);
+		finished = true;
+		changed.notify_all();
+	}
+
+	void evaluated(chunk *c) {
+		std::lock_guard<std::mutex> hold(lock);
+		done[c->sequence] = c;
+		changed.notify_all();
+	}
+
+	// Runs on its own thread until every admitted chunk is written.
+	bool write(FILE *out) {
+		bool ok = true;
+		for (;;) {
+			chunk *c;
+			{
+				std::unique_lock<std::mutex> hold(lock);
+				changed.wait(hold, [this] {return (!done.empty() && done.begin()->first == written) || (finished && written == read);});
+				if (done.empty() || done.begin()->first != written) return ok;
+				c = done.begin()->second;
+				done.erase(done.begin());
+			}
+			if (fwrite(c->output.data(), 1, c->output.size(), out) != c->output.size()) ok = false;
+			delete c;
+			{
+				std::lock_guard<std::mutex> hold(lock);
+				written++;
+			}
+			changed.notify_all();
+		}
+	}
+};
+
+struct settings {
+	unsigned threads;
+	size_t chunk_bytes;
+	bool binary;
+	std::vector<std::string> names; // Of the columns, from -b or the CSV header.
+};
+
+static const char *trim(const char *begin, const char *end, const char **trimmed) {
+	while (begin != end && (*begin == ' ' || *begin == '\t')) begin++;
+	while (end != begin && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+	if (end - begin >= 2 && *begin == '"' && end[-1] == '"') {
+		begin++;
+		end--;
+	}
+	*trimmed = end;
+	return begin;
+}
+
+static std::vector<std::string> split_names(const char *begin, const char *end) {
+	std::vector<std::string> names;
+	for (;;) {
+		const char *comma = std::find(begin, end, ',');
+		const char *stop;
+		const char *start = trim(begin, comma, &stop);
+		std::string name(start, stop);
+		std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+		names.push_back(name);
+		if (comma == end) return names;
+		begin = comma + 1;
+	}
+}
+
+// A CSV field, NaN when empty or not a number.
+static double parse_field(const char *begin, const char *end) {
+	char buffer[64];
+	const char *stop;
+	begin = trim(begin, end, &stop);
+	const size_t size = stop - begin;
+	if (!size || size >= sizeof(buffer)) return NAN;
+	memcpy(buffer, begin, size);
+	buffer[size] = '\0';
+	char *parsed;
+	const double value = strtod(buffer, &parsed);
+	return parsed == buffer + size ? value : NAN;
+}
+
+static double load_double(const char *p) {
+	unsigned char bytes[8];
+	memcpy(bytes, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	std::reverse(bytes, bytes + 8);
+#endif
+	double value;
+	memcpy(&value, bytes, 8);
+	return value;
+}
+
+static void store_double(std::string &out, double value) {
+	char bytes[8];
+	memcpy(bytes, &value, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	std::reverse(bytes, bytes + 8);
+#endif
+	out.append(bytes, 8);
+}
+
+// Turns chunks into columns and evaluates them, one per thread.
+static void work(pool *chunks, sequencer *order, unsigned self, const settings *s, const mcalc_program *p, const std::vector<mcalc_variable> *variables) {
+	const size_t width = s->names.size();
+	std::vector<std::vector<double>> columns(width);
+	std::vector<const double *> pointers(width);
+	std::vector<double> results;
+	while (chunk *c = chunks->pop(self)) {
+		size_t rows = 0;
+		for (size_t j = 0; j < width; j++) columns[j].clear();
+		if (s->binary) {
+			rows = c->size / (8 * width);
+			for (size_t j = 0; j < width; j++) {
+				columns[j].resize(rows);
+				for (size_t i = 0; i < rows; i++) columns[j][i] = load_double(c->data + 8 * (i * width + j));
+			}
+		} else {
+			const char *line = c->data, *end = c->data + c->size;
+			while (line != end) {
+				const char *stop = std::find(line, end, '\n');
+				const char *last, *first = trim(line, stop, &last);
+				if (first != last) {
+					// Missing fields are NaN, extra ones are ignored.
+					const char *field = line;
+					for (size_t j = 0; j < width; j++) {
+						const char *comma = field ? std::find(field, stop, ',') : stop;
+						columns[j].push_back(field ? parse_field(field, comma) : NAN);
+						field = comma == stop ? 0 : comma + 1;
+					}
+					rows++;
+				}
+				line = stop == end ? end : stop + 1;
+			}
+		}
+		for (size_t j = 0; j < width; j++) pointers[j] = columns[j].data();
+		results.resize(rows);
+		mcalc_run_batch(p, variables->data(), pointers.data(), (int)width, results.data(), rows);
+		c->owned.clear();
+		c->owned.shrink_to_fit();
+		c->output.reserve(rows * (s->binary ? 8 : 24));
+		for (size_t i = 0; i < rows; i++) {
+			if (s->binary) {
+				store_double(c->output, results[i]);
+			} else {
+				char number[32];
+				c->output.append(number, snprintf(number, sizeof(number), "%.17g\n", results[i]));
+			}
+		}
+		order->evaluated(c);
+	}
+}
+
+// Where a chunk of at most `size` bytes starting at `data` must end to hold whole rows.
+static size_t whole_rows(const settings *s, const char *data, size_t size, bool last) {
+	if (s->binary) return size - size % (8 * s->names.size());
+	if (last) return size;
+	const char *newline = (const char *)memrchr(data, '\n', size);
+	return newline ? newline - data + 1 : 0;
+}
+
+static void submit(pool *chunks, sequencer *order, chunk *c) {
+	c->sequence = order->admit();
+	chunks->push(c);
+}
+
+// Cuts a mapped file into chunks that point into it, returns the size of a trailing partial row.
+static size_t produce_mapped(pool *chunks, sequencer *order, const settings *s, const char *data, size_t size) {
+	while (size) {
+		const size_t take = std::min(size, s->chunk_bytes);
+		size_t cut = whole_rows(s, data, take, take == size);
+		if (!cut && !s->binary) {
+			// A line longer than a chunk, up to its end.
+			const char *newline = (const char *)memchr(data + take, '\n', size - take);
+			cut = newline ? newline - data + 1 : size;
+		}
+		if (!cut) break;
+		chunk *c = new chunk();
+		c->data = data;
+		c->size = cut;
+		submit(chunks, order, c);
+		data += cut;
+		size -= cut;
+	}
+	return size;
+}
+
+// Reads stdin into chunks after what `buffer` already holds, carrying a partial row over to
+// the next chunk. Returns the size of a trailing partial row.
+static size_t produce_stream(pool *chunks, sequencer *order, const settings *s, std::vector<char> buffer) {
+	size_t target = s->chunk_bytes;
+	bool eof = false;
+	for (;;) {
+		while (!eof && buffer.size() < target) {
+			const size_t old = buffer.size();
+			buffer.resize(target);
+			const ssize_t got = read(0, buffer.data() + old, target - old);
+			buffer.resize(old + (got > 0 ? got : 0));
+			eof = got <= 0;
+		}
+		const size_t cut = whole_rows(s, buffer.data(), buffer.size(), eof);
+		if (!cut) {
+			if (eof) return buffer.size();
+			// A line longer than a chunk.
+			target = buffer.size() + s->chunk_bytes;
+			continue;
+		}
+		chunk *c = new chunk();
+		c->owned.assign(buffer.begin(), buffer.begin() + cut);
+		buffer.erase(buffer.begin(), buffer.begin() + cut);
+		c->data = c->owned.data();
+		c->size = cut;
+		submit(chunks, order, c);
+		target = s->chunk_bytes;
+	}
+}
+
+static int usage() {
+	fprintf(stderr, "Usage: mcalc_cli [-t threads] [-s chunk bytes] [-b name,name,...] formula [file]\n");
+	return 2;
+}
+
+int main(int argc, char *argv[]) {
+	settings s;
+	s.threads = std::max(1u, std::thread::hardware_concurrency());
+	s.chunk_bytes = CHUNK_BYTES;
+	s.binary = false;
+	int arg = 1;
+	for (; arg < argc && argv[arg][0] == '-' && argv[arg][1]; arg += 2) {
+		const char *value = argv[arg + 1];
+		if (!value) return usage();
+		if (!strcmp(argv[arg], "-t")) {
+			s.threads = (unsigned)std::max(1, atoi(value));
+		} else if (!strcmp(argv[arg], "-s")) {
+			s.chunk_bytes = std::max(1ull, strtoull(value, 0, 10));
+		} else if (!strcmp(argv[arg], "-b")) {
+			s.binary = true;
+			s.names = split_names(value, value + strlen(value));
+		} else {
+			return usage();
+		}
+	}
+	if (arg >= argc || argc - arg > 2) return usage();
+	const char *formula = argv[arg], *path = argv[arg + 1];
+
+	const char *data = 0;
+	size_t size = 0, mapped = 0;
+	std::vector<char> head; // What was read from stdin before the first chunk.
+	if (path) {
+		const int fd = open(path, O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0) {
+			perror(path);
+			return 1;
+		}
+		size = mapped = st.st_size;
+		if (size) {
+			void *map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map == MAP_FAILED) {
+				perror(path);
+				return 1;
+			}
+			madvise(map, size, MADV_SEQUENTIAL);
+			data = (const char *)map;
+		}
+		close(fd);
+	}
+	if (!s.binary) {
+		// The header names the columns.
+		const char *newline;
+		if (path) {
+			newline = (const char *)memchr(data, '\n', size);
+			s.names = split_names(data, newline ? newline : data + size);
+			const size_t skip = newline ? newline - data + 1 : size;
+			data += skip;
+			size -= skip;
+		} else {
+			char buffer[4096];
+			ssize_t got;
+			while ((newline = (const char *)memchr(head.data(), '\n', head.size())) == 0 && (got = read(0, buffer, sizeof(buffer))) > 0) {
+				head.insert(head.end(), buffer, buffer + got);
+			}
+			const char *end = newline ? newline : head.data() + head.size();
+			s.names = split_names(head.data(), end);
+			head.erase(head.begin(), head.begin() + (end - head.data()) + (newline ? 1 : 0));
+		}
+	}
+	const size_t width = s.names.size();
+	s.chunk_bytes = std::max(s.chunk_bytes, 8 * width);
+
+	// Bound to `values` by name and by position; only their addresses matter to mcalc_run_batch.
+	std::vector<double> values(width);
+	std::vector<std::string> positions(width);
+	std::vector<mcalc_variable> variables, columns;
+	for (size_t j = 0; j < width; j++) {
+		positions[j] = "$" + std::to_string(j + 1);
+		mcalc_variable by_name = {s.names[j].c_str(), &values[j], MCALC_VARIABLE, 0};
+		mcalc_variable by_position = {positions[j].c_str(), &values[j], MCALC_VARIABLE, 0};
+		variables.push_back(by_name);
+		variables.push_back(by_position);
+		columns.push_back(by_name);
+	}
+	int error;
+	mcalc_expr *n = mcalc_compile_n(formula, strlen(formula), variables.data(), (int)variables.size(), &error);
+	if (!n) {
+		if (error == MCALC_OUT_OF_MEMORY) {
+			fprintf(stderr, "Out of memory compiling the formula\n");
+		} else if (error == MCALC_TOO_DEEP) {
+			fprintf(stderr, "Formula nested too deeply (set MCALC_MAX_DEPTH to allow more)\n");
+		} else {
+			fprintf(stderr, "Syntax error in formula at position %d\n", error);
+		}
+		return 2;
+	}
+	mcalc_program *p = mcalc_assemble(n);
+	if (!p) {
+		fprintf(stderr, "Out of memory compiling the formula\n");
+		return 2;
+	}
+
+	pool chunks(s.threads);
+	sequencer order(2 * s.threads);
+	bool written = true;
+	std::thread writer([&] {written = order.write(stdout);});
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < s.threads; t++) workers.emplace_back(work, &chunks, &order, t, &s, p, &columns);
+	const size_t left = path ? produce_mapped(&chunks, &order, &s, data, size) : produce_stream(&chunks, &order, &s, head);
+	order.finish();
+	chunks.close();
+	for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+	writer.join();
+
+	if (left) fprintf(stderr, "Ignored %zu bytes of a partial row at the end of the input\n", left);
+	if (mapped) munmap((void *)(data - (mapped - size)), mapped);
+	mcalc_program_free(p);
+	mcalc_free(n);
+	if (!written || fflush(stdout) != 0) {
+		perror("mcalc_cli");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,206 @@
+#ifndef __MCALC_FIXED_H__
+	#define __MCALC_FIXED_H__
+
+	#include <math.h>
+
+	#include <map>
+	#include <string>
+	#include <type_traits>
+
+	#include "evaluation.h"
+
+	// Formulas known when building, compiled by the C++ compiler into inlined code instead of
+	// being parsed and interpreted. They are written with expression templates, with the grammar
+	// and builtins of the parser except for ^ (pow() instead) and if (if_()), and give the same
+	// bits as the parsed formula:
+	//
+	//   MCALC_FIXED(score, 3, _1 * pow(_2, 0.8) + ln(_3 + 1))
+	//
+	// defines `double mcalc_fixed_score(const double *inputs)` and registers it under "score" for
+	// mcalc_fixed('score', a, b, c). Header only, at namespace scope of any file linked into
+	// the UDF.
+
+	namespace mcalc_et {
+		// A node of a formula; only nodes have the operators and builtins below.
+		template <class E> struct formula {
+			E node;
+			// Used by MCALC_FIXED: the formula reads inputs[0 .. inputs - 1].
+			static const int inputs = E::inputs;
+			double operator()(const double *in) const {return node(in);}
+		};
+
+		struct constant {
+			static const int inputs = 0;
+			double value;
+			double operator()(const double *) const {return value;}
+		};
+
+		template <int I> struct input {
+			static const int inputs = I + 1;
+			double operator()(const double *in) const {return in[I];}
+		};
+
+		template <class F, class A> struct unary {
+			static const int inputs = A::inputs;
+			A a;
+			double operator()(const double *in) const {return F::call(a(in));}
+		};
+
+		template <class F, class A, class B> struct binary {
+			static const int inputs = A::inputs > B::inputs ? A::inputs : B::inputs;
+			A a;
+			B b;
+			double operator()(const double *in) const {return F::call(a(in), b(in));}
+		};
+
+		// $1 ... $16 of the parser.
+		static const formula<input<0> > _1 = {{}};
+		static const formula<input<1> > _2 = {{}};
+		static const formula<input<2> > _3 = {{}};
+		static const formula<input<3> > _4 = {{}};
+		static const formula<input<4> > _5 = {{}};
+		static const formula<input<5> > _6 = {{}};
+		static const formula<input<6> > _7 = {{}};
+		static const formula<input<7> > _8 = {{}};
+		static const formula<input<8> > _9 = {{}};
+		static const formula<input<9> > _10 = {{}};
+		static const formula<input<10> > _11 = {{}};
+		static const formula<input<11> > _12 = {{}};
+		static const formula<input<12> > _13 = {{}};
+		static const formula<input<13> > _14 = {{}};
+		static const formula<input<14> > _15 = {{}};
+		static const formula<input<15> > _16 = {{}};
+
+		inline formula<constant> lift(double value) {formula<constant> f = {{value}}; return f;}
+		template <class E> inline const formula<E> &lift(const formula<E> &f) {return f;}
+
+		template <class F, class A> inline formula<unary<F, A> > make(const formula<A> &a) {
+			formula<unary<F, A> > f = {{a.node}};
+			return f;
+		}
+
+		template <class F, class A, class B> inline formula<binary<F, A, B> > make(const formula<A> &a, const formula<B> &b) {
+			formula<binary<F, A, B> > f = {{a.node, b.node}};
+			return f;
+		}
+
+		// Unary builtins and operators.
+		#define MCALC_ET_UNARY(NAME, EXPRESSION) \
+			struct NAME##_fn {static double call(double a) {return EXPRESSION;}}; \
+			template <class A> inline formula<unary<NAME##_fn, A> > NAME(const formula<A> &a) {return make<NAME##_fn>(a);}
+		MCALC_ET_UNARY(abs, ::fabs(a))
+		MCALC_ET_UNARY(acos, ::acos(a))
+		MCALC_ET_UNARY(asin, ::asin(a))
+		MCALC_ET_UNARY(atan, ::atan(a))
+		MCALC_ET_UNARY(ceil, ::ceil(a))
+		MCALC_ET_UNARY(cos, ::cos(a))
+		MCALC_ET_UNARY(cosh, ::cosh(a))
+		MCALC_ET_UNARY(exp, ::exp(a))
+		MCALC_ET_UNARY(fac, mcalc_fac(a))
+		MCALC_ET_UNARY(floor, ::floor(a))
+		MCALC_ET_UNARY(ln, ::log(a))
+	#ifdef MCALC_NAT_LOG
+		MCALC_ET_UNARY(log, ::log(a))
+	#else
+		MCALC_ET_UNARY(log, ::log10(a))
+	#endif
+		MCALC_ET_UNARY(log10, ::log10(a))
+		MCALC_ET_UNARY(sin, ::sin(a))
+		MCALC_ET_UNARY(sinh, ::sinh(a))
+		MCALC_ET_UNARY(sqrt, ::sqrt(a))
+		MCALC_ET_UNARY(tan, ::tan(a))
+		MCALC_ET_UNARY(tanh, ::tanh(a))
+		#undef MCALC_ET_UNARY
+
+		struct negate_fn {static double call(double a) {return -a;}};
+		template <class A> inline formula<unary<negate_fn, A> > operator-(const formula<A> &a) {return make<negate_fn>(a);}
+		template <class A> inline const formula<A> &operator+(const formula<A> &a) {return a;}
+
+		// Binary builtins and operators, with a number on either side.
+		#define MCALC_ET_BINARY(NAME, FUNCTION, EXPRESSION) \
+			struct NAME##_fn {static double call(double a, double b) {return EXPRESSION;}}; \
+			template <class A, class B> inline formula<binary<NAME##_fn, A, B> > FUNCTION(const formula<A> &a, const formula<B> &b) {return make<NAME##_fn>(a, b);} \
+			template <class A> inline formula<binary<NAME##_fn, A, constant> > FUNCTION(const formula<A> &a, double b) {return make<NAME##_fn>(a, lift(b));} \
+			template <class B> inline formula<binary<NAME##_fn, constant, B> > FUNCTION(double a, const formula<B> &b) {return make<NAME##_fn>(lift(a), b);}
+		MCALC_ET_BINARY(add, operator+, a + b)
+		MCALC_ET_BINARY(sub, operator-, a - b)
+		MCALC_ET_BINARY(mul, operator*, a * b)
+		MCALC_ET_BINARY(divide, operator/, a / b)
+		MCALC_ET_BINARY(mod, operator%, mcalc_mod(a, b))
+		MCALC_ET_BINARY(atan2, atan2, ::atan2(a, b))
+		MCALC_ET_BINARY(ncr, ncr, mcalc_ncr(a, b))
+		MCALC_ET_BINARY(npr, npr, mcalc_npr(a, b))
+		MCALC_ET_BINARY(pow, pow, ::pow(a, b))
+		MCALC_ET_BINARY(less, operator<, a < b)
+		MCALC_ET_BINARY(less_equal, operator<=, a <= b)
+		MCALC_ET_BINARY(greater, operator>, a > b)
+		MCALC_ET_BINARY(greater_equal, operator>=, a >= b)
+		MCALC_ET_BINARY(equal, operator==, a == b)
+		MCALC_ET_BINARY(not_equal, operator!=, a != b)
+		#undef MCALC_ET_BINARY
+
+		// if_(c, a, b) for if(c, a, b) and c ? a : b, only evaluating the side taken.
+		template <class C, class A, class B> struct branch {
+			static const int inputs = C::inputs > A::inputs ? (C::inputs > B::inputs ? C::inputs : B::inputs) : (A::inputs > B::inputs ? A::inputs : B::inputs);
+			C c;
+			A a;
+			B b;
+			double operator()(const double *in) const {return c(in) != 0 ? a(in) : b(in);}
+		};
+
+		template <class T> struct lifted {typedef constant type;};
+		template <class E> struct lifted<formula<E> > {typedef E type;};
+
+		template <class C, class A, class B>
+		inline formula<branch<typename lifted<C>::type, typename lifted<A>::type, typename lifted<B>::type> > if_(const C &c, const A &a, const B &b) {
+			formula<branch<typename lifted<C>::type, typename lifted<A>::type, typename lifted<B>::type> > f = {{lift(c).node, lift(a).node, lift(b).node}};
+			return f;
+		}
+
+		// As parsed: a && b is if(a, b != 0, 0), a || b is if(a, 1, b != 0).
+		template <class A, class B> inline formula<branch<A, binary<not_equal_fn, B, constant>, constant> > operator&&(const formula<A> &a, const formula<B> &b) {
+			return if_(a, b != 0.0, 0.0);
+		}
+		template <class A, class B> inline formula<branch<A, constant, binary<not_equal_fn, B, constant> > > operator||(const formula<A> &a, const formula<B> &b) {
+			return if_(a, 1.0, b != 0.0);
+		}
+
+		// The parser's constants, written pi() and e().
+		inline formula<constant> pi() {return lift(3.14159265358979323846);}
+		inline formula<constant> e() {return lift(2.71828182845904523536);}
+	}
+
+	// A fixed formula reads its arguments from inputs[0 .. arity - 1].
+	typedef double (*mcalc_fixed_function)(const double *inputs);
+
+	struct mcalc_fixed_entry {
+		mcalc_fixed_function function;
+		int arity;
+	};
+
+	// Filled while the UDF library is loaded, read-only once statements run.
+	inline std::map<std::string, mcalc_fixed_entry> &mcalc_fixed_registry() {
+		static std::map<std::string, mcalc_fixed_entry> registry;
+		return registry;
+	}
+
+	inline bool mcalc_fixed_define(const char *name, mcalc_fixed_function function, int arity) {
+		mcalc_fixed_entry entry = {function, arity};
+		mcalc_fixed_registry()[name] = entry;
+		return true;
+	}
+
+	// The formula registered as `name`, 0 if there is none.
+	inline const mcalc_fixed_entry *mcalc_fixed_find(const std::string &name) {
+		std::map<std::string, mcalc_fixed_entry>::const_iterator it = mcalc_fixed_registry().find(name);
+		return it == mcalc_fixed_registry().end() ? 0 : &it->second;
+	}
+
+	#define MCALC_FIXED(NAME, ARITY, ...) \
+		double mcalc_fixed_##NAME(const double *inputs) { \
+			using namespace mcalc_et; \
+			static_assert(std::remove_reference<decltype(__VA_ARGS__)>::type::inputs <= (ARITY), "formula " #NAME " reads more than " #ARITY " inputs"); \
+			return (__VA_ARGS__)(inputs); \
+		} \
+		static const bool mcalc_fixed_defined_##NAME = mcalc_fixed_define(#NAME, mcalc_fixed_##NAME, (ARITY));
+#endif
@@ -0,0 +1,47 @@
+#ifndef __MCALC_PROGRAM_H__
+	#define __MCALC_PROGRAM_H__
+
+	#include "evaluation.h"
+
+	/* Flat program: the optimized tree lowered to postfix code for a stack machine.
+	 * The arithmetic operators get their own opcodes, everything else is a call.
+	 * Internal layout, shared by the evaluators of this library. */
+	enum {
+		OP_CONSTANT, OP_VARIABLE, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_NEG, OP_COMMA,
+		OP_STORE, /* Copies the top of the stack to slot `slot`, for a subexpression used again later. */
+		OP_LOAD, /* Pushes slot `slot`. */
+		OP_SELECT, /* Pops c, a, b and pushes c != 0 ? a : b. */
+		OP_JUMP_ZERO, /* Pops c and goes on at `target` when it is 0, for the lazy side of a branch. */
+		OP_JUMP, /* Goes on at `target`, always forward. */
+		OP_CALL0, OP_CLOSURE0 = OP_CALL0 + 8
+	};
+
+	typedef struct mcalc_op {
+		int code;
+		union {int slot; int target;};
+		union {double value; const double *bound; const void *function;};
+		void *context;
+	} mcalc_op;
+
+	struct mcalc_program {
+		int length;
+		int depth; /* Stack entries needed. */
+		int slots; /* Shared subexpression slots needed. */
+		int pure; /* No call has side effects. */
+		int branches; /* Most branches nested in one another. */
+		mcalc_op code[1];
+	};
+
+	/* Functions a program may call, by a number that survives rebuilds instead of their address
+	 * (see blob.c). Append only: the numbers are stored in blobs. */
+	typedef struct mcalc_builtin {
+		const void *function;
+		int arity;
+	} mcalc_builtin;
+	extern const mcalc_builtin mcalc_builtins[];
+	extern const int mcalc_builtin_count;
+
+	/* mcalc_run on a stack of p->depth + p->slots entries, with instruction i reading its
+	 * variable from columns[i][row] when columns[i] is set (see batch.c). */
+	double mcalc_run_row(const mcalc_program *p, double *stack, const double *const *columns, size_t row);
+#endif
@@ -0,0 +1,149 @@
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Enough stripes that a busy server's threads seldom share one. */
+#define STRIPES 16
+/* Bucket b counts latencies in [2^b, 2^(b+1)) ns, the last one everything above. */
+#define BUCKETS 40
+
+typedef struct stripe {
+	unsigned long long counters[MCALC_STAT_COUNTERS];
+	unsigned long long count[MCALC_PHASES];
+	unsigned long long total[MCALC_PHASES]; /* ns */
+	unsigned long long histogram[MCALC_PHASES][BUCKETS];
+} __attribute__((aligned(64))) stripe;
+
+static stripe stripes[STRIPES];
+static unsigned next_stripe;
+static __thread int own_stripe = -1;
+static __thread unsigned rows; /* Not yet added to MCALC_STAT_EVALS. */
+
+int mcalc_stats_enabled;
+
+static const char *counter_names[MCALC_STAT_COUNTERS] = {
+	"compiles", "parse_errors", "nodes", "evals", "cache_hits", "cache_misses",
+	"memo_hits", "memo_misses"
+};
+
+static const char *phase_names[MCALC_PHASES] = {
+	"parse", "optimize", "assemble", "eval"
+};
+
+__attribute__((constructor)) static void stats_from_environment(void) {
+	const char *env = getenv("MCALC_STATS");
+	if (env && *env && strcmp(env, "0") != 0) mcalc_stats_enable(1);
+}
+
+static stripe *current(void) {
+	if (own_stripe < 0) own_stripe = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED) % STRIPES;
+	return &stripes[own_stripe];
+}
+
+static void add(unsigned long long *counter, unsigned long long n) {
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static unsigned long long load(const unsigned long long *counter) {
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void mcalc_stats_enable(int on) {
+	__atomic_store_n(&mcalc_stats_enabled, on != 0, __ATOMIC_RELAXED);
+}
+
+void mcalc_stats_clear(void) {
+	int i;
+	for (i = 0; i < STRIPES; i++) {
+		unsigned long long *word = (unsigned long long *)&stripes[i];
+		size_t j;
+		for (j = 0; j < sizeof(stripe) / sizeof(*word); j++) __atomic_store_n(&word[j], 0, __ATOMIC_RELAXED);
+	}
+}
+
+void mcalc_stats_count(mcalc_counter counter, unsigned long long n) {
+	add(&current()->counters[counter], n);
+}
+
+unsigned long long mcalc_stats_clock(void) {
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+	timespec_get(&ts, TIME_UTC);
+#endif
+	return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void mcalc_stats_time(mcalc_phase phase, unsigned long long start) {
+	const unsigned long long ns = mcalc_stats_clock() - start;
+	stripe *s = current();
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (bucket >= BUCKETS) bucket = BUCKETS - 1;
+	add(&s->count[phase], 1);
+	add(&s->total[phase], ns);
+	add(&s->histogram[phase][bucket], 1);
+}
+
+int mcalc_stats_row(void) {
+	if (++rows < MCALC_STATS_SAMPLE) return 0;
+	add(&current()->counters[MCALC_STAT_EVALS], rows);
+	rows = 0;
+	return 1;
+}
+
+void mcalc_stats_flush(void) {
+	if (!rows) return;
+	add(&current()->counters[MCALC_STAT_EVALS], rows);
+	rows = 0;
+}
+
+/* Upper bound in ns of the bucket holding the given quantile. */
+static unsigned long long quantile(const unsigned long long *histogram, unsigned long long count, double q) {
+	unsigned long long seen = 0;
+	int b;
+	for (b = 0; b < BUCKETS; b++) {
+		seen += histogram[b];
+		if (seen && seen >= q * count) return 2ull << b;
+	}
+	return 0;
+}
+
+#define APPEND(...) (written += snprintf(buffer + (written < size ? written : size), written < size ? size - written : 0, __VA_ARGS__))
+
+size_t mcalc_stats_json(char *buffer, size_t size) {
+	unsigned long long counters[MCALC_STAT_COUNTERS] = {0};
+	unsigned long long count[MCALC_PHASES] = {0}, total[MCALC_PHASES] = {0};
+	unsigned long long histogram[MCALC_PHASES][BUCKETS];
+	size_t written = 0;
+	int i, p, b;
+	memset(histogram, 0, sizeof(histogram));
+	for (i = 0; i < STRIPES; i++) {
+		const stripe *s = &stripes[i];
+		for (p = 0; p < MCALC_STAT_COUNTERS; p++) counters[p] += load(&s->counters[p]);
+		for (p = 0; p < MCALC_PHASES; p++) {
+			count[p] += load(&s->count[p]);
+			total[p] += load(&s->total[p]);
+			for (b = 0; b < BUCKETS; b++) histogram[p][b] += load(&s->histogram[p][b]);
+		}
+	}
+	APPEND("{\"enabled\":%s", mcalc_stats_enabled ? "true" : "false");
+	for (p = 0; p < MCALC_STAT_COUNTERS; p++) APPEND(",\"%s\":%llu", counter_names[p], counters[p]);
+	APPEND(",\"eval_sample\":%d,\"phases\":{", MCALC_STATS_SAMPLE);
+	for (p = 0; p < MCALC_PHASES; p++) {
+		APPEND("%s\"%s\":{\"count\":%llu,\"total_ns\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,\"histogram\":[",
+			p ? "," : "", phase_names[p], count[p], total[p],
+			quantile(histogram[p], count[p], 0.5), quantile(histogram[p], count[p], 0.99));
+		int first = 1;
+		for (b = 0; b < BUCKETS; b++) {
+			if (!histogram[p][b]) continue;
+			APPEND("%s[%llu,%llu]", first ? "" : ",", 2ull << b, histogram[p][b]);
+			first = 0;
+		}
+		APPEND("]}");
+	}
+	APPEND("}}");
+	return written;
+}
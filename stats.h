@@ -0,0 +1,65 @@
+#ifndef __MCALC_STATS_H__
+	#define __MCALC_STATS_H__
+
+	#include <stddef.h>
+
+	#ifdef __cplusplus
+	extern "C" {
+	#endif
+
+	/*
+	** Process-wide counters and latency histograms, off by default.
+	** Updates go to one of a few cache-line sized stripes picked per thread and
+	** are summed on read, so connection threads rarely share a line. While the
+	** statistics are off every probe is a single relaxed load and a branch.
+	*/
+
+	typedef enum mcalc_counter {
+		MCALC_STAT_COMPILES, /* Formulas compiled, including failed ones. */
+		MCALC_STAT_PARSE_ERRORS,
+		MCALC_STAT_NODES, /* Tree nodes allocated by the parser and the optimizer. */
+		MCALC_STAT_EVALS, /* Rows evaluated by the UDFs, added MCALC_STATS_SAMPLE at a time. */
+		MCALC_STAT_CACHE_HITS,
+		MCALC_STAT_CACHE_MISSES,
+		MCALC_STAT_MEMO_HITS, /* Rows answered by mcalc_memo()'s result cache. */
+		MCALC_STAT_MEMO_MISSES,
+		MCALC_STAT_COUNTERS
+	} mcalc_counter;
+
+	typedef enum mcalc_phase {
+		MCALC_PHASE_PARSE,
+		MCALC_PHASE_OPTIMIZE,
+		MCALC_PHASE_ASSEMBLE,
+		MCALC_PHASE_EVAL, /* Sampled, one row out of MCALC_STATS_SAMPLE. */
+		MCALC_PHASES
+	} mcalc_phase;
+
+	#define MCALC_STATS_SAMPLE 64
+
+	extern int mcalc_stats_enabled;
+
+	#define MCALC_STATS_ON() __builtin_expect(__atomic_load_n(&mcalc_stats_enabled, __ATOMIC_RELAXED), 0)
+
+	/* MCALC_STATS=1 in the environment of mysqld turns the statistics on at load. */
+	void mcalc_stats_enable(int on);
+	void mcalc_stats_clear(void);
+
+	void mcalc_stats_count(mcalc_counter counter, unsigned long long n);
+
+	/* Monotonic time in ns, for the start of a phase passed to mcalc_stats_time. */
+	unsigned long long mcalc_stats_clock(void);
+	void mcalc_stats_time(mcalc_phase phase, unsigned long long start);
+
+	/* Counts a row evaluated by the calling thread, true on every MCALC_STATS_SAMPLE-th
+	 * one, which should then be timed. Rows are added to MCALC_STAT_EVALS in batches. */
+	int mcalc_stats_row(void);
+	/* Adds the rows mcalc_stats_row hasn't yet, at the end of a statement. */
+	void mcalc_stats_flush(void);
+
+	/* Writes the merged statistics as JSON like snprintf, returns the full length. */
+	size_t mcalc_stats_json(char *buffer, size_t size);
+
+	#ifdef __cplusplus
+	}
+	#endif
+#endif
@@ -0,0 +1,40 @@
+/*
+** The part of the server's mysql.h that mcalc.cc uses, enough to build the
+** UDFs into a program and call them without a MySQL server (see bench_udf.cc).
+** Layout follows MySQL 8's mysql/udf_registration_types.h.
+*/
+
+#ifndef __MCALC_UDF_STUB_MYSQL_H__
+	#define __MCALC_UDF_STUB_MYSQL_H__
+
+	#define MYSQL_ERRMSG_SIZE 512
+
+	enum Item_result {
+		INVALID_RESULT = -1,
+		STRING_RESULT = 0,
+		REAL_RESULT,
+		INT_RESULT,
+		ROW_RESULT,
+		DECIMAL_RESULT
+	};
+
+	typedef struct UDF_ARGS {
+		unsigned int arg_count; /* Number of arguments */
+		enum Item_result *arg_type; /* Type of each argument, writable in _init */
+		char **args; /* Values, 0 for NULL */
+		unsigned long *lengths; /* Length of string arguments */
+		char *maybe_null; /* Whether an argument can be NULL */
+		char **attributes; /* Column names or AS aliases */
+		unsigned long *attribute_lengths;
+		void *extension;
+	} UDF_ARGS;
+
+	typedef struct UDF_INIT {
+		bool maybe_null; /* 1 if the function can return NULL */
+		unsigned int decimals; /* Decimals in the result */
+		unsigned long max_length; /* Maximum length of a string result */
+		char *ptr; /* State kept between calls */
+		bool const_item; /* 1 if the function always returns the same value */
+		void *extension;
+	} UDF_INIT;
+#endif
@@ -0,0 +1,228 @@
+#include "evaluation.h"
+#include "vmath.h"
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+/* The kernels round the same way at every width only if a*b+c is never fused. */
+#if defined(__clang__)
+	#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+	#pragma GCC optimize ("fp-contract=off")
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define MCALC_X86 1
+	#include <immintrin.h>
+#endif
+
+/* x + MAGIC rounds x to an integer, which is then in the low bits of MAGIC_BITS. */
+#define MAGIC 0x1.8p52
+#define MAGIC_BITS 0x4338000000000000ll
+
+/* One row: vectors of one double. */
+typedef double vd1 __attribute__((vector_size(8)));
+typedef int64_t vi1 __attribute__((vector_size(8)));
+typedef uint64_t vu1 __attribute__((vector_size(8)));
+#define LANES 1
+#define VD vd1
+#define VI vi1
+#define VU vu1
+#define NAME(f) f##1
+#define TARGET
+#define ANY(m) ((m)[0])
+#ifdef __FMA__
+	#define FMS(a, b, p) ((vd1){__builtin_fma((a)[0], (b)[0], -(p)[0])})
+#endif
+#include "vmath_lanes.h"
+#undef LANES
+#undef VD
+#undef VI
+#undef VU
+#undef NAME
+#undef TARGET
+#undef ANY
+#undef FMS
+
+#ifdef MCALC_X86
+typedef double vd4 __attribute__((vector_size(32)));
+typedef int64_t vi4 __attribute__((vector_size(32)));
+typedef uint64_t vu4 __attribute__((vector_size(32)));
+#define LANES 4
+#define VD vd4
+#define VI vi4
+#define VU vu4
+#define NAME(f) f##4
+#define TARGET __attribute__((target("avx2,fma")))
+#define ANY(m) _mm256_movemask_pd((__m256d)(m))
+#define FMS(a, b, p) ((vd4)_mm256_fmsub_pd((__m256d)(a), (__m256d)(b), (__m256d)(p)))
+#include "vmath_lanes.h"
+#undef LANES
+#undef VD
+#undef VI
+#undef VU
+#undef NAME
+#undef TARGET
+#undef ANY
+#undef FMS
+#endif
+
+#define SCALAR1(F, KERNEL) double mcalc_vmath_##F(double x) {const vd1 v = {x}; return KERNEL(v)[0];}
+SCALAR1(exp, exp1)
+SCALAR1(log, log1)
+SCALAR1(log10, log101)
+SCALAR1(tan, tan1)
+SCALAR1(sinh, sinh1)
+SCALAR1(cosh, cosh1)
+SCALAR1(tanh, tanh1)
+#undef SCALAR1
+
+double mcalc_vmath_sin(double x) {const vd1 v = {x}; return sincos1(v, 0)[0];}
+double mcalc_vmath_cos(double x) {const vd1 v = {x}; return sincos1(v, 1)[0];}
+double mcalc_vmath_pow(double x, double y) {const vd1 a = {x}, b = {y}; return pow1(a, b)[0];}
+
+/* Columns: 4 rows at a time with AVX2 and FMA, the others through the one-row kernel. */
+#ifdef MCALC_X86
+#define COLUMN1(F, CALL4) \
+	__attribute__((target("avx2,fma"))) static void F##_avx2(double *a, size_t n) { \
+		size_t i = 0; \
+		for (; i + 4 <= n; i += 4) { \
+			vd4 v; \
+			memcpy(&v, a + i, sizeof(v)); \
+			v = CALL4; \
+			memcpy(a + i, &v, sizeof(v)); \
+		} \
+		for (; i < n; i++) a[i] = mcalc_vmath_##F(a[i]); \
+	}
+COLUMN1(exp, exp4(v))
+COLUMN1(log, log4(v))
+COLUMN1(log10, log104(v))
+COLUMN1(sin, sincos4(v, 0))
+COLUMN1(cos, sincos4(v, 1))
+COLUMN1(tan, tan4(v))
+COLUMN1(sinh, sinh4(v))
+COLUMN1(cosh, cosh4(v))
+COLUMN1(tanh, tanh4(v))
+#undef COLUMN1
+
+__attribute__((target("avx2,fma"))) static void pow_avx2(double *a, const double *b, size_t n) {
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		vd4 x, y;
+		memcpy(&x, a + i, sizeof(x));
+		memcpy(&y, b + i, sizeof(y));
+		x = pow4(x, y);
+		memcpy(a + i, &x, sizeof(x));
+	}
+	for (; i < n; i++) a[i] = mcalc_vmath_pow(a[i], b[i]);
+}
+
+/* Exact operations, the same as libm's at any accuracy. */
+#define EXACT1(F, OP) \
+	__attribute__((target("avx2"))) static void F##_avx2(double *a, size_t n) { \
+		size_t i = 0; \
+		for (; i + 4 <= n; i += 4) _mm256_storeu_pd(a + i, OP(_mm256_loadu_pd(a + i))); \
+		for (; i < n; i++) a[i] = F(a[i]); \
+	}
+#define ABS_PD(v) _mm256_andnot_pd(_mm256_set1_pd(-0.0), v)
+EXACT1(sqrt, _mm256_sqrt_pd)
+EXACT1(fabs, ABS_PD)
+EXACT1(floor, _mm256_floor_pd)
+EXACT1(ceil, _mm256_ceil_pd)
+#undef ABS_PD
+#undef EXACT1
+
+static int has_avx2(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+#endif
+
+#define COLUMN1(F) static void F##_rows(double *a, size_t n) {size_t i; for (i = 0; i < n; i++) a[i] = mcalc_vmath_##F(a[i]);}
+COLUMN1(exp)
+COLUMN1(log)
+COLUMN1(log10)
+COLUMN1(sin)
+COLUMN1(cos)
+COLUMN1(tan)
+COLUMN1(sinh)
+COLUMN1(cosh)
+COLUMN1(tanh)
+#undef COLUMN1
+
+static void pow_rows(double *a, const double *b, size_t n) {size_t i; for (i = 0; i < n; i++) a[i] = mcalc_vmath_pow(a[i], b[i]);}
+
+typedef struct replacement {
+	const void *function; /* libm */
+	const void *kernel;
+	int flags; /* Accuracy levels using the kernel. */
+} replacement;
+
+static const replacement replacements[] = {
+	{exp, mcalc_vmath_exp, MCALC_MATH_ULP1 | MCALC_MATH_ULP4},
+	{log, mcalc_vmath_log, MCALC_MATH_ULP1 | MCALC_MATH_ULP4},
+	{sin, mcalc_vmath_sin, MCALC_MATH_ULP1 | MCALC_MATH_ULP4},
+	{cos, mcalc_vmath_cos, MCALC_MATH_ULP1 | MCALC_MATH_ULP4},
+	{pow, mcalc_vmath_pow, MCALC_MATH_ULP4},
+	{log10, mcalc_vmath_log10, MCALC_MATH_ULP4},
+	{tan, mcalc_vmath_tan, MCALC_MATH_ULP4},
+	{sinh, mcalc_vmath_sinh, MCALC_MATH_ULP4},
+	{cosh, mcalc_vmath_cosh, MCALC_MATH_ULP4},
+	{tanh, mcalc_vmath_tanh, MCALC_MATH_ULP4},
+};
+
+const void *mcalc_vmath_function(const void *function, int flags) {
+	size_t i;
+	for (i = 0; i < sizeof(replacements) / sizeof(replacements[0]); i++) {
+		if (replacements[i].function == function) return replacements[i].flags & flags ? replacements[i].kernel : function;
+	}
+	return function;
+}
+
+typedef struct unary_column {
+	const void *function;
+	mcalc_vmath_unary rows, avx2;
+} unary_column;
+
+#ifdef MCALC_X86
+	#define AVX2(F) F##_avx2
+#else
+	#define AVX2(F) 0
+#endif
+
+static const unary_column unary_columns[] = {
+	{mcalc_vmath_exp, exp_rows, AVX2(exp)},
+	{mcalc_vmath_log, log_rows, AVX2(log)},
+	{mcalc_vmath_sin, sin_rows, AVX2(sin)},
+	{mcalc_vmath_cos, cos_rows, AVX2(cos)},
+	{mcalc_vmath_log10, log10_rows, AVX2(log10)},
+	{mcalc_vmath_tan, tan_rows, AVX2(tan)},
+	{mcalc_vmath_sinh, sinh_rows, AVX2(sinh)},
+	{mcalc_vmath_cosh, cosh_rows, AVX2(cosh)},
+	{mcalc_vmath_tanh, tanh_rows, AVX2(tanh)},
+	{sqrt, 0, AVX2(sqrt)},
+	{fabs, 0, AVX2(fabs)},
+	{floor, 0, AVX2(floor)},
+	{ceil, 0, AVX2(ceil)},
+};
+
+mcalc_vmath_unary mcalc_vmath_unary_column(const void *function) {
+	size_t i;
+	for (i = 0; i < sizeof(unary_columns) / sizeof(unary_columns[0]); i++) {
+		if (unary_columns[i].function != function) continue;
+#ifdef MCALC_X86
+		if (has_avx2()) return unary_columns[i].avx2;
+#endif
+		return unary_columns[i].rows;
+	}
+	return 0;
+}
+
+mcalc_vmath_binary mcalc_vmath_binary_column(const void *function) {
+	if (function != (const void*)mcalc_vmath_pow) return 0;
+#ifdef MCALC_X86
+	if (has_avx2()) return pow_avx2;
+#endif
+	return pow_rows;
+}
+#undef AVX2
@@ -0,0 +1,42 @@
+#ifndef __MCALC_VMATH_H__
+	#define __MCALC_VMATH_H__
+
+	#include <stddef.h>
+
+	/* Polynomial kernels of the transcendental builtins, one row at a time or over
+	 * whole columns (AVX2 when the CPU has it). Both give the same bits: the kernels
+	 * don't use FMA, so a formula evaluated by mcalc_eval, mcalc_run, the JIT or
+	 * mcalc_run_batch rounds the same way. Internal, shared by the evaluators. */
+
+	#ifdef __cplusplus
+	extern "C" {
+	#endif
+
+	/* Within 1 ulp, used with MCALC_MATH_ULP1 and MCALC_MATH_ULP4. */
+	double mcalc_vmath_exp(double x);
+	double mcalc_vmath_log(double x);
+	double mcalc_vmath_sin(double x);
+	double mcalc_vmath_cos(double x);
+
+	/* Within 4 ulp, used with MCALC_MATH_ULP4. */
+	double mcalc_vmath_pow(double x, double y);
+	double mcalc_vmath_log10(double x);
+	double mcalc_vmath_tan(double x);
+	double mcalc_vmath_sinh(double x);
+	double mcalc_vmath_cosh(double x);
+	double mcalc_vmath_tanh(double x);
+
+	/* The kernel computing `function` (a libm builtin) at the accuracy of `flags`, or `function`. */
+	const void *mcalc_vmath_function(const void *function, int flags);
+
+	/* a[i] = f(a[i]) and a[i] = f(a[i], b[i]) for the function `function`, or 0 when it has
+	 * no column kernel. Besides the kernels above, sqrt, fabs, floor and ceil have one. */
+	typedef void (*mcalc_vmath_unary)(double *a, size_t n);
+	typedef void (*mcalc_vmath_binary)(double *a, const double *b, size_t n);
+	mcalc_vmath_unary mcalc_vmath_unary_column(const void *function);
+	mcalc_vmath_binary mcalc_vmath_binary_column(const void *function);
+
+	#ifdef __cplusplus
+	}
+	#endif
+#endif
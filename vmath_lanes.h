@@ -0,0 +1,249 @@
+/* Kernels of vmath.c written once for any vector width. vmath.c includes this file
+ * once per width, defining
+ *   LANES      doubles per vector
+ *   VD, VI, VU GCC vectors of LANES doubles, int64_t and uint64_t (for wrapping bit arithmetic)
+ *   NAME(f)    the name of f at this width
+ *   TARGET     attributes of the functions at this width
+ *   ANY(m)     whether a lane of the comparison mask m is set
+ *   FMS(a, b, p)  a*b - p with one rounding, when the width has FMA
+ * The algorithms and constants are those of fdlibm (e_exp.c, e_log.c, e_log10.c,
+ * e_rem_pio2.c, k_sin.c, k_cos.c) made branch free. Lanes outside the domain a
+ * kernel handles (NaN, infinities, overflow, subnormals, huge angles) are redone
+ * with libm one by one. */
+
+#define SELECT(m, a, b) ((VD)(((m) & (VI)(a)) | (~(m) & (VI)(b))))
+#define FALLBACK(m, r, call) do { \
+		if (ANY(m)) { \
+			int l; \
+			for (l = 0; l < LANES; l++) if ((m)[l]) (r)[l] = call; \
+		} \
+	} while (0)
+
+TARGET static inline VD NAME(vabs)(VD x) {return (VD)((VI)x & 0x7fffffffffffffff);}
+
+TARGET static inline VD NAME(sign)(VD x) {return (VD)((VI)x & (int64_t)0x8000000000000000ull);}
+
+/* k as a double, for |k| < 2^51 */
+TARGET static inline VD NAME(to_double)(VI k) {return (VD)(k + MAGIC_BITS) - MAGIC;}
+
+/* x = 2^k m, sqrt(2)/2 <= m < sqrt(2), for normal positive x. */
+TARGET static inline VD NAME(split_exponent)(VD x, VD *dk) {
+	const VI bits = (VI)x;
+	VD m = (VD)((bits & 0x000fffffffffffff) | 0x3ff0000000000000);
+	const VI big = m > 1.41421356237309504880;
+	m = SELECT(big, m * 0.5, m);
+	*dk = NAME(to_double)(((bits >> 52) & 0x7ff) - 1023 - big);
+	return m;
+}
+
+/* log(1 + f) - f + f*f/2 = s*(f*f/2 + R), s = f/(2 + f), R as in e_log.c */
+TARGET static inline VD NAME(log_r)(VD s) {
+	const VD z = s * s, w = z * z;
+	return z * (6.666666666666735130e-01 + w * (2.857142874366239149e-01 + w * (1.818357216161805012e-01 + w * 1.479819860511658591e-01)))
+		+ w * (3.999999999940941908e-01 + w * (2.222219843214978396e-01 + w * 1.531383769920937332e-01));
+}
+
+/* exp(x + tail) for |x| <= 708 and a tail well below ulp(x). */
+TARGET static inline VD NAME(exp_core)(VD x, VD tail) {
+	const VD t = x * 1.44269504088896338700e+00 + MAGIC;
+	const VD k = t - MAGIC;
+	const VD hi = x - k * 6.93147180369123816490e-01;
+	const VD lo = k * 1.90821492927058770002e-10 - tail;
+	const VD r = hi - lo;
+	const VD z = r * r;
+	const VD c = r - z * (1.66666666666666019037e-01 + z * (-2.77777777770155933842e-03 + z * (6.61375632143793436117e-05
+		+ z * (-1.65339022054652515390e-06 + z * 4.13813679705723846039e-08))));
+	const VD y = 1.0 - ((lo - (r * c) / (2.0 - c)) - hi);
+	return (VD)((VU)y + (((VU)t - MAGIC_BITS) << 52));
+}
+
+TARGET static inline VD NAME(exp)(VD x) {
+	VD r = NAME(exp_core)(x, (VD){0});
+	const VI out = ~(NAME(vabs)(x) <= 708.0);
+	FALLBACK(out, r, exp(x[l]));
+	return r;
+}
+
+TARGET static inline VD NAME(log)(VD x) {
+	VD dk;
+	const VD f = NAME(split_exponent)(x, &dk) - 1.0;
+	const VD hfsq = 0.5 * f * f;
+	const VD s = f / (2.0 + f);
+	VD r = dk * 6.93147180369123816490e-01 - ((hfsq - (s * (hfsq + NAME(log_r)(s)) + dk * 1.90821492927058770002e-10)) - f);
+	const VI out = ~((x >= 2.2250738585072014e-308) & (x < INFINITY));
+	FALLBACK(out, r, log(x[l]));
+	return r;
+}
+
+TARGET static inline VD NAME(log10)(VD x) {
+	VD dk;
+	const VD f = NAME(split_exponent)(x, &dk) - 1.0;
+	const VD hfsq = 0.5 * f * f;
+	const VD s = f / (2.0 + f);
+	const VD logm = f - (hfsq - s * (hfsq + NAME(log_r)(s)));
+	VD r = dk * 3.01029995663611771306e-01 + (dk * 3.69423907715893078616e-13 + logm * 4.34294481903251816668e-01);
+	const VI out = ~((x >= 2.2250738585072014e-308) & (x < INFINITY));
+	FALLBACK(out, r, log10(x[l]));
+	return r;
+}
+
+/* a*b = p + *error exactly, for |a|, |b| below 2^996. The error is the same with FMA
+ * or without (Dekker), so this is the one place where the kernels may fuse. */
+TARGET static inline VD NAME(two_product)(VD a, VD b, VD *error) {
+	const VD p = a * b;
+#ifdef FMS
+	*error = FMS(a, b, p);
+#else
+	const VD ca = a * 134217729.0, cb = b * 134217729.0;
+	const VD ah = ca - (ca - a), bh = cb - (cb - b);
+	const VD al = a - ah, bl = b - bh;
+	*error = ((ah * bh - p) + ah * bl + al * bh) + al * bl;
+#endif
+	return p;
+}
+
+/* exp(y log(x)), with log(x) and the product carried in double-double. */
+TARGET static inline VD NAME(pow)(VD x, VD y) {
+	VD dk, error;
+	const VD f = NAME(split_exponent)(x, &dk) - 1.0;
+	const VD u = 2.0 + f;
+	const VD ul = f - (u - 2.0); /* u + ul = 2 + f */
+	const VD s = f / u;
+	const VD p = NAME(two_product)(s, u, &error);
+	const VD sl = (((f - p) - error) - s * ul) / u; /* s + sl = f/(2 + f) */
+	/* log(x) = k ln2 + 2 atanh(s) = k ln2 + 2s + 2s^3/3 + 2s^5/5 + ..., the first three
+	 * terms in double-double. The rest is below 2^-12 of the result, z^12/25 < 2^-65. */
+	VD zl, cl, tl;
+	const VD z = NAME(two_product)(s, s, &zl);
+	const VD c = NAME(two_product)(s, z, &cl); /* s^3 */
+	const VD t = NAME(two_product)(c, (VD){0} + 0.66666666666666663, &tl); /* 2s^3/3 */
+	const VD rest = s * z * z * (2.0 / 5 + z * (2.0 / 7 + z * (2.0 / 9 + z * (2.0 / 11 + z * (2.0 / 13 + z * (2.0 / 15
+		+ z * (2.0 / 17 + z * (2.0 / 19 + z * (2.0 / 21 + z * (2.0 / 23))))))))));
+	const VD a = dk * 6.93147180369123816490e-01, b = 2.0 * s;
+	const VD h = a + b, bb = h - a;
+	const VD h2 = h + t;
+	const VD lo = ((a - (h - bb)) + (b - bb)) + (t - (h2 - h)) + (tl + (cl + s * zl) * 0.66666666666666663 + c * 3.7007434154171883e-17)
+		+ (2.0 * sl + 2.0 * z * sl + rest + dk * 1.90821492927058770002e-10);
+	const VD lh = h2 + lo, ll = lo - (lh - h2);
+	const VD q = NAME(two_product)(y, lh, &error);
+	const VD ql = error + y * ll;
+	const VD qh = q + ql;
+	VD r = NAME(exp_core)(qh, ql - (qh - q));
+	const VI out = ~((x >= 2.2250738585072014e-308) & (x < INFINITY) & (NAME(vabs)(y) < INFINITY) & (NAME(vabs)(qh) <= 708.0));
+	FALLBACK(out, r, pow(x[l], y[l]));
+	return r;
+}
+
+/* x - n pi/2 = *y0 + *y1 with |*y0| <= pi/4, for |x| <= 2^20 pi/2. Returns n. */
+TARGET static inline VI NAME(reduce)(VD x, VD *y0, VD *y1) {
+	const VD t = x * 6.36619772367581382433e-01 + MAGIC;
+	const VD n = t - MAGIC;
+	const VI e = ((VI)x >> 52) & 0x7ff;
+	VD r = x - n * 1.57079632673412561417e+00;
+	VD w = n * 6.07710050650619224932e-11;
+	VD y = r - w;
+	/* Cancellation: redo with the next 33 bits of pi/2, then the next. */
+	VI more = e - (((VI)y >> 52) & 0x7ff) > 16;
+	if (ANY(more)) {
+		const VD rr = r - n * 6.07710050630396597660e-11;
+		const VD ww = n * 2.02226624879595063154e-21 - ((r - rr) - n * 6.07710050630396597660e-11);
+		r = SELECT(more, rr, r);
+		w = SELECT(more, ww, w);
+		y = r - w;
+		more = e - (((VI)y >> 52) & 0x7ff) > 49;
+		if (ANY(more)) {
+			const VD rr = r - n * 2.02226624871116645580e-21;
+			const VD ww = n * 8.47842766036889956997e-32 - ((r - rr) - n * 2.02226624871116645580e-21);
+			r = SELECT(more, rr, r);
+			w = SELECT(more, ww, w);
+			y = r - w;
+		}
+	}
+	*y0 = y;
+	*y1 = (r - y) - w;
+	return (VI)t - MAGIC_BITS;
+}
+
+TARGET static inline VD NAME(sin_kernel)(VD x, VD y) {
+	const VD z = x * x, v = z * x;
+	const VD r = 8.33333333332248946124e-03 + z * (-1.98412698298579493134e-04 + z * (2.75573137070700676789e-06
+		+ z * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10)));
+	return x - ((z * (0.5 * y - v * r) - y) - v * -1.66666666666666324348e-01);
+}
+
+TARGET static inline VD NAME(cos_kernel)(VD x, VD y) {
+	const VD z = x * x, w = z * z;
+	const VD r = z * (4.16666666666666019037e-02 + z * (-1.38888888888741095749e-03 + z * 2.48015872894767294178e-05))
+		+ w * w * (-2.75573143513906633035e-07 + z * (2.08757232129817482790e-09 + z * -1.13596475577881948265e-11));
+	const VD hz = 0.5 * z, v = 1.0 - hz;
+	return v + (((1.0 - v) - hz) + (z * r - x * y));
+}
+
+/* sin (phase 0) or cos (phase 1) */
+TARGET static inline VD NAME(sincos)(VD x, int phase) {
+	VD y0, y1;
+	const VI n = NAME(reduce)(x, &y0, &y1) + phase;
+	const VD s = NAME(sin_kernel)(y0, y1), c = NAME(cos_kernel)(y0, y1);
+	VD r = SELECT(-(n & 1), c, s);
+	r = (VD)((VU)r ^ ((VU)(n & 2) << 62));
+	const VI out = ~(NAME(vabs)(x) <= 1.6e6);
+	if (phase) FALLBACK(out, r, cos(x[l]));
+	else FALLBACK(out, r, sin(x[l]));
+	return r;
+}
+
+TARGET static inline VD NAME(tan)(VD x) {
+	VD y0, y1;
+	const VI n = NAME(reduce)(x, &y0, &y1);
+	const VD s = NAME(sin_kernel)(y0, y1), c = NAME(cos_kernel)(y0, y1);
+	VD r = SELECT(-(n & 1), -c / s, s / c);
+	const VI out = ~(NAME(vabs)(x) <= 1.6e6);
+	FALLBACK(out, r, tan(x[l]));
+	return r;
+}
+
+/* sinh(x) - x and cosh(x) - 1 by their series, for |x| < 0.5 */
+TARGET static inline VD NAME(sinh_series)(VD x) {
+	const VD z = x * x;
+	return x * z * (1.0 / 6 + z * (1.0 / 120 + z * (1.0 / 5040 + z * (1.0 / 362880 + z * (1.0 / 39916800
+		+ z * (1.0 / 6227020800 + z * (1.0 / 1307674368000)))))));
+}
+
+TARGET static inline VD NAME(cosh_series)(VD x) {
+	const VD z = x * x;
+	return z * (1.0 / 2 + z * (1.0 / 24 + z * (1.0 / 720 + z * (1.0 / 40320 + z * (1.0 / 3628800
+		+ z * (1.0 / 479001600 + z * (1.0 / 87178291200)))))));
+}
+
+TARGET static inline VD NAME(sinh)(VD x) {
+	const VD a = NAME(vabs)(x);
+	const VD t = NAME(exp_core)(a, (VD){0});
+	const VD large = (VD)((VI)(0.5 * t - 0.5 / t) | (VI)NAME(sign)(x));
+	VD r = SELECT(a < 0.5, x + NAME(sinh_series)(x), large);
+	const VI out = ~(a <= 708.0);
+	FALLBACK(out, r, sinh(x[l]));
+	return r;
+}
+
+TARGET static inline VD NAME(cosh)(VD x) {
+	const VD a = NAME(vabs)(x);
+	const VD t = NAME(exp_core)(a, (VD){0});
+	VD r = 0.5 * t + 0.5 / t;
+	const VI out = ~(a <= 708.0);
+	FALLBACK(out, r, cosh(x[l]));
+	return r;
+}
+
+TARGET static inline VD NAME(tanh)(VD x) {
+	/* tanh(20) rounds to 1. */
+	const VD a = SELECT(NAME(vabs)(x) < 20.0, NAME(vabs)(x), (VD){0} + 20.0);
+	const VD small = (a + NAME(sinh_series)(a)) / (1.0 + NAME(cosh_series)(a));
+	const VD large = 1.0 - 2.0 / (NAME(exp_core)(2.0 * a, (VD){0}) + 1.0);
+	VD r = (VD)((VI)SELECT(a < 0.5, small, large) | (VI)NAME(sign)(x));
+	const VI out = x != x;
+	FALLBACK(out, r, tanh(x[l]));
+	return r;
+}
+
+#undef SELECT
+#undef FALLBACK